@@ -1,27 +1,187 @@
+#define _DEFAULT_SOURCE     // mmap flags and other POSIX extensions under -std=c17
+
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
 
+// Dynamic recompiler backends
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_X86_64
+#elif defined(__aarch64__) && !defined(_WIN32)
+#define JIT_AARCH64
+#endif
+#if defined(JIT_X86_64) || defined(JIT_AARCH64)
+#define HAVE_JIT
+#include <sys/mman.h>
+#if defined(__APPLE__) && defined(JIT_AARCH64)
+#include <pthread.h>
+#endif
+#endif
+
+// ROM library directories (--library)
+#ifndef _WIN32
+#define HAVE_LIBRARY
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef TRACE
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+// Frame streams to files, pipes and TCP sockets (--stream)
+#ifndef _WIN32
+#define HAVE_STREAM
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// Session server (--serve), one epoll loop for every socket
+#ifdef __linux__
+#define HAVE_SERVER
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#endif
+
 #include "SDL.h"
+#include "SDL_opengl.h"
+
+// Beeper played from the SDL audio callback. The callback only reads gate and wave and
+// writes phase and gain, which nothing else touches, so it never locks or allocates
+#define BEEPER_HZ 440               // beep pitch
+#define BEEPER_WAVE 256             // samples in the wavetable, one period
+typedef struct{
+    SDL_atomic_t gate;              // sound_timer > 0, published by update_timers
+    uint32_t phase;                 // position in wave, the top 8 bits index it
+    uint32_t step;                  // phase advance per output sample
+    int32_t gain;                   // 0 to 256, follows the gate in short ramps so edges do not click
+    int16_t wave[BEEPER_WAVE];      // one band-limited square wave period at the configured volume
+} beeper_t;
+
+typedef struct gl_renderer gl_renderer_t;
 
 // SDL Container object
 typedef struct {
     SDL_Window *window;
     SDL_Renderer *renderer;
+    SDL_Texture *texture;   // streaming display texture, NULL when using the rect renderer
+    gl_renderer_t *gl;      // OpenGL shader renderer, renderer and texture are NULL when it runs
+    SDL_Rect *outlines[2];  // pixel outline grids drawn on top of the texture, lo-res and hi-res
+    int outline_count[2];   // number of rects in outlines
+    bool vsync;             // presents block until the display refreshes
+    uint32_t refresh_rate;  // display refresh rate in Hz, 60 when unknown
+    SDL_AudioDeviceID audio_device; // 0 when running silent
+    beeper_t *beeper;       // state shared with the audio callback
 } sdl_t;
 
+// Renderer backends
+typedef enum{
+    RENDER_TEXTURE,     // expand the display into a streaming texture and let the GPU scale it
+    RENDER_RECTS,       // draw one filled rect per CHIP8 pixel (fallback)
+    RENDER_GL,          // upload the 1-bit display and scale it in an OpenGL fragment shader
+} render_mode_t;
+
+// CPU cores
+typedef enum{
+    CPU_INTERPRETER,    // reference fetch/decode/execute interpreter
+    CPU_PREDECODED,     // pre-decoded instruction cache with threaded dispatch
+    CPU_JIT,            // basic block dynamic recompiler (x86-64 and AArch64)
+} cpu_mode_t;
+
+// Behaviors CHIP8 implementations disagree on, the bits of a quirk profile
+typedef enum{
+    QUIRK_SHIFT_VY = 1 << 0,    // 8XY6/8XYE shift VY into VX instead of shifting VX in place
+    QUIRK_MEMORY_I = 1 << 1,    // FX55/FX65 leave I past the last register they stored or loaded
+    QUIRK_VF_RESET = 1 << 2,    // 8XY1/8XY2/8XY3 clear VF
+    QUIRK_JUMP_VX = 1 << 3,     // BXNN jumps to XNN + VX instead of BNNN to NNN + V0
+    QUIRK_WRAP = 1 << 4,        // DXYN wraps sprites around the display edges instead of clipping them
+    QUIRK_LORES_DXY0 = 1 << 5,  // DXY0 draws a 16x16 sprite in lo-res too, not just in hi-res
+} quirk_t;
+
+// Quirk profiles, picked once per ROM, each runs in an interpreter of its own (see emulate_quirks)
+typedef enum{
+    QUIRKS_CHIP8 = 0,                                               // what this emulator always did, most ROMs expect it
+    QUIRKS_VIP = QUIRK_SHIFT_VY | QUIRK_MEMORY_I | QUIRK_VF_RESET,  // the original COSMAC VIP interpreter
+    QUIRKS_SCHIP = QUIRK_JUMP_VX | QUIRK_LORES_DXY0,                // SUPER-CHIP 1.1
+    QUIRKS_XOCHIP = QUIRK_SHIFT_VY | QUIRK_MEMORY_I | QUIRK_WRAP | QUIRK_LORES_DXY0,   // XO-CHIP as Octo runs it
+} quirks_t;
+
+// Frame pacing for the windowed main loop
+typedef enum{
+    PACING_TIMER,       // sleep/spin to the 60hz emulation clock
+    PACING_VSYNC,       // 60hz emulation clock, presents wait for vsync instead of sleeping
+    PACING_DISPLAY,     // one emulated frame per display refresh, CPU and timers scaled to match
+} pacing_t;
+
+// What the windowed main loop does while its window is out of sight, see in_background
+typedef enum{
+    BACKGROUND_RUN,     // carry on, a minimized or hidden window only stops presenting
+    BACKGROUND_THROTTLE,    // the same once the window loses focus too, and wake up once a frame
+    BACKGROUND_PAUSE,   // stop emulating until the window is back in front
+} background_t;
+
 // Configuration object
 typedef struct {
     uint32_t window_width;  // SDL window width
     uint32_t window_height; // SDL window height
     uint32_t fg_color;      // Foreground color RGBA8888
     uint32_t bg_color;      // Background color RGBA8888
+    uint32_t plane2_color;  // XO-CHIP pixels lit only in the second plane RGBA8888
+    uint32_t both_color;    // XO-CHIP pixels lit in both planes RGBA8888
     uint32_t scale_factor;  // Amount to scale a CHIP8 pixel by e.g. 20x will be a 20x larger window
     bool pixel_outlines;    // Draw pixel outlines
     uint32_t clock_speed;   // CHIP8 clock speed in Hz or number of instructions to execute per second
+    render_mode_t render_mode; // Renderer backend used by redraw_screen
+    uint32_t persistence;   // GL renderer: percent of its brightness a pixel keeps per frame after it goes dark
+    cpu_mode_t cpu_mode;    // CPU core used to run instructions
+    quirks_t quirks;        // quirk profile the ROM runs with
+    bool headless;          // Run without SDL video, uncapped, and report throughput
+    uint64_t max_instructions; // Headless: stop after this many instructions, 0 = no limit
+    uint64_t max_frames;    // Headless: stop after this many 60hz frames, 0 = no limit
+    uint32_t batch_size;    // Batch: number of instances to run, 0 = single instance
+    uint32_t threads;       // Batch: worker threads, 0 = one per CPU core
+    bool lockstep;          // Batch: step groups of instances together in vector lanes
+    pacing_t pacing;        // main loop frame pacing
+    background_t background;    // main loop policy for a minimized, hidden or unfocused window
+    bool emu_thread;        // emulate on a thread of its own, the main thread only handles SDL
+    bool turbo;             // start fast-forwarding, Tab toggles it
+    uint32_t run_ahead;     // frames emulated past the current one for each present, 0 = none
+    uint32_t turbo_speed;   // fast-forward speed as a multiple of real time, 0 = uncapped
+    uint32_t volume;        // beeper volume in percent, 0 = no audio device
+    bool idle_skip;         // fast-forward through loops that wait for the next frame
+    bool rewind;            // record a rewind history, hold backspace to step back through it
+    uint32_t seed;          // CXNN seed, batch instance i uses seed + i
+    const char *record;     // keypad log file to record the session into, NULL = none
+    const char *replay;     // keypad log file to replay headless, NULL = none
+    const char *profile;    // profiling builds: file the counters are written to at exit
+    const char *bench;      // benchmark builds: file the results are written to
+    bool decode_trace;      // tracing builds: print the trace file given instead of a ROM
+    bool library;           // the file argument is a directory of ROMs to index, and batch with --batch
+    bool input_latency;     // print key press to display change latency at exit
+    const char *stream;     // frame stream target: a file, - for stdout or tcp:HOST:PORT, NULL = none
+    bool play_stream;       // the file argument is a frame stream to show instead of a ROM
+    uint16_t serve_port;    // serve sessions of the ROM on this TCP port, 0 = no server
+    uint32_t max_sessions;  // server: sessions open at once, more connections are turned away
+    uint32_t fuzz;          // differential fuzzing: cases to run, 0 = no fuzzing
+    bool analyze;           // statically analyze the ROM at load, see analyze_code
+    bool print_cfg;         // print the ROM's control-flow graph and RAM map instead of running it
 } config_t;
 
 // Emulator states
@@ -41,49 +201,651 @@ typedef struct{
     uint8_t Y;      // 4 bit register identifier
 } instruction_t;
 
+// Pre-decoded instruction handlers, see run_predecoded
+typedef enum{
+    OP_DECODE,          // not decoded yet (or invalidated by a RAM write)
+    OP_SLOW,            // rare opcode, handed to emulate_chip8
+    OP_NOP,             // unimplemented opcode, does nothing
+    OP_00E0, OP_00EE, OP_1NNN, OP_2NNN, OP_3XNN, OP_4XNN, OP_5XY0, OP_6XNN, OP_7XNN,
+    OP_8XY0, OP_8XY1, OP_8XY2, OP_8XY3, OP_8XY4, OP_8XY5, OP_8XY6, OP_8XY7, OP_8XYE,
+    OP_9XY0, OP_ANNN, OP_BNNN, OP_CXNN, OP_DXYN, OP_EX9E, OP_EXA1,
+    OP_FX07, OP_FX15, OP_FX18, OP_FX1E, OP_FX29,
+    // quirk variants, picked by decode_instruction from the machine's profile
+    OP_8XY1_VF, OP_8XY2_VF, OP_8XY3_VF, OP_8XY6_VY, OP_8XYE_VY, OP_BXNN, OP_DXYN_WRAP,
+    OP_COUNT,
+} handler_t;
+
+// Pre-decoded instruction, one per even RAM address
+typedef struct{
+    uint8_t handler;    // handler_t to dispatch to
+    uint8_t X;          // 4 bit register identifier
+    uint8_t Y;          // 4 bit register identifier
+    uint8_t NN;         // 8 bit constant, N is the low nibble
+    uint16_t NNN;       // 12 bit address/constant
+} decoded_t;
+
+// Dynamic recompiler state, see run_jit
+typedef struct jit jit_t;
+
+// Changed-row frame output, see stream_frame
+typedef struct frame_stream frame_stream_t;
+
+// Region of the display changed since the last redraw, inclusive pixel bounds
+typedef struct{
+    uint8_t x1, y1;     // top left corner
+    uint8_t x2, y2;     // bottom right corner
+} damage_t;
+
+// Emulator hotkeys raised by handle_input for whoever runs the machine
+typedef enum{
+    HOTKEY_SAVE = 1 << 0,   // F5: write the save state file
+    HOTKEY_LOAD = 1 << 1,   // F8: restore the save state file
+    HOTKEY_TRACE = 1 << 2,  // F9: write the trace ring to a file, tracing builds only
+    HOTKEY_TURBO = 1 << 3,  // Tab: toggle fast-forward, see run_turbo_frames
+} hotkey_t;
+
+// Window states handle_input follows for the main loops
+typedef enum{
+    WINDOW_HIDDEN = 1 << 0,     // minimized or hidden, nothing presented is seen
+    WINDOW_UNFOCUSED = 1 << 1,  // another window has the keyboard
+} window_t;
+
+// Keypad change seen by handle_input, waiting for the scheduler to reach its cycle
+typedef struct{
+    uint64_t time;          // performance counter when SDL saw the event
+    uint16_t keys;          // keypad mask from then on
+} key_event_t;
+
+#define KEY_QUEUE 32        // pending keypad changes, the oldest is dropped when full
+
+// Key press to display change latency, see measure_latency
+typedef struct{
+    uint64_t since;         // performance counter of the press being timed, 0 = none
+    uint64_t shown;         // display hash when it was pressed
+    uint64_t samples;       // presses timed
+    uint64_t total;         // sum of their latencies, in counter ticks
+    uint64_t min, max;
+} latency_t;
+
+// Machine state at the last backward jump, see idle_skip
+typedef struct{
+    uint16_t PC;            // jump target, 0xFFFF when nothing was seen yet this run
+    uint16_t I;
+    uint8_t V[16];
+    uint16_t stack[12];
+    uint8_t sp;             // stack depth
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint32_t rng;
+    uint32_t effects;       // chip8_t.effects at the jump
+    uint64_t left;          // instructions left in the run at the jump
+    uint64_t skipped;       // instructions fast-forwarded so far, for the headless report
+    uint8_t countdown;      // backward jumps until the next sample
+} idle_t;
+
+// Only every IDLE_SAMPLE-th backward jump is compared, an idle loop still matches
+// itself IDLE_SAMPLE passes later while busy loops pay for one compare in that many
+#define IDLE_SAMPLE 16
+
+#ifdef PROFILE
+// Execution counters of a profiling build (make profile), see write_profile
+typedef struct{
+    uint64_t opcodes[16][256];  // by top nibble, then N for 8XYN and NN for 0NNN/EXNN/FXNN
+    uint64_t pcs[4096];         // instructions fetched at each address
+    uint64_t sprite_rows[16];   // DXYN count by N
+    uint64_t emulate_ticks;     // performance counter ticks spent in run_chip8
+    uint64_t redraw_ticks;      // and in redraw_screen
+} profile_t;
+#endif
+
+#ifdef TRACE
+// One executed instruction and what it left in the registers it may have written
+typedef struct{
+    uint64_t cycle;         // instructions into the run, idle skipped ones included
+    uint16_t PC;
+    uint16_t opcode;
+    uint16_t I;
+    uint8_t VX;
+    uint8_t VF;
+} trace_record_t;
+
+#define TRACE_RECORDS (1 << 16)     // a megabyte of history, must be a power of two
+#define TRACE_MAGIC 0x52543843      // "C8TR" little endian
+#define TRACE_VERSION 1
+
+// Binary trace of a tracing build (make trace), written with plain stores so tracing
+// keeps the timing of the run it is watching, see flush_trace
+typedef struct{
+    uint64_t cycle;         // next record's cycle
+    uint64_t count;         // records ever written, the ring keeps the last TRACE_RECORDS
+    char file[1024];        // flush target, formatted up front for the crash handler
+    trace_record_t records[TRACE_RECORDS];
+} trace_t;
+#endif
+
+// Display buffer, big enough for SUPER-CHIP hi-res and the two XO-CHIP bit planes
+#define DISPLAY_PLANES 2
+#define DISPLAY_ROWS 64     // hi-res height, lo-res uses the top 32 rows
+#define DISPLAY_WORDS 2     // 64 pixel words per row, lo-res uses the first
+
+#define CACHE_LINE 64       // host cache line, chip8_t keeps its registers on one
+
 // CHIP8 Machine object
+// Plain data without pointers into itself, so a machine can be copied or moved with memcpy
+// The registers every instruction touches share the first cache line, the state touched
+// once a frame or on rarer opcodes the next, then RAM and the display start on lines of their own
 typedef struct{
-    emulator_state_t state;
-    uint8_t ram[4096];      // 4KB of RAM
-    bool display[64*32];    // 64x32 pixel display
-    uint16_t stack[12];     // subroutine stack
-    uint16_t *stack_ptr;      // stack pointer
-    uint8_t V[16];          // 16 8-bit registers
+    _Alignas(CACHE_LINE) uint8_t V[16];     // 16 8-bit registers
     uint16_t PC;            // 16-bit program counter supposed to be 12-bit
     uint16_t I;             // 16-bit index register supposed to be 12-bit
+    uint16_t stack[12];     // subroutine stack
+    uint8_t sp;             // stack depth, stack[sp] is where 2NNN pushes next
+    uint8_t quirks;         // quirks_t profile, set once the ROM is loaded
     uint8_t delay_timer;    // delay timer deccrements at 60hz when >0
     uint8_t sound_timer;    // sound timer decrements at 60hz and plays tone when >0
-    bool keypad[16];        // hexadecimal keypad 0x0-0xF
-    const char *rom_name;   // current ROM name
+    uint16_t keypad;        // hexadecimal keypad 0x0-0xF, bit n = key n held
     instruction_t inst;     // current instruction
+    bool hires;             // 128x64 SUPER-CHIP resolution, 00FF/00FE switch it
+    uint8_t planes;         // planes DXYN, 00E0 and scrolls draw to, bit p = plane p, set by FN01
     bool draw ;             // update the screen yes/no
+
+    _Alignas(CACHE_LINE) uint32_t rng;      // xorshift32 state for CXNN, never 0, see seed_random
+    uint32_t effects;       // counts display and RAM writes, see idle_skip
+    uint64_t data_pages;    // 64 byte RAM pages static analysis proved are never run, see analyze_code
+    decoded_t *decoded;     // pre-decoded instruction cache, allocated by the first predecoded run
+    jit_t *jit;             // translated block cache, allocated by the first JIT run
+    bool jit_failed;        // the cache could not be allocated, JIT runs stay pre-decoded
+    damage_t damage;        // damaged display region, only valid while draw is set
+    emulator_state_t state;
+    uint8_t hotkeys;        // hotkey_t bits pressed since the main loop last looked
+    bool rewind_held;       // rewind key is held down
+    uint8_t window;         // window_t bits, set by handle_input
+
+    _Alignas(CACHE_LINE) uint8_t ram[4096]; // 4KB of RAM
+    // 64x32 or 128x64 pixel display, per plane one pair of words per row, MSB of word 0 is
+    // the leftmost pixel. Pixels outside the current resolution are always 0
+    uint64_t display[DISPLAY_PLANES][DISPLAY_ROWS][DISPLAY_WORDS];
+
+    const char *rom_name;   // current ROM name
+    idle_t idle;            // idle loop detection
+    SDL_atomic_t *beeper_gate;  // where update_timers publishes sound_timer > 0, NULL = silent
+    key_event_t key_queue[KEY_QUEUE];   // keypad changes not applied yet, oldest at key_head
+    uint8_t key_head;
+    uint8_t key_count;
+    latency_t latency;      // key press latency, timed by the windowed main loops
+    frame_stream_t *stream; // where every finished frame is written, NULL = not streaming
+#ifdef PROFILE
+    profile_t *profile;     // counters to update, NULL = not profiled
+#endif
+#ifdef TRACE
+    trace_t *trace;         // ring to record into, NULL = not traced
+#endif
 } chip8_t;
 
+_Static_assert(offsetof(chip8_t, draw) < CACHE_LINE, "chip8_t registers must share a cache line");
+
+// Zero filled machines, the cache line alignment of chip8_t is more than calloc promises
+chip8_t *alloc_machines(uint32_t count){
+    chip8_t *machines = aligned_alloc(_Alignof(chip8_t), count * sizeof *machines);
+    if(machines) memset(machines, 0, count * sizeof *machines);
+    return machines;
+}
+
+#ifdef HAVE_JIT
+void jit_invalidate(chip8_t *chip8, uint16_t addr, uint16_t len);
+#endif
+uint64_t display_hash(const chip8_t *chip8);
+
+// Scancode to keypad bit, 0 = not a keypad key, rebound with --key
+// Scancodes name physical keys, so the square below stays a square on any layout
+// CHIP8 Keypad     QWERTY
+// 123C             1234
+// 456D             qwer
+// 789E             asdf
+// A0BF             zxcv
+uint16_t keymap[SDL_NUM_SCANCODES] = {
+    [SDL_SCANCODE_1] = 1 << 0x1, [SDL_SCANCODE_2] = 1 << 0x2, [SDL_SCANCODE_3] = 1 << 0x3, [SDL_SCANCODE_4] = 1 << 0xC,
+    [SDL_SCANCODE_Q] = 1 << 0x4, [SDL_SCANCODE_W] = 1 << 0x5, [SDL_SCANCODE_E] = 1 << 0x6, [SDL_SCANCODE_R] = 1 << 0xD,
+    [SDL_SCANCODE_A] = 1 << 0x7, [SDL_SCANCODE_S] = 1 << 0x8, [SDL_SCANCODE_D] = 1 << 0x9, [SDL_SCANCODE_F] = 1 << 0xE,
+    [SDL_SCANCODE_Z] = 1 << 0xA, [SDL_SCANCODE_X] = 1 << 0x0, [SDL_SCANCODE_C] = 1 << 0xB, [SDL_SCANCODE_V] = 1 << 0xF,
+};
+
+// Rebind one keypad key from a --key K=NAME argument, K in hex and NAME an SDL scancode name
+bool bind_key(const char *binding){
+    char *end;
+    const unsigned long key = strtoul(binding, &end, 16);
+    const SDL_Scancode code = end != binding && *end == '=' && key < 16 ? SDL_GetScancodeFromName(end + 1)
+                                                                        : SDL_SCANCODE_UNKNOWN;
+    if(code == SDL_SCANCODE_UNKNOWN){
+        SDL_Log("Bad key binding %s, expected keypad key=SDL key name, e.g. 5=Up\n", binding);
+        return false;
+    }
+    // handle_input looks the keymap up first, a keypad binding would shadow the hotkey
+    static const SDL_Scancode hotkeys[] = {SDL_SCANCODE_ESCAPE, SDL_SCANCODE_TAB, SDL_SCANCODE_BACKSPACE,
+                                           SDL_SCANCODE_F5, SDL_SCANCODE_F8,
+#ifdef TRACE
+                                           SDL_SCANCODE_F9,
+#endif
+    };
+    for(uint32_t h = 0; h < sizeof hotkeys / sizeof *hotkeys; h++){
+        if(hotkeys[h] == code){
+            SDL_Log("Bad key binding %s, %s is a hotkey\n", binding, SDL_GetScancodeName(code));
+            return false;
+        }
+    }
+    if(keymap[code] && keymap[code] != 1u << key){
+        uint32_t old = 0;
+        while(!(keymap[code] & 1u << old)) old++;
+        SDL_Log("Key binding %s takes %s from keypad key %X, bind that one again\n",
+                binding, SDL_GetScancodeName(code), old);
+    }
+    for(uint32_t c = 0; c < SDL_NUM_SCANCODES; c++) keymap[c] &= ~(1u << key);
+    keymap[code] = 1 << key;
+    return true;
+}
+
+// Quirk profile names, as given to --quirks and kept in the library index
+typedef struct{
+    const char *name;
+    quirks_t quirks;
+} quirk_profile_t;
+
+const quirk_profile_t quirk_profiles[] = {
+    {"chip8", QUIRKS_CHIP8},
+    {"vip", QUIRKS_VIP},
+    {"schip", QUIRKS_SCHIP},
+    {"xochip", QUIRKS_XOCHIP},
+};
+
+bool find_quirks(const char *name, quirks_t *quirks){
+    for(uint32_t p = 0; p < sizeof quirk_profiles / sizeof *quirk_profiles; p++){
+        if(strcmp(name, quirk_profiles[p].name) == 0){
+            *quirks = quirk_profiles[p].quirks;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Fill the output buffer with the beep, or silence while the gate is closed
+void audio_callback(void *userdata, uint8_t *stream, int len){
+    beeper_t *beeper = userdata;
+    int16_t *samples = (int16_t *)stream;
+    const int32_t target = SDL_AtomicGet(&beeper->gate) ? 256 : 0;
+    for(int i = 0; i < len / (int)sizeof *samples; i++){
+        // 64 samples from silence to full, about a millisecond
+        if(beeper->gain < target) beeper->gain += 4;
+        else if(beeper->gain > target) beeper->gain -= 4;
+        samples[i] = beeper->wave[beeper->phase >> 24] * beeper->gain / 256;
+        beeper->phase += beeper->step;
+    }
+}
+
+// Open the audio device for the beeper, without one the emulator just runs silent
+void init_audio(sdl_t *sdl, const config_t config){
+    if(!config.volume) return;
+    beeper_t *beeper = calloc(1, sizeof *beeper);
+    if(!beeper){
+        SDL_Log("Could not allocate the beeper, running without sound\n");
+        return;
+    }
+    // 256 samples is about 5 ms at 48 kHz, the beep starts within a frame of FX18
+    const SDL_AudioSpec want = {.freq = 48000, .format = AUDIO_S16SYS, .channels = 1, .samples = 256,
+                                .callback = audio_callback, .userdata = beeper};
+    SDL_AudioSpec have;
+    sdl->audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if(!sdl->audio_device){
+        SDL_Log("Could not open audio device %s, running without sound\n", SDL_GetError());
+        free(beeper);
+        return;
+    }
+    beeper->step = (uint32_t)(BEEPER_HZ * 4294967296.0 / have.freq);
+    // sum the odd harmonics below the output Nyquist frequency, a plain square would alias
+    // 0.9 leaves room for the overshoot at the edges
+    const double amplitude = 0.9 * 32767 * config.volume / 100 * 4 / M_PI;
+    for(uint32_t i = 0; i < BEEPER_WAVE; i++){
+        double sum = 0;
+        for(uint32_t k = 1; k * BEEPER_HZ < (uint32_t)have.freq / 2 && k < BEEPER_WAVE / 2; k += 2)
+            sum += sin(2 * M_PI * k * i / BEEPER_WAVE) / k;
+        beeper->wave[i] = amplitude * sum;
+    }
+    sdl->beeper = beeper;
+    SDL_PauseAudioDevice(sdl->audio_device, 0);
+}
+
+// OpenGL 3.3 renderer (--render gl). The display is uploaded as it is stored, 1 bit per pixel
+// with the two planes interleaved, and shaders do the rest: a glow pass keeps each pixel's
+// brightness, fading with --persistence, and a screen pass scales it to the window with the
+// palette and pixel outlines. The CPU work per frame is a 2 KB upload, whatever the scale
+// Entry points are loaded through SDL_GL_GetProcAddress so nothing links against libGL
+#define GL_ENTRY_POINTS(X) \
+    X(void, ActiveTexture, (GLenum)) \
+    X(void, AttachShader, (GLuint, GLuint)) \
+    X(void, BindFramebuffer, (GLenum, GLuint)) \
+    X(void, BindTexture, (GLenum, GLuint)) \
+    X(void, BindVertexArray, (GLuint)) \
+    X(GLenum, CheckFramebufferStatus, (GLenum)) \
+    X(void, Clear, (GLbitfield)) \
+    X(void, ClearColor, (GLfloat, GLfloat, GLfloat, GLfloat)) \
+    X(void, CompileShader, (GLuint)) \
+    X(GLuint, CreateProgram, (void)) \
+    X(GLuint, CreateShader, (GLenum)) \
+    X(void, DeleteFramebuffers, (GLsizei, const GLuint *)) \
+    X(void, DeleteProgram, (GLuint)) \
+    X(void, DeleteShader, (GLuint)) \
+    X(void, DeleteTextures, (GLsizei, const GLuint *)) \
+    X(void, DeleteVertexArrays, (GLsizei, const GLuint *)) \
+    X(void, DrawArrays, (GLenum, GLint, GLsizei)) \
+    X(void, FramebufferTexture2D, (GLenum, GLenum, GLenum, GLuint, GLint)) \
+    X(void, GenFramebuffers, (GLsizei, GLuint *)) \
+    X(void, GenTextures, (GLsizei, GLuint *)) \
+    X(void, GenVertexArrays, (GLsizei, GLuint *)) \
+    X(void, GetProgramInfoLog, (GLuint, GLsizei, GLsizei *, GLchar *)) \
+    X(void, GetProgramiv, (GLuint, GLenum, GLint *)) \
+    X(void, GetShaderInfoLog, (GLuint, GLsizei, GLsizei *, GLchar *)) \
+    X(void, GetShaderiv, (GLuint, GLenum, GLint *)) \
+    X(GLint, GetUniformLocation, (GLuint, const GLchar *)) \
+    X(void, LinkProgram, (GLuint)) \
+    X(void, PixelStorei, (GLenum, GLint)) \
+    X(void, ShaderSource, (GLuint, GLsizei, const GLchar *const *, const GLint *)) \
+    X(void, TexImage2D, (GLenum, GLint, GLint, GLsizei, GLsizei, GLint, GLenum, GLenum, const void *)) \
+    X(void, TexParameteri, (GLenum, GLenum, GLint)) \
+    X(void, TexSubImage2D, (GLenum, GLint, GLint, GLint, GLsizei, GLsizei, GLenum, GLenum, const void *)) \
+    X(void, Uniform1f, (GLint, GLfloat)) \
+    X(void, Uniform1i, (GLint, GLint)) \
+    X(void, Uniform2i, (GLint, GLint, GLint)) \
+    X(void, Uniform4f, (GLint, GLfloat, GLfloat, GLfloat, GLfloat)) \
+    X(void, UseProgram, (GLuint)) \
+    X(void, Viewport, (GLint, GLint, GLsizei, GLsizei))
+
+#define GL_BYTES (DISPLAY_WORDS * 8)    // bytes per display row and plane
+
+struct gl_renderer{
+    SDL_GLContext context;
+#define X(ret, name, args) ret (APIENTRY *name) args;
+    GL_ENTRY_POINTS(X)
+#undef X
+    GLuint vao;             // empty, the vertex shader makes a full screen triangle from gl_VertexID
+    GLuint bits;            // RG8UI, GL_BYTES x DISPLAY_ROWS, one display byte per plane
+    GLuint glow[2];         // RG8, brightness per pixel and plane, the last frame's and the next
+    GLuint fbo[2];          // render targets for glow
+    GLuint glow_program, screen_program;
+    GLint glow_size, glow_decay, screen_size, screen_window, screen_outlines;
+    uint8_t current;        // glow holding the latest frame
+    bool hires;             // resolution glow was drawn at
+    double decay;           // brightness a pixel keeps per 60 Hz frame, 0 = no persistence
+    uint64_t fade_end;      // performance counter when the last lit pixel has faded below 1/255
+    bool fading;            // glow still changing, keep presenting until fade_end
+    uint64_t last;          // performance counter at the last glow pass
+    uint8_t upload[DISPLAY_ROWS][GL_BYTES][DISPLAY_PLANES];
+};
+
+static const char *const gl_vertex_shader =
+    "#version 330 core\n"
+    "void main(){\n"
+    "    vec2 p = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 4.0 - 1.0;\n"
+    "    gl_Position = vec4(p, 0.0, 1.0);\n"
+    "}\n";
+
+// glow: fragment (x, y) is display pixel (x, y), lit pixels go to full brightness and
+// the rest keep decay of what they had
+static const char *const gl_glow_shader =
+    "#version 330 core\n"
+    "uniform usampler2D bits;\n"
+    "uniform sampler2D previous;\n"
+    "uniform ivec2 size;\n"
+    "uniform float decay;\n"
+    "out vec4 color;\n"
+    "void main(){\n"
+    "    ivec2 p = ivec2(gl_FragCoord.xy);\n"
+    "    uvec2 byte = texelFetch(bits, ivec2(p.x >> 3, p.y), 0).rg;\n"
+    "    vec2 lit = vec2((byte >> uint(7 - (p.x & 7))) & 1u);\n"
+    "    color = vec4(max(lit, texelFetch(previous, p, 0).rg * decay), 0.0, 1.0);\n"
+    "}\n";
+
+// screen: window pixel to display pixel, blend the palette by plane brightness and
+// draw the first and last window pixel of every display pixel in bg as its outline
+static const char *const gl_screen_shader =
+    "#version 330 core\n"
+    "uniform sampler2D glow;\n"
+    "uniform ivec2 size;\n"
+    "uniform ivec2 window;\n"
+    "uniform bool outlines;\n"
+    "uniform vec4 bg, fg, plane2, both;\n"
+    "out vec4 color;\n"
+    "void main(){\n"
+    "    ivec2 frag = ivec2(gl_FragCoord.xy);\n"
+    "    frag.y = window.y - 1 - frag.y;\n"
+    "    ivec2 cell = frag * size / window;\n"
+    "    vec2 i = texelFetch(glow, cell, 0).rg;\n"
+    "    color = bg + (fg - bg) * i.x * (1.0 - i.y) + (plane2 - bg) * i.y * (1.0 - i.x) + (both - bg) * i.x * i.y;\n"
+    "    ivec2 first = (cell * window + size - 1) / size;\n"
+    "    ivec2 last = ((cell + 1) * window + size - 1) / size - 1;\n"
+    "    if(outlines && (any(equal(frag, first)) || any(equal(frag, last)))) color = bg;\n"
+    "}\n";
+
+// Compile and link a program from the shared vertex shader and a fragment shader, 0 on failure
+GLuint gl_program(gl_renderer_t *gl, const char *fragment){
+    const char *sources[2] = {gl_vertex_shader, fragment};
+    const GLenum types[2] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+    char log[1024];
+    GLint ok = 0;
+    const GLuint program = gl->CreateProgram();
+    for(int i = 0; i < 2; i++){
+        const GLuint shader = gl->CreateShader(types[i]);
+        gl->ShaderSource(shader, 1, &sources[i], NULL);
+        gl->CompileShader(shader);
+        gl->GetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+        if(!ok){
+            gl->GetShaderInfoLog(shader, sizeof log, NULL, log);
+            SDL_Log("Could not compile shader: %s\n", log);
+        }
+        gl->AttachShader(program, shader);
+        gl->DeleteShader(shader);   // freed with the program
+        if(!ok){
+            gl->DeleteProgram(program);
+            return 0;
+        }
+    }
+    gl->LinkProgram(program);
+    gl->GetProgramiv(program, GL_LINK_STATUS, &ok);
+    if(!ok){
+        gl->GetProgramInfoLog(program, sizeof log, NULL, log);
+        SDL_Log("Could not link shaders: %s\n", log);
+        gl->DeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// Set a vec4 uniform to an RGBA8888 color
+void gl_color(gl_renderer_t *gl, GLuint program, const char *name, uint32_t color){
+    gl->Uniform4f(gl->GetUniformLocation(program, name), (color >> 24) / 255.0f, ((color >> 16) & 0xFF) / 255.0f,
+                  ((color >> 8) & 0xFF) / 255.0f, (color & 0xFF) / 255.0f);
+}
+
+void free_gl(gl_renderer_t *gl){
+    if(!gl) return;
+    if(gl->context){
+        if(gl->glow_program) gl->DeleteProgram(gl->glow_program);
+        if(gl->screen_program) gl->DeleteProgram(gl->screen_program);
+        if(gl->fbo[0]) gl->DeleteFramebuffers(2, gl->fbo);
+        if(gl->glow[0]) gl->DeleteTextures(2, gl->glow);
+        if(gl->bits) gl->DeleteTextures(1, &gl->bits);
+        if(gl->vao) gl->DeleteVertexArrays(1, &gl->vao);
+        SDL_GL_DeleteContext(gl->context);
+    }
+    free(gl);
+}
+
+// Create the GL context, shaders and textures on an SDL_WINDOW_OPENGL window
+// NULL when any of it is missing, the caller falls back to the SDL renderer
+gl_renderer_t *init_gl(sdl_t *sdl, const config_t config){
+    gl_renderer_t *gl = calloc(1, sizeof *gl);
+    if(!gl) return NULL;
+    gl->context = SDL_GL_CreateContext(sdl->window);
+    if(!gl->context){
+        SDL_Log("Could not create an OpenGL 3.3 context %s\n", SDL_GetError());
+        free(gl);
+        return NULL;
+    }
+    bool ok = true;
+#define X(ret, name, args) ok = ok && (gl->name = (ret (APIENTRY *) args)SDL_GL_GetProcAddress("gl" #name));
+    GL_ENTRY_POINTS(X)
+#undef X
+    if(!ok){
+        SDL_Log("OpenGL entry points are missing\n");
+        SDL_GL_DeleteContext(gl->context);
+        free(gl);
+        return NULL;
+    }
+    gl->glow_program = gl_program(gl, gl_glow_shader);
+    gl->screen_program = gl_program(gl, gl_screen_shader);
+    if(!gl->glow_program || !gl->screen_program){
+        free_gl(gl);
+        return NULL;
+    }
+    gl->GenVertexArrays(1, &gl->vao);
+    gl->BindVertexArray(gl->vao);
+    gl->PixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    gl->GenTextures(1, &gl->bits);
+    gl->BindTexture(GL_TEXTURE_2D, gl->bits);
+    gl->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    gl->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    gl->TexImage2D(GL_TEXTURE_2D, 0, GL_RG8UI, GL_BYTES, DISPLAY_ROWS, 0, GL_RG_INTEGER, GL_UNSIGNED_BYTE, gl->upload);
+    gl->GenTextures(2, gl->glow);
+    gl->GenFramebuffers(2, gl->fbo);
+    for(int i = 0; i < 2; i++){
+        gl->BindTexture(GL_TEXTURE_2D, gl->glow[i]);
+        gl->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        gl->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        gl->TexImage2D(GL_TEXTURE_2D, 0, GL_RG8, GL_BYTES * 8, DISPLAY_ROWS, 0, GL_RG, GL_UNSIGNED_BYTE, NULL);
+        gl->BindFramebuffer(GL_FRAMEBUFFER, gl->fbo[i]);
+        gl->FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gl->glow[i], 0);
+        ok = ok && gl->CheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        gl->ClearColor(0, 0, 0, 1);
+        gl->Clear(GL_COLOR_BUFFER_BIT);
+    }
+    gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
+    if(!ok){
+        SDL_Log("Could not create the OpenGL glow buffers\n");
+        free_gl(gl);
+        return NULL;
+    }
+
+    gl->UseProgram(gl->glow_program);
+    gl->Uniform1i(gl->GetUniformLocation(gl->glow_program, "bits"), 0);
+    gl->Uniform1i(gl->GetUniformLocation(gl->glow_program, "previous"), 1);
+    gl->glow_size = gl->GetUniformLocation(gl->glow_program, "size");
+    gl->glow_decay = gl->GetUniformLocation(gl->glow_program, "decay");
+    gl->UseProgram(gl->screen_program);
+    gl->Uniform1i(gl->GetUniformLocation(gl->screen_program, "glow"), 1);
+    gl->Uniform1i(gl->GetUniformLocation(gl->screen_program, "outlines"), config.pixel_outlines);
+    gl_color(gl, gl->screen_program, "bg", config.bg_color);
+    gl_color(gl, gl->screen_program, "fg", config.fg_color);
+    gl_color(gl, gl->screen_program, "plane2", config.plane2_color);
+    gl_color(gl, gl->screen_program, "both", config.both_color);
+    gl->screen_size = gl->GetUniformLocation(gl->screen_program, "size");
+    gl->screen_window = gl->GetUniformLocation(gl->screen_program, "window");
+    gl->decay = config.persistence / 100.0;
+    gl->last = SDL_GetPerformanceCounter();
+    return gl;
+}
+
 //Initialize SDL
 bool init_sdl(sdl_t *sdl, const config_t config){
     if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER) !=0){
         SDL_Log("Could not initialize SDL subsystems! %s\n", SDL_GetError()); // Amount to scale a CHIP8 pixel by e.g. 20x will be a 20x larger window
         return false; // init failed
     }
+    if(config.render_mode == RENDER_GL){
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+        SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+    }
     sdl->window = SDL_CreateWindow("CHIP8 Emulator", SDL_WINDOWPOS_CENTERED,
                                     SDL_WINDOWPOS_CENTERED,
                                     config.window_width*config.scale_factor,
                                     config.window_height*config.scale_factor,
-                                    0);
+                                    config.render_mode == RENDER_GL ? SDL_WINDOW_OPENGL : 0);
     if(!sdl->window){
         SDL_Log("Could not create SDL window %s\n", SDL_GetError());
         return false; // init failed
     }
-    sdl->renderer = SDL_CreateRenderer(sdl->window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_DisplayMode mode;
+    sdl->refresh_rate = 60;
+    if(SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(sdl->window), &mode) == 0 && mode.refresh_rate > 0)
+        sdl->refresh_rate = mode.refresh_rate;
+    if(config.render_mode == RENDER_GL){
+        sdl->gl = init_gl(sdl, config);
+        if(sdl->gl){
+            sdl->vsync = config.pacing != PACING_TIMER && SDL_GL_SetSwapInterval(1) == 0;
+            if(config.pacing != PACING_TIMER && !sdl->vsync)
+                SDL_Log("OpenGL has no vsync, pacing with the timer instead\n");
+            else if(config.pacing == PACING_TIMER) SDL_GL_SetSwapInterval(0);
+            init_audio(sdl, config);
+            return true; // init success
+        }
+        SDL_Log("Falling back to texture renderer\n");
+    }
+    const uint32_t renderer_flags = SDL_RENDERER_ACCELERATED |
+                                    (config.pacing != PACING_TIMER ? SDL_RENDERER_PRESENTVSYNC : 0);
+    sdl->renderer = SDL_CreateRenderer(sdl->window, -1, renderer_flags);
     if(!sdl->renderer){
         SDL_Log("Could not create SDL renderer %s\n", SDL_GetError());
         return false; // init failed
     }
+    SDL_RendererInfo info;
+    sdl->vsync = config.pacing != PACING_TIMER && SDL_GetRendererInfo(sdl->renderer, &info) == 0 &&
+                 (info.flags & SDL_RENDERER_PRESENTVSYNC);
+    if(config.pacing != PACING_TIMER && !sdl->vsync)
+        SDL_Log("Renderer has no vsync, pacing with the timer instead\n");
+    if(config.render_mode != RENDER_RECTS){
+        // one texel per hi-res pixel, lo-res pixels cover 2x2 texels
+        // nearest filtering keeps the pixels sharp when scaled
+        SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+        sdl->texture = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGBA8888,
+                                         SDL_TEXTUREACCESS_STREAMING,
+                                         config.window_width * 2, config.window_height * 2);
+        if(!sdl->texture){
+            SDL_Log("Could not create SDL texture %s, falling back to rect renderer\n", SDL_GetError());
+        }
+    }
+    if(sdl->texture && config.pixel_outlines){
+        // Outlines are drawn in the bg color, so over unlit pixels they are invisible
+        // and a full grid looks the same as outlining every lit pixel
+        // Two 1px lines per column/row match the edges SDL_RenderDrawRect would draw
+        // One grid per resolution, hi-res pixels are half a lo-res pixel (rounded per edge)
+        const int s = config.scale_factor;
+        const int w = config.window_width * s;
+        const int h = config.window_height * s;
+        for(int hires = 0; hires < 2; hires++){
+            const uint32_t columns = config.window_width << hires, rows = config.window_height << hires;
+            SDL_Rect *outlines = calloc(2 * (columns + rows), sizeof *outlines);
+            if(!outlines){
+                SDL_Log("Could not allocate pixel outlines\n");
+                return false; // init failed
+            }
+            int count = 0;
+            for(uint32_t x = 0; x < columns; x++){
+                outlines[count++] = (SDL_Rect){.x = (x*s) >> hires, .y = 0, .w = 1, .h = h};
+                outlines[count++] = (SDL_Rect){.x = (((x+1)*s) >> hires) - 1, .y = 0, .w = 1, .h = h};
+            }
+            for(uint32_t y = 0; y < rows; y++){
+                outlines[count++] = (SDL_Rect){.x = 0, .y = (y*s) >> hires, .w = w, .h = 1};
+                outlines[count++] = (SDL_Rect){.x = 0, .y = (((y+1)*s) >> hires) - 1, .w = w, .h = 1};
+            }
+            sdl->outlines[hires] = outlines;
+            sdl->outline_count[hires] = count;
+        }
+    }
+    init_audio(sdl, config);
     return true; // init success
 }
 
-//Initialize CHIP8 machine
-bool init_chip8(chip8_t *chip8, const char *rom_name){
+// Load a ROM image that is already in memory, such as a mapped library file
+bool load_chip8(chip8_t *chip8, const char *rom_name, const uint8_t *rom, size_t rom_size){
     const uint32_t entry_point = 0x200; // CHIP8 ROM entry point
     const uint8_t font[] ={
         0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -104,6 +866,26 @@ bool init_chip8(chip8_t *chip8, const char *rom_name){
         0xF0, 0x80, 0xF0, 0x80, 0x80  // F
     };
     memcpy(&chip8->ram[0], font, sizeof(font)); // load the font
+    const size_t max_size = sizeof chip8->ram - entry_point;
+    if(rom_size > max_size){
+        SDL_Log("ROM file %s is too big! ROM size: %zu, Max size allowed: %zu\n",
+                rom_name, rom_size, max_size);
+        return false;                           // failure
+    }
+    memcpy(&chip8->ram[entry_point], rom, rom_size);    // load the ROM
+    chip8->state = RUNNING;                     // Default machine state to on/running
+    chip8->PC = entry_point;                    // Start program counter at ROM entry point
+    chip8->rom_name = rom_name;                 // loadin ROM name
+    chip8->sp = 0;                              // empty stack
+    chip8->planes = 1;                          // draw to the first plane only, as plain CHIP8 does
+    chip8->draw = true;                         // texture contents start undefined so draw everything once
+    chip8->damage = (damage_t){0, 0, 0xFF, 0xFF};
+    return true;                                // success
+}
+
+//Initialize CHIP8 machine
+bool init_chip8(chip8_t *chip8, const char *rom_name){
+    uint8_t data[sizeof chip8->ram - 0x200];
     FILE *rom = fopen(rom_name, "rb");          // open ROM file
     if(!rom){
         SDL_Log("ROM file %s is invalid or does not exist\n", rom_name);
@@ -111,25 +893,26 @@ bool init_chip8(chip8_t *chip8, const char *rom_name){
     }
     fseek(rom, 0, SEEK_END);                    // get/check ROM size
     const long rom_size = ftell(rom);
-    const long max_size = sizeof chip8->ram - entry_point;
     rewind(rom);
-    if(rom_size > max_size){
-        SDL_Log("ROM file %s is too big! ROM size: %ld, Max size allowed: %ld\n",
-                rom_name, rom_size, max_size);
+    if(rom_size < 0 || (size_t)rom_size > sizeof data){
+        SDL_Log("ROM file %s is too big! ROM size: %ld, Max size allowed: %zu\n",
+                rom_name, rom_size, sizeof data);
+        fclose(rom);
         return false;                           // failure
     }
-    if(fread(&chip8->ram[entry_point], rom_size, 1, rom)!=1){
+    if(fread(data, rom_size, 1, rom)!=1){
         SDL_Log("Could not read ROM file %s into CHIP8 memory\n", rom_name);
+        fclose(rom);
         return false;                           // failure
     }
     fclose(rom);                                // close ROM file
-    chip8->state = RUNNING;                     // Default machine state to on/running
-    chip8->PC = entry_point;                    // Start program counter at ROM entry point
-    chip8->rom_name = rom_name;                 // loadin ROM name
-    chip8->stack_ptr = &chip8->stack[0];        // set stack pointer
-    return true;                                // success
+    return load_chip8(chip8, rom_name, data, rom_size);
 }
 
+#define RUN_AHEAD_MAX 8     // most frames --run-ahead emulates past the current one
+#define SESSIONS_MAX 65536  // most --sessions, a machine and a descriptor each
+#define TURBO_MAX 1000      // fastest --turbo, keeps the scheduler's tick products inside 64 bits
+
 // Set up initial configs
 bool set_config(config_t *config, int argc, char **argv){
     // Set defaults
@@ -137,20 +920,321 @@ bool set_config(config_t *config, int argc, char **argv){
     config->window_width = 64;      // CHIP8 original X resolution
     config->fg_color = 0xFFFFFFFF;  // WHITE
     config->bg_color = 0x000000FF;  // BLACK
+    config->plane2_color = 0xFF6600FF;  // ORANGE
+    config->both_color = 0x808080FF;    // GREY
     config->scale_factor = 20;      // 20x scale factor 1280x640
     config->pixel_outlines = true;  // set pixel outlines as true by default
     config->clock_speed = 500;      // 500hz clock speed
+    config->render_mode = RENDER_TEXTURE; // streaming texture renderer
+    config->persistence = 0;        // pixels go dark at once
+    config->cpu_mode = CPU_INTERPRETER; // reference interpreter
+    config->quirks = QUIRKS_CHIP8;  // the behavior this emulator always had
+    config->headless = false;       // open a window
+    config->max_instructions = 0;   // no instruction limit
+    config->max_frames = 0;         // no frame limit
+    config->batch_size = 0;         // single instance
+    config->threads = 0;            // one worker per CPU core
+    config->lockstep = false;       // one instance at a time per worker
+    config->pacing = PACING_TIMER;  // sleep to the 60hz clock
+    config->background = BACKGROUND_THROTTLE;   // no presents out of sight, coarse pacing out of focus
+    config->emu_thread = false;     // emulate and render on the main thread
+    config->turbo = false;          // real time until Tab is pressed
+    config->run_ahead = 0;          // present the frame that was emulated
+    config->turbo_speed = 0;        // fast-forward as fast as the host can
+    config->volume = 25;            // beep at a quarter of full scale
+    config->idle_skip = true;       // skip idle loops
+    config->max_sessions = 4096;    // enough for a node, the open file limit is raised to match
+    config->rewind = false;         // no rewind history
+    config->seed = time(NULL);      // a different run every time
+    config->record = NULL;          // not recording
+    config->replay = NULL;          // not replaying
+    config->profile = "profile.csv";    // profiling builds always write their counters
+    config->bench = "bench.csv";        // benchmark builds always write their results
+    bool seed_given = false;
 
     // Override defaults with command line arguments
     for(int i = 1;i<argc;i++){
-        (void)argv[i];
+        if(strcmp(argv[i], "--render") == 0 && i+1 < argc){
+            // --render texture|rects|gl: choose the renderer backend
+            i++;
+            if(strcmp(argv[i], "texture") == 0) config->render_mode = RENDER_TEXTURE;
+            else if(strcmp(argv[i], "rects") == 0) config->render_mode = RENDER_RECTS;
+            else if(strcmp(argv[i], "gl") == 0) config->render_mode = RENDER_GL;
+            else{
+                SDL_Log("Unknown renderer %s, expected texture, rects or gl\n", argv[i]);
+                return false;           // failure
+            }
+        }
+        else if(strcmp(argv[i], "--persistence") == 0 && i+1 < argc){
+            // --persistence N: GL renderer, pixels that go dark keep N percent of their brightness per frame
+            config->persistence = strtoul(argv[++i], NULL, 0);
+            if(config->persistence > 95){
+                SDL_Log("Persistence must be between 0 and 95\n");
+                return false;           // failure
+            }
+        }
+        else if(strcmp(argv[i], "--cpu") == 0 && i+1 < argc){
+            // --cpu interpreter|predecoded|jit: choose the CPU core
+            i++;
+            if(strcmp(argv[i], "interpreter") == 0) config->cpu_mode = CPU_INTERPRETER;
+            else if(strcmp(argv[i], "predecoded") == 0) config->cpu_mode = CPU_PREDECODED;
+            else if(strcmp(argv[i], "jit") == 0){
+#ifdef HAVE_JIT
+                config->cpu_mode = CPU_JIT;
+#else
+                SDL_Log("No JIT backend for this CPU, using the pre-decoded core\n");
+                config->cpu_mode = CPU_PREDECODED;
+#endif
+            }
+            else{
+                SDL_Log("Unknown CPU core %s, expected interpreter, predecoded or jit\n", argv[i]);
+                return false;           // failure
+            }
+        }
+        else if(strcmp(argv[i], "--quirks") == 0 && i+1 < argc){
+            // --quirks chip8|vip|schip|xochip: behavior of the opcodes implementations disagree on
+            if(!find_quirks(argv[++i], &config->quirks)){
+                SDL_Log("Unknown quirk profile %s, expected chip8, vip, schip or xochip\n", argv[i]);
+                return false;           // failure
+            }
+        }
+        else if(strcmp(argv[i], "--pacing") == 0 && i+1 < argc){
+            // --pacing timer|vsync|display: choose how the main loop keeps time
+            i++;
+            if(strcmp(argv[i], "timer") == 0) config->pacing = PACING_TIMER;
+            else if(strcmp(argv[i], "vsync") == 0) config->pacing = PACING_VSYNC;
+            else if(strcmp(argv[i], "display") == 0) config->pacing = PACING_DISPLAY;
+            else{
+                SDL_Log("Unknown pacing %s, expected timer, vsync or display\n", argv[i]);
+                return false;           // failure
+            }
+        }
+        else if(strcmp(argv[i], "--background") == 0 && i+1 < argc){
+            // --background run|throttle|pause: what the main loop does while the window is out of sight
+            i++;
+            if(strcmp(argv[i], "run") == 0) config->background = BACKGROUND_RUN;
+            else if(strcmp(argv[i], "throttle") == 0) config->background = BACKGROUND_THROTTLE;
+            else if(strcmp(argv[i], "pause") == 0) config->background = BACKGROUND_PAUSE;
+            else{
+                SDL_Log("Unknown background policy %s, expected run, throttle or pause\n", argv[i]);
+                return false;           // failure
+            }
+        }
+        else if(strcmp(argv[i], "--volume") == 0 && i+1 < argc){
+            // --volume N: beeper volume in percent, 0 does not open an audio device at all
+            config->volume = strtoul(argv[++i], NULL, 0);
+            if(config->volume > 100){
+                SDL_Log("Volume must be between 0 and 100\n");
+                return false;           // failure
+            }
+        }
+        else if(strcmp(argv[i], "--turbo") == 0 && i+1 < argc){
+            // --turbo N: start fast-forwarding at N times real time, 0 = as fast as possible
+            config->turbo = true;
+            const unsigned long speed = strtoul(argv[++i], NULL, 0);
+            if(speed > TURBO_MAX){
+                SDL_Log("Turbo speed must be between 0 and %d\n", TURBO_MAX);
+                return false;           // failure
+            }
+            config->turbo_speed = speed;
+        }
+        else if(strcmp(argv[i], "--run-ahead") == 0 && i+1 < argc){
+            // --run-ahead K: present the frame K frames ahead with the keys held now, then rewind
+            config->run_ahead = strtoul(argv[++i], NULL, 0);
+            if(config->run_ahead > RUN_AHEAD_MAX){
+                SDL_Log("Run-ahead must be between 0 and %d frames\n", RUN_AHEAD_MAX);
+                return false;           // failure
+            }
+        }
+        else if(strcmp(argv[i], "--emu-thread") == 0){
+            // --emu-thread: run emulation on its own thread so presents never stall it
+            config->emu_thread = true;
+        }
+        else if(strcmp(argv[i], "--no-idle-skip") == 0){
+            // --no-idle-skip: execute idle loops like any other code, for benchmarking the cores
+            config->idle_skip = false;
+        }
+        else if(strcmp(argv[i], "--rewind") == 0){
+            // --rewind: keep a compressed per-frame history, hold backspace to rewind
+            config->rewind = true;
+        }
+        else if(strcmp(argv[i], "--key") == 0 && i+1 < argc){
+            // --key K=NAME: bind keypad key K to the key SDL calls NAME, e.g. 5=Up
+            if(!bind_key(argv[++i])) return false;  // failure
+        }
+        else if(strcmp(argv[i], "--latency") == 0){
+            // --latency: time key presses to the first changed present, print the stats at exit
+            config->input_latency = true;
+        }
+        else if(strcmp(argv[i], "--stream") == 0 && i+1 < argc){
+            // --stream TARGET: write the changed rows of every frame to a file, - or tcp:HOST:PORT
+#ifndef HAVE_STREAM
+            SDL_Log("--stream is not supported on this platform\n");
+            return false;               // failure
+#endif
+            config->stream = argv[++i];
+        }
+        else if(strcmp(argv[i], "--play-stream") == 0){
+            // --play-stream: the file argument is a frame stream (- for stdin), show it
+#ifndef HAVE_STREAM
+            SDL_Log("--play-stream is not supported on this platform\n");
+            return false;               // failure
+#endif
+            config->play_stream = true;
+        }
+        else if(strcmp(argv[i], "--serve") == 0 && i+1 < argc){
+            // --serve PORT: host a session of the ROM for every TCP client that connects
+#ifndef HAVE_SERVER
+            SDL_Log("--serve is not supported on this platform\n");
+            return false;               // failure
+#endif
+            const unsigned long port = strtoul(argv[++i], NULL, 0);
+            if(!port || port > 65535){
+                SDL_Log("Port must be between 1 and 65535\n");
+                return false;           // failure
+            }
+            config->serve_port = port;
+        }
+        else if(strcmp(argv[i], "--sessions") == 0 && i+1 < argc){
+            // --sessions N: most sessions the server keeps open at once
+            const unsigned long sessions = strtoul(argv[++i], NULL, 0);
+            if(!sessions || sessions > SESSIONS_MAX){
+                SDL_Log("Sessions must be between 1 and %d\n", SESSIONS_MAX);
+                return false;           // failure
+            }
+            config->max_sessions = sessions;
+        }
+        else if(strcmp(argv[i], "--seed") == 0 && i+1 < argc){
+            // --seed N: seed the CXNN generator for a reproducible run
+            config->seed = strtoul(argv[++i], NULL, 0);
+            seed_given = true;
+        }
+        else if(strcmp(argv[i], "--record") == 0 && i+1 < argc){
+            // --record FILE: log keypad changes for --replay
+            config->record = argv[++i];
+        }
+        else if(strcmp(argv[i], "--replay") == 0 && i+1 < argc){
+            // --replay FILE: rerun a recorded session headless at full speed
+            config->replay = argv[++i];
+        }
+        else if(strcmp(argv[i], "--profile") == 0 && i+1 < argc){
+            // --profile FILE: profiling builds write their counters here, JSON if it ends in .json
+#ifndef PROFILE
+            SDL_Log("--profile needs a profiling build, see make profile\n");
+            return false;               // failure
+#endif
+            config->profile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--bench") == 0 && i+1 < argc){
+            // --bench FILE: benchmark builds write their results here, JSON if it ends in .json
+#ifndef BENCH
+            SDL_Log("--bench needs a benchmark build, see make bench\n");
+            return false;               // failure
+#endif
+            config->bench = argv[++i];
+        }
+        else if(strcmp(argv[i], "--decode-trace") == 0){
+            // --decode-trace: the file argument is a trace, print it as text and exit
+#ifndef TRACE
+            SDL_Log("--decode-trace needs a tracing build, see make trace\n");
+            return false;               // failure
+#endif
+            config->decode_trace = true;
+        }
+        else if(strcmp(argv[i], "--library") == 0){
+            // --library: the file argument is a ROM directory, list its index or batch every ROM
+#ifndef HAVE_LIBRARY
+            SDL_Log("--library is not supported on this platform\n");
+            return false;               // failure
+#endif
+            config->library = true;
+        }
+        else if(strcmp(argv[i], "--analyze") == 0){
+            // --analyze: find the ROM's code at load, precompile its loops and skip invalidating data writes
+            config->analyze = true;
+        }
+        else if(strcmp(argv[i], "--print-cfg") == 0){
+            // --print-cfg: print the basic blocks and RAM page classes of the ROM as CSV and exit
+            config->print_cfg = true;
+        }
+        else if(strcmp(argv[i], "--headless") == 0){
+            // --headless: no window, run uncapped and print throughput stats
+            config->headless = true;
+        }
+        else if(strcmp(argv[i], "--instructions") == 0 && i+1 < argc){
+            // --instructions N: headless run length in instructions
+            config->max_instructions = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "--frames") == 0 && i+1 < argc){
+            // --frames N: headless run length in 60hz frames
+            config->max_frames = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "--batch") == 0 && i+1 < argc){
+            // --batch N: run N headless instances of the ROM, one CXNN seed each
+            config->batch_size = strtoul(argv[++i], NULL, 0);
+            if(!config->batch_size){
+                SDL_Log("Batch size must be at least 1\n");
+                return false;           // failure
+            }
+            config->headless = true;
+        }
+        else if(strcmp(argv[i], "--threads") == 0 && i+1 < argc){
+            // --threads N: batch worker threads
+            config->threads = strtoul(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "--lockstep") == 0){
+            // --lockstep: batch instances share vector lanes while their control flow agrees
+            config->lockstep = true;
+        }
+        else if(strcmp(argv[i], "--fuzz") == 0 && i+1 < argc){
+            // --fuzz N: run N generated cases on every CPU core and compare them frame by frame
+            config->fuzz = strtoul(argv[++i], NULL, 0);
+            if(!config->fuzz || config->fuzz > INT32_MAX){
+                SDL_Log("Fuzz case count must be between 1 and %d\n", INT32_MAX);
+                return false;           // failure
+            }
+            config->headless = true;
+        }
+        else if(strcmp(argv[i], "--clock") == 0 && i+1 < argc){
+            // --clock N: CHIP8 clock speed in Hz
+            config->clock_speed = strtoul(argv[++i], NULL, 0);
+            if(config->clock_speed < 60){
+                SDL_Log("Clock speed must be at least 60 Hz\n");
+                return false;           // failure
+            }
+        }
+        else if(strncmp(argv[i], "--", 2) == 0){
+            SDL_Log("Unknown option %s\n", argv[i]);
+            return false;               // failure
+        }
     }
+    // batches are for regression runs, keep them reproducible
+    if(config->batch_size && !seed_given) config->seed = 0;
+    if(config->record && (config->rewind || config->headless)){
+        SDL_Log("--record needs a window and cannot be combined with --rewind\n");
+        return false;                   // failure
+    }
+    if(config->lockstep && !config->batch_size){
+        SDL_Log("--lockstep needs --batch\n");
+        return false;                   // failure
+    }
+    // fuzz cases are short so each seed covers many programs
+    if(config->fuzz && !config->max_frames) config->max_frames = 60;
+    // a headless run needs an end, default to one emulated minute
+    if(config->headless && !config->max_instructions && !config->max_frames)
+        config->max_frames = 60 * 60;
     return true;                        // success
 }
 
 //Final cleanup
 void final_cleanup(const sdl_t sdl){
-    SDL_DestroyRenderer(sdl.renderer);  //Destroy renderer
+    if(sdl.audio_device) SDL_CloseAudioDevice(sdl.audio_device);   //Stop the audio callback
+    free(sdl.beeper);
+    free(sdl.outlines[0]);              //Free pixel outline grids
+    free(sdl.outlines[1]);
+    if(sdl.texture) SDL_DestroyTexture(sdl.texture); //Destroy display texture
+    free_gl(sdl.gl);                    //Destroy GL objects and context
+    if(sdl.renderer) SDL_DestroyRenderer(sdl.renderer);  //Destroy renderer
     SDL_DestroyWindow(sdl.window);      //Destroy window
     SDL_Quit();                         //Shut down SDL subsystem
 }
@@ -162,35 +1246,105 @@ void clear_screen(const config_t config,const sdl_t sdl){
     const uint8_t g = (config.bg_color >> 16) & 0xFF;
     const uint8_t b = (config.bg_color >> 8) & 0xFF;
     const uint8_t a = (config.bg_color >> 0) & 0xFF;
+    if(!sdl.renderer) return;           // the GL screen pass draws every pixel
     SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
     SDL_RenderClear(sdl.renderer);
 }
 
-// Update window with any changes
-void redraw_screen(const sdl_t sdl, const config_t config, chip8_t *chip8) {
+// Width and height of the current resolution in pixels
+uint32_t display_width(const chip8_t *chip8, const config_t config){
+    return config.window_width << chip8->hires;
+}
+
+uint32_t display_height(const chip8_t *chip8, const config_t config){
+    return config.window_height << chip8->hires;
+}
+
+// Read one pixel from the packed display, bit p of the result is set if plane p has it lit
+uint8_t display_pixel(const chip8_t *chip8, uint32_t x, uint32_t y){
+    const uint32_t word = x >> 6, bit = 63 - (x & 63);
+    return ((chip8->display[0][y][word] >> bit) & 1) | ((chip8->display[1][y][word] >> bit) & 1) << 1;
+}
+
+// Upload the display if it changed, run the glow pass and draw it to the window
+void redraw_screen_gl(const sdl_t sdl, const config_t config, chip8_t *chip8){
+    gl_renderer_t *gl = sdl.gl;
+    const uint32_t width = display_width(chip8, config), height = display_height(chip8, config);
+    const uint64_t now = SDL_GetPerformanceCounter();
+    if(chip8->draw){
+        // rows as bytes, leftmost pixel in the MSB, the planes side by side
+        for(uint32_t y = 0; y < height; y++)
+            for(uint32_t b = 0; b < width / 8; b++)
+                for(uint32_t p = 0; p < DISPLAY_PLANES; p++)
+                    gl->upload[y][b][p] = chip8->display[p][y][b >> 3] >> (56 - 8 * (b & 7));
+        gl->ActiveTexture(GL_TEXTURE0);
+        gl->BindTexture(GL_TEXTURE_2D, gl->bits);
+        gl->TexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GL_BYTES, height, GL_RG_INTEGER, GL_UNSIGNED_BYTE, gl->upload);
+        // a lit pixel fades to below 1/255 in log(1/255) / log(decay) frames
+        if(gl->decay > 0)
+            gl->fade_end = now + log(1 / 255.0) / log(gl->decay) * SDL_GetPerformanceFrequency() / 60;
+    }
+    if(chip8->draw || gl->fading || chip8->hires != gl->hires){
+        // decay by the time gone by, so the fade runs at the same speed at any present rate
+        const double frames = (double)(now - gl->last) * 60 / SDL_GetPerformanceFrequency();
+        const uint8_t next = gl->current ^ 1;
+        gl->UseProgram(gl->glow_program);
+        gl->Uniform2i(gl->glow_size, width, height);
+        gl->Uniform1f(gl->glow_decay, chip8->hires != gl->hires ? 0 : pow(gl->decay, frames));
+        gl->ActiveTexture(GL_TEXTURE1);
+        gl->BindTexture(GL_TEXTURE_2D, gl->glow[gl->current]);
+        gl->BindFramebuffer(GL_FRAMEBUFFER, gl->fbo[next]);
+        gl->Viewport(0, 0, width, height);
+        gl->DrawArrays(GL_TRIANGLES, 0, 3);
+        gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
+        gl->current = next;
+        gl->hires = chip8->hires;
+    }
+    gl->last = now;
+    gl->fading = now < gl->fade_end;
+
+    int w, h;
+    SDL_GL_GetDrawableSize(sdl.window, &w, &h);
+    gl->UseProgram(gl->screen_program);
+    gl->Uniform2i(gl->screen_size, width, height);
+    gl->Uniform2i(gl->screen_window, w, h);
+    gl->ActiveTexture(GL_TEXTURE1);
+    gl->BindTexture(GL_TEXTURE_2D, gl->glow[gl->current]);
+    gl->Viewport(0, 0, w, h);
+    gl->DrawArrays(GL_TRIANGLES, 0, 3);
+    SDL_GL_SwapWindow(sdl.window);
+}
+
+// Draw the display as one rect per pixel (fallback renderer)
+void redraw_screen_rects(const sdl_t sdl, const config_t config, chip8_t *chip8) {
     SDL_Rect rect = {.x=0, .y = 0, .w = config.scale_factor, .h = config.scale_factor};
 
+    // display_pixel indexes the palette: unlit, first plane, second plane, both planes
+    const uint32_t palette[4] = {config.bg_color, config.fg_color, config.plane2_color, config.both_color};
     // Grab bg color values to draw outlines
-    const uint8_t fg_r = (config.fg_color >> 24) & 0xFF;
-    const uint8_t fg_g = (config.fg_color >> 16) & 0xFF;
-    const uint8_t fg_b = (config.fg_color >>  8) & 0xFF;
-    const uint8_t fg_a = (config.fg_color >>  0) & 0xFF;
-    // Grab fg color vals to draw rectangles
     const uint8_t bg_r = (config.bg_color >> 24) & 0xFF;
     const uint8_t bg_g = (config.bg_color >> 16) & 0xFF;
     const uint8_t bg_b = (config.bg_color >>  8) & 0xFF;
     const uint8_t bg_a = (config.bg_color >>  0) & 0xFF;
     // loop and draw a rectangle per pixel to the window
-    for (uint32_t i = 0; i < sizeof(chip8->display); i++){
+    // hi-res pixels are half as big, rounded per edge so odd scales still fill the window
+    const uint32_t width = display_width(chip8, config), height = display_height(chip8, config);
+    const uint32_t s = config.scale_factor, hires = chip8->hires;
+    for (uint32_t i = 0; i < width * height; i++){
         // translate 1D index i value to 2D X/Y coords
-        // X = i % window width
-        // Y = i / window width
-        rect.x = (i % config.window_width) * config.scale_factor;
-        rect.y = (i / config.window_width) * config.scale_factor;
-
-        if (chip8->display[i]) {
-            // Pixel is on, draw foreground color
-            SDL_SetRenderDrawColor(sdl.renderer, fg_r, fg_g, fg_b, fg_a);
+        // X = i % width
+        // Y = i / width
+        const uint32_t x = i % width, y = i / width;
+        rect.x = (x * s) >> hires;
+        rect.y = (y * s) >> hires;
+        rect.w = (((x + 1) * s) >> hires) - rect.x;
+        rect.h = (((y + 1) * s) >> hires) - rect.y;
+
+        const uint8_t pixel = display_pixel(chip8, x, y);
+        if (pixel) {
+            // Pixel is on, draw its plane color
+            const uint32_t color = palette[pixel];
+            SDL_SetRenderDrawColor(sdl.renderer, color >> 24, (color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF);
             SDL_RenderFillRect(sdl.renderer, &rect);
             // if user requested drawing pixel outlines draw those now
             if(config.pixel_outlines){
@@ -207,24 +1361,160 @@ void redraw_screen(const sdl_t sdl, const config_t config, chip8_t *chip8) {
     SDL_RenderPresent(sdl.renderer);
 }
 
-// handle user input
-// CHIP8 Keypad     QWERTY
-// 123C             1234
-// 456D             qwer
-// 789E             asdf
-// A0BF             zxcv
-void handle_input(chip8_t *chip8){
-    SDL_Event event;
-    while(SDL_PollEvent(&event)){
-        switch(event.type){
-            case SDL_QUIT:              //Exit window; End program
-                chip8->state = QUIT;    //Will exit main emulator loop
-                return;
-            case SDL_KEYDOWN:
-                switch(event.key.keysym.sym){
-                    case SDLK_ESCAPE:   //Escape key; pause the execution
-                        if(chip8->state == RUNNING){
-                            chip8->state = PAUSED;
+// Expand the damaged part of the display into the streaming texture
+// and scale it to the window with one copy
+void redraw_screen_texture(const sdl_t sdl, const config_t config, chip8_t *chip8) {
+    // clamp the damaged region to the display
+    const uint32_t width = display_width(chip8, config), height = display_height(chip8, config);
+    const uint32_t x2 = chip8->damage.x2 < width ? chip8->damage.x2 : width - 1;
+    const uint32_t y2 = chip8->damage.y2 < height ? chip8->damage.y2 : height - 1;
+    // the texture is hi-res sized, a lo-res pixel covers t x t texels
+    const int t = chip8->hires ? 1 : 2;
+    const SDL_Rect dirty = {.x = chip8->damage.x1 * t, .y = chip8->damage.y1 * t,
+                            .w = (x2 - chip8->damage.x1 + 1) * t, .h = (y2 - chip8->damage.y1 + 1) * t};
+    void *pixels;
+    int pitch;
+    // vsync presents every refresh, the texture only changes when something was drawn
+    if(chip8->draw){
+        if(SDL_LockTexture(sdl.texture, &dirty, &pixels, &pitch) != 0){
+            SDL_Log("Could not lock SDL texture %s\n", SDL_GetError());
+            return;
+        }
+        // texture is RGBA8888, same packing as the config colors
+        // pixels points at the top left of the locked region
+        const uint32_t palette[4] = {config.bg_color, config.fg_color, config.plane2_color, config.both_color};
+        for(int y = 0; y < dirty.h; y += t){
+            uint32_t *row = (uint32_t *)((uint8_t *)pixels + y * pitch);
+            for(int x = 0; x < dirty.w; x += t){
+                const uint32_t color = palette[display_pixel(chip8, (dirty.x + x) / t, (dirty.y + y) / t)];
+                for(int i = 0; i < t; i++) row[x + i] = color;
+            }
+            // lo-res rows are doubled by copying the row just expanded
+            if(t == 2) memcpy((uint8_t *)row + pitch, row, dirty.w * sizeof *row);
+        }
+        SDL_UnlockTexture(sdl.texture);
+    }
+    SDL_RenderCopy(sdl.renderer, sdl.texture, NULL, NULL);
+
+    // if user requested drawing pixel outlines draw the whole grid in one call
+    if(config.pixel_outlines){
+        const uint8_t bg_r = (config.bg_color >> 24) & 0xFF;
+        const uint8_t bg_g = (config.bg_color >> 16) & 0xFF;
+        const uint8_t bg_b = (config.bg_color >>  8) & 0xFF;
+        const uint8_t bg_a = (config.bg_color >>  0) & 0xFF;
+        SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
+        SDL_RenderFillRects(sdl.renderer, sdl.outlines[chip8->hires], sdl.outline_count[chip8->hires]);
+    }
+    SDL_RenderPresent(sdl.renderer);
+}
+
+// Update window with any changes, frames without damage are not redrawn or presented
+void redraw_screen(const sdl_t sdl, const config_t config, chip8_t *chip8) {
+    // with vsync the present is what paces the loop, so present even when nothing changed
+    // and keep presenting while pixels that went dark are still fading
+    if(!chip8->draw && !sdl.vsync && !(sdl.gl && sdl.gl->fading)) return;
+#ifdef PROFILE
+    const uint64_t start = SDL_GetPerformanceCounter();
+#endif
+    // the rect renderer redraws the whole back buffer as its contents are undefined after a present
+    if(sdl.gl) redraw_screen_gl(sdl, config, chip8);
+    else if(sdl.texture) redraw_screen_texture(sdl, config, chip8);
+    else redraw_screen_rects(sdl, config, chip8);
+    chip8->draw = false;
+#ifdef PROFILE
+    if(chip8->profile) chip8->profile->redraw_ticks += SDL_GetPerformanceCounter() - start;
+#endif
+}
+
+// Grow the damaged display region to cover the given pixel rectangle
+void add_damage(chip8_t *chip8, uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2){
+    chip8->effects++;
+    if(!chip8->draw){
+        chip8->damage = (damage_t){x1, y1, x2, y2};
+        chip8->draw = true;
+        return;
+    }
+    if(x1 < chip8->damage.x1) chip8->damage.x1 = x1;
+    if(y1 < chip8->damage.y1) chip8->damage.y1 = y1;
+    if(x2 > chip8->damage.x2) chip8->damage.x2 = x2;
+    if(y2 > chip8->damage.y2) chip8->damage.y2 = y2;
+}
+
+// Queue a keypad key going down or up at host time, the scheduler applies it at the matching cycle
+void queue_key(chip8_t *chip8, uint64_t time, uint16_t key, bool down){
+    const uint16_t before = chip8->key_count ?
+        chip8->key_queue[(chip8->key_head + chip8->key_count - 1) % KEY_QUEUE].keys : chip8->keypad;
+    const uint16_t keys = down ? before | key : before & ~key;
+    if(keys == before) return;  // key repeat
+    if(chip8->key_count == KEY_QUEUE){
+        // every change carries the whole keypad, losing the oldest only loses its timing
+        chip8->key_head = (chip8->key_head + 1) % KEY_QUEUE;
+        chip8->key_count--;
+    }
+    chip8->key_queue[(chip8->key_head + chip8->key_count++) % KEY_QUEUE] = (key_event_t){time, keys};
+    if(down && !chip8->latency.since){
+        chip8->latency.since = time;
+        chip8->latency.shown = display_hash(chip8);
+    }
+}
+
+// handle user input, keypad keys are looked up by scancode in keymap and queued with
+// the time SDL saw them, everything else is a hotkey
+void handle_input(chip8_t *chip8){
+    SDL_Event event;
+    // event timestamps are SDL_GetTicks milliseconds, the scheduler runs on the performance counter
+    const uint64_t now = SDL_GetPerformanceCounter();
+    const uint64_t freq = SDL_GetPerformanceFrequency();
+    const uint32_t ticks = SDL_GetTicks();
+    while(SDL_PollEvent(&event)){
+        switch(event.type){
+            case SDL_QUIT:              //Exit window; End program
+                chip8->state = QUIT;    //Will exit main emulator loop
+                return;
+            case SDL_WINDOWEVENT:
+                switch(event.window.event){
+                    case SDL_WINDOWEVENT_MINIMIZED:
+                    case SDL_WINDOWEVENT_HIDDEN:
+                        chip8->window |= WINDOW_HIDDEN;
+                        break;
+                    case SDL_WINDOWEVENT_RESTORED:
+                    case SDL_WINDOWEVENT_MAXIMIZED:
+                    case SDL_WINDOWEVENT_SHOWN:
+                    case SDL_WINDOWEVENT_EXPOSED:
+                        //window contents were lost or not kept up; present the whole display again
+                        chip8->window &= ~WINDOW_HIDDEN;
+                        add_damage(chip8, 0, 0, 0xFF, 0xFF);
+                        break;
+                    case SDL_WINDOWEVENT_FOCUS_LOST: chip8->window |= WINDOW_UNFOCUSED; break;
+                    case SDL_WINDOWEVENT_FOCUS_GAINED: chip8->window &= ~WINDOW_UNFOCUSED; break;
+                    default: break;
+                }
+                break;
+            case SDL_KEYDOWN:
+            case SDL_KEYUP:{
+                const bool down = event.type == SDL_KEYDOWN;
+                const uint16_t key = keymap[event.key.keysym.scancode];
+                if(key){
+                    const int32_t age = ticks - event.key.timestamp;   // events after ticks count as now
+                    queue_key(chip8, now - (age > 0 ? age * freq / 1000 : 0), key, down);
+                    break;
+                }
+                if(!down){
+                    if(event.key.keysym.sym == SDLK_BACKSPACE) chip8->rewind_held = false;
+                    break;
+                }
+                if(event.key.repeat) break; //held hotkeys fire once, not at the key-repeat rate
+                switch(event.key.keysym.sym){
+                    case SDLK_F5: chip8->hotkeys |= HOTKEY_SAVE; break;   //F5; save state
+                    case SDLK_F8: chip8->hotkeys |= HOTKEY_LOAD; break;   //F8; load state
+#ifdef TRACE
+                    case SDLK_F9: chip8->hotkeys |= HOTKEY_TRACE; break;  //F9; dump the trace ring
+#endif
+                    case SDLK_BACKSPACE: chip8->rewind_held = true; break; //Backspace; rewind while held
+                    case SDLK_TAB: chip8->hotkeys |= HOTKEY_TURBO; break;  //Tab; toggle fast-forward
+                    case SDLK_ESCAPE:   //Escape key; pause the execution
+                        if(chip8->state == RUNNING){
+                            chip8->state = PAUSED;
                             puts("===PAUSED===");
                         }
                         else{
@@ -232,60 +1522,31 @@ void handle_input(chip8_t *chip8){
                             puts("===RUNNING===");
                         }
                         return;
-                    // map qwerty keys to CHIP8 keypad
-                    case SDLK_1: chip8->keypad[0x1] = true; break;
-                    case SDLK_2: chip8->keypad[0x2] = true; break;
-                    case SDLK_3: chip8->keypad[0x3] = true; break;
-                    case SDLK_4: chip8->keypad[0xC] = true; break;
-
-                    case SDLK_q: chip8->keypad[0x4] = true; break;
-                    case SDLK_w: chip8->keypad[0x5] = true; break;
-                    case SDLK_e: chip8->keypad[0x6] = true; break;
-                    case SDLK_r: chip8->keypad[0xD] = true; break;
-
-                    case SDLK_a: chip8->keypad[0x7] = true; break;
-                    case SDLK_s: chip8->keypad[0x8] = true; break;
-                    case SDLK_d: chip8->keypad[0x9] = true; break;
-                    case SDLK_f: chip8->keypad[0xE] = true; break;
-
-                    case SDLK_z: chip8->keypad[0xA] = true; break;
-                    case SDLK_x: chip8->keypad[0x0] = true; break;
-                    case SDLK_c: chip8->keypad[0xB] = true; break;
-                    case SDLK_v: chip8->keypad[0xF] = true; break;
                     default: break;
                 }
                 break;
-            case SDL_KEYUP:
-                switch(event.key.keysym.sym){
-                    // map qwerty keys to CHIP8 keypad
-                    case SDLK_1: chip8->keypad[0x1] = false; break;
-                    case SDLK_2: chip8->keypad[0x2] = false; break;
-                    case SDLK_3: chip8->keypad[0x3] = false; break;
-                    case SDLK_4: chip8->keypad[0xC] = false; break;
-
-                    case SDLK_q: chip8->keypad[0x4] = false; break;
-                    case SDLK_w: chip8->keypad[0x5] = false; break;
-                    case SDLK_e: chip8->keypad[0x6] = false; break;
-                    case SDLK_r: chip8->keypad[0xD] = false; break;
-
-                    case SDLK_a: chip8->keypad[0x7] = false; break;
-                    case SDLK_s: chip8->keypad[0x8] = false; break;
-                    case SDLK_d: chip8->keypad[0x9] = false; break;
-                    case SDLK_f: chip8->keypad[0xE] = false; break;
-
-                    case SDLK_z: chip8->keypad[0xA] = false; break;
-                    case SDLK_x: chip8->keypad[0x0] = false; break;
-                    case SDLK_c: chip8->keypad[0xB] = false; break;
-                    case SDLK_v: chip8->keypad[0xF] = false; break;
-                    default: break;
-                }
+            }
             default:
                 break;
         }
     }
 }
 
-#ifdef DEBUG
+// Whether --background applies to the window as handle_input last saw it
+bool in_background(const chip8_t *chip8, const config_t config){
+    const uint8_t away = config.background == BACKGROUND_RUN ? WINDOW_HIDDEN : WINDOW_HIDDEN | WINDOW_UNFOCUSED;
+    return chip8->window & away;
+}
+
+#define WAIT_EVENT_MS 100    // longest a paused or hidden loop sleeps without an event
+
+// Block until SDL has an event for handle_input, a paused or hidden loop has nothing else to do
+// The timeout bounds the sleep, so the loops still come round if no event ever arrives
+void wait_for_event(void){
+    SDL_WaitEventTimeout(NULL, WAIT_EVENT_MS);  // leaves the event queued
+}
+
+#if defined(DEBUG) || defined(TRACE)
 void print_debug_info(chip8_t *chip8){
     //print debug info
     //decode opcode
@@ -297,10 +1558,22 @@ void print_debug_info(chip8_t *chip8){
                 //0x00E0: Clear the screen
                 printf("Clear Screen\n");
             }
+            else if((chip8->inst.opcode & 0xFFF0) == 0x00C0 || (chip8->inst.opcode & 0xFFF0) == 0x00D0){
+                printf("Scroll %s %d rows\n", chip8->inst.Y == 0xC ? "down" : "up", chip8->inst.N);
+            }
+            else if(chip8->inst.NN == 0xFB || chip8->inst.NN == 0xFC){
+                printf("Scroll %s 4 pixels\n", chip8->inst.NN == 0xFB ? "right" : "left");
+            }
+            else if(chip8->inst.NN == 0xFD){
+                printf("Exit interpreter\n");
+            }
+            else if(chip8->inst.NN == 0xFE || chip8->inst.NN == 0xFF){
+                printf("Switch to %s\n", chip8->inst.NN == 0xFF ? "128x64 hi-res" : "64x32 lo-res");
+            }
             else if(chip8->inst.NN == 0xEE){
                 //0x00EE: Return from subroutine
                 //Set program counter to last address on subroutine stack ("pop" it off the stack)
-                printf("Return from subroutine to address 0X%04X\n", *(chip8->stack_ptr-1));
+                printf("Return from subroutine to address 0X%04X\n", chip8->stack[chip8->sp - 1]);
             }
             else{
                 printf("Unimplemented Opcode.\n");
@@ -432,16 +1705,16 @@ void print_debug_info(chip8_t *chip8){
             if(chip8->inst.NN == 0x9E){
                 //skip next instruction if key stored in VX is pressed
                 printf("Skip next instruction if key in V%X is pressed; Keypad val:%d \n",
-                    chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X]]);
-                if(chip8->keypad[(chip8->V[chip8->inst.X] & 0xF)])
+                    chip8->V[chip8->inst.X], (chip8->keypad >> (chip8->V[chip8->inst.X] & 0xF)) & 1);
+                if(chip8->keypad & (1 << (chip8->V[chip8->inst.X] & 0xF)))
                     printf("Skip next opcode\n"); //skip next opcode/instruction
                 else printf("Do not skip next opcode\n");
             }
             else if (chip8->inst.NN == 0xA1) {
                 //skip next instruction if key stored in VX is not pressed
                 printf("Skip next instruction if key in V%X is not pressed; Keypad val:%d \n",
-                    chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X]]);
-                if(!chip8->keypad[(chip8->V[chip8->inst.X] & 0xF)])
+                    chip8->V[chip8->inst.X], (chip8->keypad >> (chip8->V[chip8->inst.X] & 0xF)) & 1);
+                if(!(chip8->keypad & (1 << (chip8->V[chip8->inst.X] & 0xF))))
                     printf("Skip next opcode\n"); //skip next opcode/instruction
                 else printf("Do not skip next opcode\n");
             }
@@ -501,6 +1774,9 @@ void print_debug_info(chip8_t *chip8){
                     printf("Fill the values of V0 to V%X with the values in memory starting from I\n",
                         chip8->inst.X);
                     break;
+                case 0x01:
+                    printf("Select planes %X\n", chip8->inst.X & 0x3);
+                    break;
                 default :
                     break;
             }
@@ -513,10 +1789,282 @@ void print_debug_info(chip8_t *chip8){
 }
 #endif
 
-//emulate CHIP8 instructions
-void emulate_chip8(chip8_t *chip8 , config_t config){
-    //fetch opcode from memory
-    chip8->inst.opcode = chip8->ram[chip8->PC] << 8 | chip8->ram[chip8->PC+1];
+// Seed the CXNN generator, neighbouring seeds are scrambled into unrelated streams
+void seed_random(chip8_t *chip8, uint32_t seed){
+    seed = (seed ^ 61) ^ (seed >> 16);
+    seed *= 9;
+    seed ^= seed >> 4;
+    seed *= 0x27D4EB2D;
+    seed ^= seed >> 15;
+    chip8->rng = seed ? seed : 0x9E3779B9;  // xorshift is stuck at 0
+}
+
+// Next random byte from the machine's own generator, so instances never share state
+uint8_t random_byte(chip8_t *chip8){
+    uint32_t x = chip8->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    chip8->rng = x;
+    return x >> 24;
+}
+
+// Row i of the sprite at addr, left aligned in a word, DXY0 (wide) rows are two bytes
+static inline uint64_t sprite_row(const chip8_t *chip8, uint16_t addr, uint8_t i, bool wide){
+    if(!wide) return (uint64_t)chip8->ram[(addr + i) & 0xFFF] << 56;
+    return (uint64_t)chip8->ram[(addr + 2*i) & 0xFFF] << 56 | (uint64_t)chip8->ram[(addr + 2*i + 1) & 0xFFF] << 48;
+}
+
+// DXY0 draws a 16x16 sprite in hi-res, and in lo-res when the profile says so
+static inline bool wide_sprite(const chip8_t *chip8, uint8_t N){
+    return !N && (chip8->hires || chip8->quirks & QUIRK_LORES_DXY0);
+}
+
+//0xDXYN: Draw N-height sprite at coords VX,VY; Read from memory location I;
+//Set VF to 1 if any pixels are flipped from set to unset
+//Each selected plane gets its own sprite, the next one starts right after the previous in RAM
+void draw_sprite(chip8_t *chip8, const config_t config, uint8_t X, uint8_t Y, uint8_t N){
+    const uint32_t width = display_width(chip8, config), height = display_height(chip8, config);
+    const uint8_t X_coord = chip8->V[X] % width;
+    const uint8_t Y_coord = chip8->V[Y] % height;
+    const bool wide = wide_sprite(chip8, N);
+    const uint8_t rows = wide ? 16 : N;
+
+    // sprites clip at the right/bottom edges, damage the clipped box
+    if(rows && chip8->planes){
+        const uint32_t X_end = X_coord + (wide ? 15u : 7u);
+        const uint32_t Y_end = Y_coord + rows - 1u;
+        add_damage(chip8, X_coord, Y_coord,
+                   X_end < width ? X_end : width - 1,
+                   Y_end < height ? Y_end : height - 1);
+    }
+
+    // line each sprite row up with its display word in a single shift, the bits shifted out
+    // go to the next word, or are clipped past the right edge
+    // a row collides if any lit sprite bit lands on a lit display bit
+    const uint8_t word = X_coord >> 6, shift = X_coord & 63;
+    const bool spill = shift && word + 1u < width >> 6;
+    uint16_t addr = chip8->I;
+    uint64_t collision = 0;
+    for(uint8_t p = 0; p < DISPLAY_PLANES; p++){
+        if(!(chip8->planes & 1 << p)) continue;
+        for (uint8_t i = 0; i < rows && Y_coord + i < height; i++){
+            uint64_t *row = chip8->display[p][Y_coord + i];
+            const uint64_t sprite = sprite_row(chip8, addr, i, wide);
+            collision |= row[word] & sprite >> shift;
+            row[word] ^= sprite >> shift;
+            if(spill){
+                collision |= row[word + 1] & sprite << (64 - shift);
+                row[word + 1] ^= sprite << (64 - shift);
+            }
+        }
+        addr += wide ? 32 : rows;
+    }
+    chip8->V[0xF] = collision != 0;
+}
+
+// DXYN with QUIRK_WRAP: pixels past the right edge come back on the left, rows past the
+// bottom at the top. A lo-res row is one word, so wrapping is a rotate, a hi-res row is two
+// and the bits shifted out of one word go into the other
+void draw_sprite_wrapped(chip8_t *chip8, const config_t config, uint8_t X, uint8_t Y, uint8_t N){
+    const uint32_t width = display_width(chip8, config), height = display_height(chip8, config);
+    const uint8_t X_coord = chip8->V[X] % width;
+    const uint8_t Y_coord = chip8->V[Y] % height;
+    const bool wide = wide_sprite(chip8, N);
+    const uint8_t rows = wide ? 16 : N;
+
+    if(rows && chip8->planes){
+        const uint32_t X_end = X_coord + (wide ? 15u : 7u);
+        const uint32_t Y_end = Y_coord + rows - 1u;
+        if(X_end < width && Y_end < height)
+            add_damage(chip8, X_coord, Y_coord, X_end, Y_end);
+        else
+            add_damage(chip8, 0, 0, 0xFF, 0xFF);    // split across edges, damage it all
+    }
+
+    const uint8_t word = X_coord >> 6, shift = X_coord & 63;
+    uint16_t addr = chip8->I;
+    uint64_t collision = 0;
+    for(uint8_t p = 0; p < DISPLAY_PLANES; p++){
+        if(!(chip8->planes & 1 << p)) continue;
+        for(uint8_t i = 0; i < rows; i++){
+            uint64_t *row = chip8->display[p][(Y_coord + i) % height];
+            const uint64_t sprite = sprite_row(chip8, addr, i, wide);
+            const uint64_t low = shift ? sprite << (64 - shift) : 0;
+            if(!chip8->hires){
+                const uint64_t rotated = sprite >> shift | low;
+                collision |= row[0] & rotated;
+                row[0] ^= rotated;
+                continue;
+            }
+            collision |= row[word] & sprite >> shift;
+            row[word] ^= sprite >> shift;
+            collision |= row[word ^ 1] & low;
+            row[word ^ 1] ^= low;
+        }
+        addr += wide ? 32 : rows;
+    }
+    chip8->V[0xF] = collision != 0;
+}
+
+//0x00E0: Clear the selected planes
+void clear_display(chip8_t *chip8){
+    for(uint8_t p = 0; p < DISPLAY_PLANES; p++)
+        if(chip8->planes & 1 << p) memset(chip8->display[p], 0, sizeof chip8->display[p]);
+    add_damage(chip8, 0, 0, 0xFF, 0xFF); //will update screen on next 60 hz tick
+}
+
+// 00CN, 00DN and 00FB-00FF, the SUPER-CHIP and XO-CHIP additions to the 0NNN space
+bool extended_0nnn(uint16_t opcode){
+    return (opcode & 0xFFE0) == 0x00C0 || (opcode >= 0x00FB && opcode <= 0x00FF);
+}
+
+// Run one extended_0nnn opcode. Scrolls move the selected planes of the current resolution,
+// rows are moved with memmove and columns with word shifts carrying into the next word
+void emulate_0nnn(chip8_t *chip8, const config_t config, uint16_t opcode){
+    const uint32_t height = display_height(chip8, config);
+    const uint8_t N = opcode & 0x0F;
+    if(opcode == 0x00FD){
+        //0x00FD: Exit the interpreter, halts on this instruction
+        chip8->PC -= 2;
+        return;
+    }
+    if(opcode == 0x00FE || opcode == 0x00FF){
+        //0x00FE/0x00FF: Switch to lo-res/hi-res, the display is cleared
+        chip8->hires = opcode == 0x00FF;
+        memset(chip8->display, 0, sizeof chip8->display);
+        add_damage(chip8, 0, 0, 0xFF, 0xFF);
+        return;
+    }
+    for(uint8_t p = 0; p < DISPLAY_PLANES; p++){
+        if(!(chip8->planes & 1 << p)) continue;
+        uint64_t (*rows)[DISPLAY_WORDS] = chip8->display[p];
+        const uint32_t n = N < height ? N : height;
+        if((opcode & 0xFFF0) == 0x00C0){
+            //0x00CN: Scroll down N rows
+            memmove(rows[n], rows[0], (height - n) * sizeof rows[0]);
+            memset(rows[0], 0, n * sizeof rows[0]);
+        }
+        else if((opcode & 0xFFF0) == 0x00D0){
+            //0x00DN: Scroll up N rows
+            memmove(rows[0], rows[n], (height - n) * sizeof rows[0]);
+            memset(rows[height - n], 0, n * sizeof rows[0]);
+        }
+        else if(opcode == 0x00FB){
+            //0x00FB: Scroll right 4 pixels, lo-res drops what leaves word 0
+            for(uint32_t y = 0; y < height; y++){
+                if(chip8->hires) rows[y][1] = rows[y][1] >> 4 | rows[y][0] << 60;
+                rows[y][0] >>= 4;
+            }
+        }
+        else{
+            //0x00FC: Scroll left 4 pixels, word 1 is always 0 in lo-res
+            for(uint32_t y = 0; y < height; y++){
+                rows[y][0] = rows[y][0] << 4 | rows[y][1] >> 60;
+                rows[y][1] <<= 4;
+            }
+        }
+    }
+    add_damage(chip8, 0, 0, 0xFF, 0xFF);
+}
+
+#define CODE_PAGE_SHIFT 6   // static analysis pages are 64 bytes, one bit each of a uint64_t
+
+// Pages of addr..addr+len-1, inside RAM
+uint64_t code_page_span(uint16_t addr, uint16_t len){
+    const uint32_t first = addr >> CODE_PAGE_SHIFT, last = (addr + len - 1u) >> CODE_PAGE_SHIFT;
+    return (~0ull >> (63 - last)) & (~0ull << first);
+}
+
+// Drop pre-decoded and translated code overlapping addr..addr+len-1, inside RAM
+void invalidate_range(chip8_t *chip8, uint16_t addr, uint16_t len){
+    // pages the static analysis proved are never run hold no code to drop
+    if(!(code_page_span(addr, len) & ~chip8->data_pages)) return;
+#ifdef HAVE_JIT
+    if(chip8->jit) jit_invalidate(chip8, addr, len);
+#endif
+    if(!chip8->decoded) return;
+    for(uint32_t i = addr >> 1; i <= (addr + len - 1u) >> 1; i++)
+        chip8->decoded[i].handler = OP_DECODE;
+}
+
+// Drop code overlapping the runs of addr..addr+len-1 where RAM differs from ram, inside RAM
+// Whole-range invalidation would flush the JIT for a data byte sharing the range with code
+void invalidate_changed(chip8_t *chip8, const uint8_t *ram, uint16_t addr, uint16_t len){
+    for(uint32_t i = addr; i < addr + len; i++){
+        if(chip8->ram[i] == ram[i]) continue;
+        const uint32_t start = i;
+        while(i < addr + len && chip8->ram[i] != ram[i]) i++;
+        invalidate_range(chip8, start, i - start);
+    }
+}
+
+// RAM from addr to addr+len-1 was written, drop pre-decoded instructions overlapping it
+// so self-modifying ROMs see their new code. Writes past the end of RAM wrap to its start
+void invalidate_code(chip8_t *chip8, uint16_t addr, uint16_t len){
+    chip8->effects++;
+    addr &= 0xFFF;
+    const uint16_t wrapped = addr + len > sizeof chip8->ram ? addr + len - sizeof chip8->ram : 0;
+    if(wrapped) invalidate_range(chip8, 0, wrapped);
+    invalidate_range(chip8, addr, len - wrapped);
+}
+
+// Called at a backward jump to PC with left instructions still to run. If the machine was
+// here before in exactly the same state and nothing was drawn or written since, the loop
+// can only repeat until the frame ends (timers and keys change between runs), so skip
+// whole periods of it. Returns the number of instructions skipped, the state after them
+// is the state now, so skipping is invisible apart from the host CPU it saves
+uint64_t idle_skip(chip8_t *chip8, const config_t config, uint16_t PC, uint64_t left){
+    idle_t *idle = &chip8->idle;
+    if(!config.idle_skip || --idle->countdown) return 0;
+    idle->countdown = IDLE_SAMPLE;
+    const uint8_t sp = chip8->sp;
+    if(idle->PC == PC && idle->left > left && idle->effects == chip8->effects &&
+       idle->I == chip8->I && idle->sp == sp && idle->rng == chip8->rng &&
+       idle->delay_timer == chip8->delay_timer && idle->sound_timer == chip8->sound_timer &&
+       memcmp(idle->V, chip8->V, sizeof idle->V) == 0 &&
+       memcmp(idle->stack, chip8->stack, sp * sizeof *idle->stack) == 0){
+        const uint64_t period = idle->left - left;
+        const uint64_t skip = left / period * period;
+        idle->left = left - skip;
+        idle->skipped += skip;
+#ifdef TRACE
+        if(chip8->trace) chip8->trace->cycle += skip;
+#endif
+        return skip;
+    }
+    idle->PC = PC;
+    idle->I = chip8->I;
+    memcpy(idle->V, chip8->V, sizeof idle->V);
+    memcpy(idle->stack, chip8->stack, sp * sizeof *idle->stack);
+    idle->sp = sp;
+    idle->delay_timer = chip8->delay_timer;
+    idle->sound_timer = chip8->sound_timer;
+    idle->rng = chip8->rng;
+    idle->effects = chip8->effects;
+    idle->left = left;
+    return 0;
+}
+
+#ifdef TRACE
+// Append the instruction that just ran at PC to the trace ring
+void trace_instruction(chip8_t *chip8, uint16_t PC){
+    trace_t *trace = chip8->trace;
+    trace->records[trace->count++ & (TRACE_RECORDS - 1)] = (trace_record_t){
+        .cycle = trace->cycle++, .PC = PC, .opcode = chip8->inst.opcode,
+        .I = chip8->I, .VX = chip8->V[chip8->inst.X], .VF = chip8->V[0xF],
+    };
+}
+#endif
+
+// Execute one instruction with the given quirks. Always inlined with a constant quirks,
+// so each profile gets an interpreter of its own with the quirk tests folded away
+static inline __attribute__((always_inline)) void emulate_quirks(chip8_t *chip8, const config_t config, const uint8_t quirks){
+#if defined(TRACE) || defined(PROFILE)
+    const uint16_t fetch_PC = chip8->PC;    // address of this instruction, PC moves on below
+#endif
+    //fetch opcode from memory, addresses wrap around the 4KB like on the VIP
+    chip8->inst.opcode = chip8->ram[chip8->PC & 0xFFF] << 8 | chip8->ram[(chip8->PC+1) & 0xFFF];
     chip8->PC += 2; //increment program counter
 
     //handle the constants
@@ -529,19 +2077,34 @@ void emulate_chip8(chip8_t *chip8 , config_t config){
 #ifdef DEBUG
     print_debug_info(chip8);
 #endif
+#ifdef PROFILE
+    if(chip8->profile){
+        //count the opcode class, the address it ran at and the sprite height
+        const uint8_t op = chip8->inst.opcode >> 12;
+        const uint8_t sub = op == 0x8 ? chip8->inst.N :
+                            op == 0xE || op == 0xF || (op == 0x0 && !chip8->inst.X) ? chip8->inst.NN : 0;
+        chip8->profile->opcodes[op][sub]++;
+        chip8->profile->pcs[fetch_PC & 0xFFF]++;
+        if(op == 0xD) chip8->profile->sprite_rows[chip8->inst.N]++;
+    }
+#endif
 
     //decode opcode
     switch ((chip8->inst.opcode >> 12) & 0x0F){
         case 0x0:
             if(chip8->inst.NN == 0xE0){
                 //0x00E0: Clear the screen
-                memset(&chip8->display[0], false, sizeof chip8->display);
-                chip8->draw = true; //will update screen on next 60 hz tick
+                clear_display(chip8);
             }
             else if(chip8->inst.NN == 0xEE){
                 //0x00EE: Return from subroutine
                 //Set program counter to last address on subroutine stack ("pop" it off the stack)
-                chip8->PC = *--chip8->stack_ptr;
+                //returning with an empty stack does nothing
+                if(chip8->sp > 0) chip8->PC = chip8->stack[--chip8->sp];
+            }
+            else if(extended_0nnn(chip8->inst.opcode)){
+                //0x00CN/0x00DN/0x00FB-0x00FF: scroll, exit and resolution switches
+                emulate_0nnn(chip8, config, chip8->inst.opcode);
             }
             else{
                 // unimplemented opcode
@@ -553,7 +2116,9 @@ void emulate_chip8(chip8_t *chip8 , config_t config){
             break;
         case 0x02:
             //0x2NNN: Call subroutine at NNN
-            *chip8->stack_ptr++ = chip8->PC;                    // push current address to stack
+            //with all 12 stack entries in use the return address is dropped
+            if(chip8->sp < 12)
+                chip8->stack[chip8->sp++] = chip8->PC;                // push current address to stack
             chip8->PC = chip8->inst.NNN;                        //set program counter to subroutine address
             break;
         case 0x03:
@@ -588,14 +2153,17 @@ void emulate_chip8(chip8_t *chip8 , config_t config){
                 case 0x1:
                     //0x8XY1: Set register VX |= VY
                     chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
+                    if(quirks & QUIRK_VF_RESET) chip8->V[0xF] = 0;
                     break;
                 case 0x2:
                     //0x8XY2: Set register VX &= VY
                     chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
+                    if(quirks & QUIRK_VF_RESET) chip8->V[0xF] = 0;
                     break;
                 case 0x3:
                     //0x8XY3: Set register VX ^= VY
                     chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
+                    if(quirks & QUIRK_VF_RESET) chip8->V[0xF] = 0;
                     break;
                 case 0x4:
                     //0x8XY4: Set register VX += VY, set VF to 1 if carry
@@ -608,9 +2176,15 @@ void emulate_chip8(chip8_t *chip8 , config_t config){
                     chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
                     break;
                 case 0x6:
-                    //0x8XY6: Set register VX >>= 1, store shifted off bit in VF
-                    chip8->V[0xF] = chip8->V[chip8->inst.X] & 1;
-                    chip8->V[chip8->inst.X] >>= 1;
+                    //0x8XY6: Set register VX >>= 1 (VX = VY >> 1 with QUIRK_SHIFT_VY), store shifted off bit in VF
+                    if(quirks & QUIRK_SHIFT_VY){
+                        chip8->V[0xF] = chip8->V[chip8->inst.Y] & 1;
+                        chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] >> 1;
+                    }
+                    else{
+                        chip8->V[0xF] = chip8->V[chip8->inst.X] & 1;
+                        chip8->V[chip8->inst.X] >>= 1;
+                    }
                     break;
                 case 0x7:
                     //0x8XY7: Set register VX = VY - VX, set VF to 1 if there is not a borrow (result is positive/0)
@@ -618,9 +2192,15 @@ void emulate_chip8(chip8_t *chip8 , config_t config){
                     chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
                     break;
                 case 0xE:
-                    //0x8XYE: Set register VX <<= 1, store shifted off bit in VF
-                    chip8->V[0xF] = (chip8->V[chip8->inst.X] & 0x80) >> 7;
-                    chip8->V[chip8->inst.X] <<= 1;
+                    //0x8XYE: Set register VX <<= 1 (VX = VY << 1 with QUIRK_SHIFT_VY), store shifted off bit in VF
+                    if(quirks & QUIRK_SHIFT_VY){
+                        chip8->V[0xF] = (chip8->V[chip8->inst.Y] & 0x80) >> 7;
+                        chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] << 1;
+                    }
+                    else{
+                        chip8->V[0xF] = (chip8->V[chip8->inst.X] & 0x80) >> 7;
+                        chip8->V[chip8->inst.X] <<= 1;
+                    }
                     break;
                 default:
                     //handle unexpected N val
@@ -641,52 +2221,31 @@ void emulate_chip8(chip8_t *chip8 , config_t config){
             break;
 
         case 0x0B:
-            //0xBNNN: Jump to V0 + NNN
-            chip8->PC = chip8->V[0] + chip8->inst.NNN;
+            //0xBNNN: Jump to V0 + NNN, with QUIRK_JUMP_VX BXNN: jump to VX + XNN
+            chip8->PC = chip8->V[quirks & QUIRK_JUMP_VX ? chip8->inst.X : 0] + chip8->inst.NNN;
             break;
 
         case 0x0C:
             //0xCXNN: Set register VX to random number between 0 and 255 and do AND operation with NN
-            chip8->V[chip8->inst.X] = (rand() % 256) & chip8->inst.NN;
+            chip8->V[chip8->inst.X] = random_byte(chip8) & chip8->inst.NN;
             break;
 
-        case 0x0D: {
+        case 0x0D:
             //0xDXYN: Draw N-height sprite at coords X,Y; Read from memory location I;
             //Set VF to 1 if any pixels are flipped from set to unset
-            uint8_t X_coord = chip8->V[chip8->inst.X] % config.window_width;
-            uint8_t Y_coord = chip8->V[chip8->inst.Y] % config.window_height;
-            const uint8_t org_X = X_coord; // save the initial value of x coordinate
-
-            chip8->V[0xF] = 0; //initailize carry to 1
-            for (uint8_t i = 0; i < chip8->inst.N; i++){
-                // set the sprite data starting from the address in the I register
-                const uint8_t sprite_data = chip8->ram[chip8->I+i];
-                X_coord = org_X;
-
-                for (int8_t j = 7; j>=0; j--){
-                    bool *pixel = &chip8->display[Y_coord * config.window_width + X_coord];
-                    const bool sprite_bit = (sprite_data & (1<<j));
-                    if(sprite_bit && *pixel){
-                        chip8->V[0xF] = 1;
-                    }
-                    *pixel ^= sprite_bit;
-                    if(++X_coord >=config.window_width) break;
-                }
-                if(++Y_coord >=config.window_height) break;
-            }
-            chip8->draw = true;
+            if(quirks & QUIRK_WRAP) draw_sprite_wrapped(chip8, config, chip8->inst.X, chip8->inst.Y, chip8->inst.N);
+            else draw_sprite(chip8, config, chip8->inst.X, chip8->inst.Y, chip8->inst.N);
             break;
-        }
         case 0x0E:
             if(chip8->inst.NN == 0x9E){
                 //skip next instruction if key stored in VX is pressed
-                if(chip8->keypad[(chip8->V[chip8->inst.X] & 0x0F)]){ //avoid seg faults by extracting the last nibble
+                if(chip8->keypad & (1 << (chip8->V[chip8->inst.X] & 0x0F))){ //keys are nibbles, bit n = key n
                     chip8->PC += 2;
                 }
             }
             else if (chip8->inst.NN == 0xA1) {
                 //skip next instruction if key stored in VX is not pressed
-                if(!chip8->keypad[(chip8->V[chip8->inst.X] & 0x0F)]){ //avoid seg faults by extracting the last nibble
+                if(!(chip8->keypad & (1 << (chip8->V[chip8->inst.X] & 0x0F)))){ //keys are nibbles, bit n = key n
                     chip8->PC += 2;
                 }
             }
@@ -694,6 +2253,11 @@ void emulate_chip8(chip8_t *chip8 , config_t config){
 
         case 0x0F:
             switch(chip8->inst.NN){
+                case 0x01:
+                    // XO-CHIP FN01: select the planes drawing, clearing and scrolling act on
+                    chip8->planes = chip8->inst.X & 0x3;
+                    break;
+
                 case 0x07:
                     //set VX to the value of delay timer
                     chip8->V[chip8->inst.X] = chip8->delay_timer;
@@ -702,15 +2266,11 @@ void emulate_chip8(chip8_t *chip8 , config_t config){
                 case 0x0A:
                     // a key press is awaited so reset PC to temporarily stop exec
                     // blocks all instruction until key event and store key press in vx
-                    bool key_pressed = true;
-                    for(uint8_t i = 0; i < sizeof chip8->keypad; i++){
-                        if(chip8->keypad[i]){
-                            chip8->V[chip8->inst.X] = i;
-                            key_pressed = true;
-                            break;
-                        }
+                    // the lowest key held wins
+                    if(chip8->keypad){
+                        chip8->V[chip8->inst.X] = __builtin_ctz(chip8->keypad);
                     }
-                    if (!key_pressed){
+                    else{
                         chip8->PC -= 2;
                     }
                     break;
@@ -741,24 +2301,28 @@ void emulate_chip8(chip8_t *chip8 , config_t config){
                 case 0x33:
                     // store the binary coded decimal of the value in chip8->V[chip8->inst.X] in memory starting from I
                     uint8_t value = chip8->V[chip8->inst.X];
-                    chip8->ram[chip8->I+2] = value % 10;
+                    chip8->ram[(chip8->I+2) & 0xFFF] = value % 10;
                     value /= 10;
-                    chip8->ram[chip8->I+1] = value % 10;
+                    chip8->ram[(chip8->I+1) & 0xFFF] = value % 10;
                     value /= 10;
-                    chip8->ram[chip8->I] = value;
+                    chip8->ram[chip8->I & 0xFFF] = value;
+                    invalidate_code(chip8, chip8->I, 3);
                     break;
                 case 0x55:
                     // store the values of V0 to Vx in memory starting from I
-                    // Schip does not increment I register
+                    // Schip does not increment I register, the VIP and XO-CHIP do (QUIRK_MEMORY_I)
                     for(uint8_t i = 0; i <= chip8->inst.X; i++){
-                        chip8->ram[chip8->I + i] = chip8->V[i];
+                        chip8->ram[(chip8->I + i) & 0xFFF] = chip8->V[i];
                     }
+                    invalidate_code(chip8, chip8->I, chip8->inst.X + 1);
+                    if(quirks & QUIRK_MEMORY_I) chip8->I += chip8->inst.X + 1;
                     break;
                 case 0x65:
                     // load the values of V0 to Vx with the values in memory starting from I
                     for(uint8_t i = 0; i <= chip8->inst.X; i++){
-                        chip8->V[i] = chip8->ram[chip8->I + i];
+                        chip8->V[i] = chip8->ram[(chip8->I + i) & 0xFFF];
                     }
+                    if(quirks & QUIRK_MEMORY_I) chip8->I += chip8->inst.X + 1;
                     break;
                 default:
                     break;
@@ -766,70 +2330,4943 @@ void emulate_chip8(chip8_t *chip8 , config_t config){
         default:
             break; //unexpected opcode
     }
+#ifdef TRACE
+    if(chip8->trace) trace_instruction(chip8, fetch_PC);
+#endif
 }
 
-//update the timers
-void update_timers(chip8_t *chip8){
-    if(chip8->delay_timer > 0) chip8->delay_timer--;
-    if(chip8->sound_timer > 0) chip8->sound_timer--;
-    // play sound if sound timer is greater than 0
-    // else stop the sound
+// The interpreter of each quirk profile
+void emulate_chip8_plain(chip8_t *chip8, const config_t config){ emulate_quirks(chip8, config, QUIRKS_CHIP8); }
+void emulate_vip(chip8_t *chip8, const config_t config){ emulate_quirks(chip8, config, QUIRKS_VIP); }
+void emulate_schip(chip8_t *chip8, const config_t config){ emulate_quirks(chip8, config, QUIRKS_SCHIP); }
+void emulate_xochip(chip8_t *chip8, const config_t config){ emulate_quirks(chip8, config, QUIRKS_XOCHIP); }
+
+//emulate CHIP8 instructions, one at a time in the interpreter of the machine's quirk profile
+void emulate_chip8(chip8_t *chip8 , config_t config){
+    switch(chip8->quirks){
+        case QUIRKS_VIP: emulate_vip(chip8, config); break;
+        case QUIRKS_SCHIP: emulate_schip(chip8, config); break;
+        case QUIRKS_XOCHIP: emulate_xochip(chip8, config); break;
+        default: emulate_chip8_plain(chip8, config); break;
+    }
 }
 
-//main sequence
-int main(int argc, char **argv){
-    //Default usage message for args
-    if(argc < 2){
-        fprintf(stderr, "Usage: %s <rom_name>\n", argv[0]);
-        exit(EXIT_FAILURE);
+// Decode the instruction at addr into its threaded handler and operands
+decoded_t decode_instruction(const chip8_t *chip8, uint16_t addr){
+    const uint16_t opcode = chip8->ram[addr] << 8 | chip8->ram[addr+1];
+    decoded_t op = {
+        .handler = OP_NOP,
+        .X = (opcode & 0x0F00) >> 8,
+        .Y = (opcode & 0x00F0) >> 4,
+        .NN = opcode & 0x00FF,
+        .NNN = opcode & 0x0FFF,
+    };
+    switch((opcode >> 12) & 0x0F){
+        case 0x0:
+            if(op.NN == 0xE0) op.handler = OP_00E0;
+            else if(op.NN == 0xEE) op.handler = OP_00EE;
+            else if(extended_0nnn(opcode)) op.handler = OP_SLOW;
+            break;
+        case 0x1: op.handler = OP_1NNN; break;
+        case 0x2: op.handler = OP_2NNN; break;
+        case 0x3: op.handler = OP_3XNN; break;
+        case 0x4: op.handler = OP_4XNN; break;
+        case 0x5: op.handler = OP_5XY0; break;
+        case 0x6: op.handler = OP_6XNN; break;
+        case 0x7: op.handler = OP_7XNN; break;
+        case 0x8:{
+            const bool reset = chip8->quirks & QUIRK_VF_RESET, shift_vy = chip8->quirks & QUIRK_SHIFT_VY;
+            switch(op.NN & 0x0F){
+                case 0x0: op.handler = OP_8XY0; break;
+                case 0x1: op.handler = reset ? OP_8XY1_VF : OP_8XY1; break;
+                case 0x2: op.handler = reset ? OP_8XY2_VF : OP_8XY2; break;
+                case 0x3: op.handler = reset ? OP_8XY3_VF : OP_8XY3; break;
+                case 0x4: op.handler = OP_8XY4; break;
+                case 0x5: op.handler = OP_8XY5; break;
+                case 0x6: op.handler = shift_vy ? OP_8XY6_VY : OP_8XY6; break;
+                case 0x7: op.handler = OP_8XY7; break;
+                case 0xE: op.handler = shift_vy ? OP_8XYE_VY : OP_8XYE; break;
+                default: break;
+            }
+            break;
+        }
+        case 0x9: op.handler = OP_9XY0; break;
+        case 0xA: op.handler = OP_ANNN; break;
+        case 0xB: op.handler = chip8->quirks & QUIRK_JUMP_VX ? OP_BXNN : OP_BNNN; break;
+        case 0xC: op.handler = OP_CXNN; break;
+        case 0xD: op.handler = chip8->quirks & QUIRK_WRAP ? OP_DXYN_WRAP : OP_DXYN; break;
+        case 0xE:
+            if(op.NN == 0x9E) op.handler = OP_EX9E;
+            else if(op.NN == 0xA1) op.handler = OP_EXA1;
+            break;
+        case 0xF:
+            switch(op.NN){
+                case 0x07: op.handler = OP_FX07; break;
+                case 0x15: op.handler = OP_FX15; break;
+                case 0x18: op.handler = OP_FX18; break;
+                case 0x1E: op.handler = OP_FX1E; break;
+                case 0x29: op.handler = OP_FX29; break;
+                case 0x01: case 0x0A: case 0x33: case 0x55: case 0x65: op.handler = OP_SLOW; break;
+                default: break;
+            }
+            break;
     }
+    return op;
+}
 
-    //initialize configuration
-    config_t config = {0};
-    if(!set_config(&config, argc, argv)) exit(EXIT_FAILURE);
+// Run count instructions from the pre-decoded cache with threaded (computed goto) dispatch
+// Instructions are decoded the first time they run and stay cached until RAM under them
+// is written. Odd or out of range PCs and rare opcodes go through emulate_chip8 so it
+// stays the single reference for their behavior.
+void run_predecoded(chip8_t *chip8, const config_t config, uint64_t count){
+    static const void *const dispatch[OP_COUNT] = {
+        [OP_DECODE] = &&op_decode, [OP_SLOW] = &&op_slow, [OP_NOP] = &&op_nop,
+        [OP_00E0] = &&op_00E0, [OP_00EE] = &&op_00EE, [OP_1NNN] = &&op_1NNN, [OP_2NNN] = &&op_2NNN,
+        [OP_3XNN] = &&op_3XNN, [OP_4XNN] = &&op_4XNN, [OP_5XY0] = &&op_5XY0, [OP_6XNN] = &&op_6XNN,
+        [OP_7XNN] = &&op_7XNN, [OP_8XY0] = &&op_8XY0, [OP_8XY1] = &&op_8XY1, [OP_8XY2] = &&op_8XY2,
+        [OP_8XY3] = &&op_8XY3, [OP_8XY4] = &&op_8XY4, [OP_8XY5] = &&op_8XY5, [OP_8XY6] = &&op_8XY6,
+        [OP_8XY7] = &&op_8XY7, [OP_8XYE] = &&op_8XYE, [OP_9XY0] = &&op_9XY0, [OP_ANNN] = &&op_ANNN,
+        [OP_BNNN] = &&op_BNNN, [OP_CXNN] = &&op_CXNN, [OP_DXYN] = &&op_DXYN, [OP_EX9E] = &&op_EX9E,
+        [OP_EXA1] = &&op_EXA1, [OP_FX07] = &&op_FX07, [OP_FX15] = &&op_FX15, [OP_FX18] = &&op_FX18,
+        [OP_FX1E] = &&op_FX1E, [OP_FX29] = &&op_FX29,
+        [OP_8XY1_VF] = &&op_8XY1_VF, [OP_8XY2_VF] = &&op_8XY2_VF, [OP_8XY3_VF] = &&op_8XY3_VF,
+        [OP_8XY6_VY] = &&op_8XY6_VY, [OP_8XYE_VY] = &&op_8XYE_VY, [OP_BXNN] = &&op_BXNN,
+        [OP_DXYN_WRAP] = &&op_DXYN_WRAP,
+    };
+    if(!chip8->decoded){
+        chip8->decoded = calloc(sizeof chip8->ram / 2, sizeof *chip8->decoded);
+        if(!chip8->decoded){
+            //out of memory, the interpreter still works
+            for(uint64_t i = 0; i < count; i++) emulate_chip8(chip8, config);
+            return;
+        }
+    }
+    // PC and the countdown live in locals; V is a byte pointer so the compiler
+    // would otherwise have to reload chip8->PC after every register write
+    uint8_t *V = chip8->V;
+    uint16_t PC = chip8->PC;
+    decoded_t *op;
 
-    //Initialize SDL
-    sdl_t sdl = {0};
-    if(!init_sdl(&sdl, config)) exit(EXIT_FAILURE);
+    // fetch the next pre-decoded instruction and jump straight to its handler
+#define NEXT()                                                  \
+    do{                                                         \
+        if(!count--) goto done;                                 \
+        if(PC & 0xF001) goto op_unaligned;                      \
+        op = &chip8->decoded[PC >> 1];                          \
+        PC += 2;                                                \
+        goto *dispatch[op->handler];                            \
+    }while(0)
 
-    //Initialize CHIP8 machine
-    chip8_t chip8 = {0};
-    const char *rom_name = argv[1];
-    if(!init_chip8(&chip8, rom_name)) exit(EXIT_FAILURE);
+    NEXT();
 
-    //Initial screen clear to background color
-    clear_screen(config, sdl);
+op_decode:
+    *op = decode_instruction(chip8, PC - 2);
+    goto *dispatch[op->handler];
+op_unaligned:
+    // odd or out of range PC, not cached
+    chip8->PC = PC;
+    emulate_chip8(chip8, config);
+    PC = chip8->PC;
+    NEXT();
+op_slow:
+    chip8->PC = PC - 2;
+    emulate_chip8(chip8, config);
+    // FX0A without a key pressed stays put
+    if(chip8->PC == PC - 2) count -= idle_skip(chip8, config, chip8->PC, count);
+    PC = chip8->PC;
+    NEXT();
+op_nop:
+    NEXT();
+op_00E0:
+    clear_display(chip8);
+    NEXT();
+op_00EE:
+    if(chip8->sp > 0) PC = chip8->stack[--chip8->sp];
+    NEXT();
+op_1NNN:
+    if(op->NNN < PC) count -= idle_skip(chip8, config, op->NNN, count);
+    PC = op->NNN;
+    NEXT();
+op_2NNN:
+    if(chip8->sp < 12) chip8->stack[chip8->sp++] = PC;
+    PC = op->NNN;
+    NEXT();
+op_3XNN:
+    if(V[op->X] == op->NN) PC += 2;
+    NEXT();
+op_4XNN:
+    if(V[op->X] != op->NN) PC += 2;
+    NEXT();
+op_5XY0:
+    if(V[op->X] == V[op->Y]) PC += 2;
+    NEXT();
+op_6XNN:
+    V[op->X] = op->NN;
+    NEXT();
+op_7XNN:
+    V[op->X] += op->NN;
+    NEXT();
+op_8XY0:
+    V[op->X] = V[op->Y];
+    NEXT();
+op_8XY1:
+    V[op->X] |= V[op->Y];
+    NEXT();
+op_8XY2:
+    V[op->X] &= V[op->Y];
+    NEXT();
+op_8XY3:
+    V[op->X] ^= V[op->Y];
+    NEXT();
+op_8XY4:
+    V[0xF] = (V[op->Y] > (0xFF - V[op->X]));
+    V[op->X] += V[op->Y];
+    NEXT();
+op_8XY5:
+    V[0xF] = (V[op->Y] <= V[op->X]);
+    V[op->X] -= V[op->Y];
+    NEXT();
+op_8XY6:
+    V[0xF] = V[op->X] & 1;
+    V[op->X] >>= 1;
+    NEXT();
+op_8XY7:
+    V[0xF] = (V[op->X] <= V[op->Y]);
+    V[op->X] = V[op->Y] - V[op->X];
+    NEXT();
+op_8XYE:
+    V[0xF] = (V[op->X] & 0x80) >> 7;
+    V[op->X] <<= 1;
+    NEXT();
+op_9XY0:
+    if(V[op->X] != V[op->Y]) PC += 2;
+    NEXT();
+op_ANNN:
+    chip8->I = op->NNN;
+    NEXT();
+op_BNNN:
+    PC = V[0] + op->NNN;
+    NEXT();
+op_CXNN:
+    V[op->X] = random_byte(chip8) & op->NN;
+    NEXT();
+op_DXYN:
+    draw_sprite(chip8, config, op->X, op->Y, op->NN & 0x0F);
+    NEXT();
+op_EX9E:
+    if(chip8->keypad & (1 << (V[op->X] & 0x0F))) PC += 2;
+    NEXT();
+op_EXA1:
+    if(!(chip8->keypad & (1 << (V[op->X] & 0x0F)))) PC += 2;
+    NEXT();
+op_FX07:
+    V[op->X] = chip8->delay_timer;
+    NEXT();
+op_FX15:
+    chip8->delay_timer = V[op->X];
+    NEXT();
+op_FX18:
+    chip8->sound_timer = V[op->X];
+    NEXT();
+op_FX1E:
+    chip8->I += V[op->X];
+    NEXT();
+op_FX29:
+    chip8->I = (V[op->X] & 0x0F) * 5;
+    NEXT();
+op_8XY1_VF:
+    V[op->X] |= V[op->Y];
+    V[0xF] = 0;
+    NEXT();
+op_8XY2_VF:
+    V[op->X] &= V[op->Y];
+    V[0xF] = 0;
+    NEXT();
+op_8XY3_VF:
+    V[op->X] ^= V[op->Y];
+    V[0xF] = 0;
+    NEXT();
+op_8XY6_VY:
+    V[0xF] = V[op->Y] & 1;
+    V[op->X] = V[op->Y] >> 1;
+    NEXT();
+op_8XYE_VY:
+    V[0xF] = (V[op->Y] & 0x80) >> 7;
+    V[op->X] = V[op->Y] << 1;
+    NEXT();
+op_BXNN:
+    PC = V[op->X] + op->NNN;
+    NEXT();
+op_DXYN_WRAP:
+    draw_sprite_wrapped(chip8, config, op->X, op->Y, op->NN & 0x0F);
+    NEXT();
+done:
+    chip8->PC = PC;
+#undef NEXT
+}
 
-    srand(time(NULL));
+#ifdef HAVE_JIT
+// Basic block dynamic recompiler
+//
+// Straight-line runs of instructions are translated into native code, ending at
+// 1NNN/2NNN/00EE/BNNN, the skips and anything that can write RAM or rewind PC. V
+// registers used by a block are pinned in host registers: loaded on first use, written
+// back at block exit or before calling out to emulate_chip8 for the opcodes that are
+// not worth translating (00E0, 00EE, 2NNN, CXNN, DXYN, EXNN, FX0A, FX33, FX55, FX65).
+// Every block runs a fixed number of instructions, so run_jit can stop exactly on the
+// cycle budget.
+// Writes to RAM holding translated code flush the whole translation cache.
 
-    //Main emulator loop
-    while (chip8.state != QUIT){
-        //Handle user input
-        handle_input(&chip8);
-        if(chip8.state == PAUSED) continue;
-        //get_time
-        const uint64_t before = SDL_GetPerformanceCounter();
-        //Emulate CHIP8 Instructions for this emulator "frame" (60hz)
-        for (uint8_t i = 0; i < config.clock_speed/60; i++)
-            emulate_chip8(&chip8, config);
+#define JIT_BUFFER_SIZE (1 << 20)   // executable memory for translated blocks
+#define JIT_MAX_BLOCK 64            // longest block translated in one go
+#define JIT_MAX_INST_BYTES 256      // upper bound for one instruction plus the block exit
+
+typedef void (*jit_block_t)(chip8_t *chip8);
+
+// ALU operations understood by the backends
+typedef enum{
+    JIT_ADD,
+    JIT_SUB,
+    JIT_OR,
+    JIT_AND,
+    JIT_XOR,
+} jit_alu_t;
+
+struct jit{
+    uint8_t *buffer;                // executable memory
+    size_t used;                    // bytes of buffer holding finished blocks
+    jit_block_t blocks[2048];       // translated block by even PC
+    uint8_t lengths[2048];          // instructions in each translated block
+    uint8_t code_map[4096 / 8];     // RAM bytes read by a translated block
+    config_t config;                // config for interpreter helpers
+    // translation state
+    uint8_t *out;                   // emit cursor
+    int8_t pin[16];                 // pin slot holding each V register, -1 = in memory
+    uint8_t pins;                   // pin slots in use
+    uint16_t dirty;                 // V registers modified in host registers
+};
+
+// Helper called from translated code for opcodes that are not translated
+void jit_interpret(chip8_t *chip8){
+    emulate_chip8(chip8, chip8->jit->config);
+}
+
+void jit_emit8(jit_t *jit, uint8_t byte){
+    *jit->out++ = byte;
+}
 
-        //get_time elapsed since last get_time
-        const uint64_t after = SDL_GetPerformanceCounter();
+void jit_emit32(jit_t *jit, uint32_t word){
+    memcpy(jit->out, &word, sizeof word);
+    jit->out += sizeof word;
+}
 
-        //Delay for 60 hz
-        const double elapsed = (double)((after - before) / 1000) / SDL_GetPerformanceFrequency();
+#if defined(JIT_X86_64)
+// x86-64 System V backend
+// rbx holds the chip8_t pointer, rax/rcx are scratch, V registers go in the rest
+#define JIT_T0 0    // rax
+#define JIT_T1 1    // rcx
+#define JIT_BASE 3  // rbx
+const uint8_t jit_pin_regs[] = {2, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
 
-        //SDL_Delay(1000/60-actual time elapsed)
-        SDL_Delay(16.67f > elapsed ? 16.67f - elapsed : 0);
+// REX prefix for a reg/rm pair, forced when a byte register 4-7 must mean spl..dil
+void jit_rex(jit_t *jit, bool w, uint8_t reg, uint8_t rm, bool force){
+    const uint8_t rex = 0x40 | w << 3 | (reg >> 3) << 2 | (rm >> 3);
+    if(rex != 0x40 || force) jit_emit8(jit, rex);
+}
 
-        //update window with changes every 60hz
-        redraw_screen(sdl , config , &chip8);
+// ModRM + disp32 for [rbx + offset]
+void jit_mem(jit_t *jit, uint8_t reg, uint32_t offset){
+    jit_emit8(jit, 0x80 | (reg & 7) << 3 | JIT_BASE);
+    jit_emit32(jit, offset);
+}
 
-        // update the timers
-        update_timers(&chip8);
+void jit_prologue(jit_t *jit){
+    jit_emit8(jit, 0x53);                                       // push rbx
+    jit_emit8(jit, 0x55);                                       // push rbp
+    for(uint8_t r = 12; r <= 15; r++){                          // push r12-r15
+        jit_emit8(jit, 0x41);
+        jit_emit8(jit, 0x50 | (r & 7));
     }
+    jit_emit8(jit, 0x48); jit_emit8(jit, 0x83); jit_emit8(jit, 0xEC); jit_emit8(jit, 8);  // sub rsp, 8
+    jit_emit8(jit, 0x48); jit_emit8(jit, 0x89); jit_emit8(jit, 0xFB);                     // mov rbx, rdi
+}
 
-    //Final cleanup
+void jit_epilogue(jit_t *jit){
+    jit_emit8(jit, 0x48); jit_emit8(jit, 0x83); jit_emit8(jit, 0xC4); jit_emit8(jit, 8);  // add rsp, 8
+    for(uint8_t r = 15; r >= 12; r--){                          // pop r15-r12
+        jit_emit8(jit, 0x41);
+        jit_emit8(jit, 0x58 | (r & 7));
+    }
+    jit_emit8(jit, 0x5D);                                       // pop rbp
+    jit_emit8(jit, 0x5B);                                       // pop rbx
+    jit_emit8(jit, 0xC3);                                       // ret
+}
+
+void jit_mov_imm(jit_t *jit, uint8_t r, uint32_t imm){
+    jit_rex(jit, false, 0, r, false);
+    jit_emit8(jit, 0xB8 | (r & 7));                             // mov r32, imm32
+    jit_emit32(jit, imm);
+}
+
+void jit_alu(jit_t *jit, jit_alu_t op, uint8_t d, uint8_t s){
+    static const uint8_t opcodes[] = {[JIT_ADD] = 0x01, [JIT_SUB] = 0x29, [JIT_OR] = 0x09,
+                                      [JIT_AND] = 0x21, [JIT_XOR] = 0x31};
+    jit_rex(jit, false, s, d, false);
+    jit_emit8(jit, opcodes[op]);                                // op r/m32, r32
+    jit_emit8(jit, 0xC0 | (s & 7) << 3 | (d & 7));
+}
+
+void jit_mov(jit_t *jit, uint8_t d, uint8_t s){
+    if(d == s) return;
+    jit_rex(jit, false, s, d, false);
+    jit_emit8(jit, 0x89);                                       // mov r/m32, r32
+    jit_emit8(jit, 0xC0 | (s & 7) << 3 | (d & 7));
+}
+
+void jit_alu_imm(jit_t *jit, jit_alu_t op, uint8_t d, uint32_t imm){
+    static const uint8_t digits[] = {[JIT_ADD] = 0, [JIT_SUB] = 5, [JIT_OR] = 1,
+                                     [JIT_AND] = 4, [JIT_XOR] = 6};
+    jit_rex(jit, false, 0, d, false);
+    jit_emit8(jit, 0x81);                                       // op r/m32, imm32
+    jit_emit8(jit, 0xC0 | digits[op] << 3 | (d & 7));
+    jit_emit32(jit, imm);
+}
+
+void jit_shr(jit_t *jit, uint8_t r, uint8_t bits){
+    jit_rex(jit, false, 0, r, false);
+    jit_emit8(jit, 0xC1); jit_emit8(jit, 0xE8 | (r & 7)); jit_emit8(jit, bits);   // shr r32, imm8
+}
+
+void jit_shl(jit_t *jit, uint8_t r, uint8_t bits){
+    jit_rex(jit, false, 0, r, false);
+    jit_emit8(jit, 0xC1); jit_emit8(jit, 0xE0 | (r & 7)); jit_emit8(jit, bits);   // shl r32, imm8
+}
+
+// Truncate to 8 bits
+void jit_zx8(jit_t *jit, uint8_t r){
+    jit_rex(jit, false, r, r, true);
+    jit_emit8(jit, 0x0F); jit_emit8(jit, 0xB6);                 // movzx r32, r8
+    jit_emit8(jit, 0xC0 | (r & 7) << 3 | (r & 7));
+}
+
+// r *= 5, only used on the scratch registers
+void jit_mul5(jit_t *jit, uint8_t r){
+    jit_emit8(jit, 0x8D);                                       // lea r32, [r + r*4]
+    jit_emit8(jit, 0x04 | r << 3);
+    jit_emit8(jit, 0x80 | r << 3 | r);
+}
+
+// Zero extending load of a 8 or 16 bit chip8_t field
+void jit_load(jit_t *jit, uint8_t bits, uint8_t r, uint32_t offset){
+    jit_rex(jit, false, r, 0, false);
+    jit_emit8(jit, 0x0F); jit_emit8(jit, bits == 8 ? 0xB6 : 0xB7); // movzx r32, [rbx + offset]
+    jit_mem(jit, r, offset);
+}
+
+void jit_store(jit_t *jit, uint8_t bits, uint8_t r, uint32_t offset){
+    if(bits == 16) jit_emit8(jit, 0x66);
+    jit_rex(jit, false, r, 0, bits == 8);
+    jit_emit8(jit, bits == 8 ? 0x88 : 0x89);                    // mov [rbx + offset], r8/r16
+    jit_mem(jit, r, offset);
+}
+
+// PC = (a == b) ? taken : not_taken (or != when equal is false), b is a register or an immediate
+void jit_select_pc(jit_t *jit, bool equal, uint8_t a, bool b_imm, uint32_t b,
+                   uint16_t taken, uint16_t not_taken, uint32_t pc_offset){
+    jit_mov_imm(jit, JIT_T0, not_taken);
+    jit_mov_imm(jit, JIT_T1, taken);
+    if(b_imm){
+        jit_rex(jit, false, 0, a, false);
+        jit_emit8(jit, 0x81); jit_emit8(jit, 0xF8 | (a & 7));   // cmp r32, imm32
+        jit_emit32(jit, b);
+    }
+    else{
+        jit_rex(jit, false, b, a, false);
+        jit_emit8(jit, 0x39);                                   // cmp r32, r32
+        jit_emit8(jit, 0xC0 | (b & 7) << 3 | (a & 7));
+    }
+    jit_emit8(jit, 0x0F); jit_emit8(jit, equal ? 0x44 : 0x45);  // cmove/cmovne eax, ecx
+    jit_emit8(jit, 0xC0 | JIT_T0 << 3 | JIT_T1);
+    jit_store(jit, 16, JIT_T0, pc_offset);
+}
+
+// Call fn(chip8)
+void jit_call(jit_t *jit, void (*fn)(chip8_t *)){
+    uint64_t address = (uintptr_t)fn;
+    jit_emit8(jit, 0x48); jit_emit8(jit, 0x89); jit_emit8(jit, 0xDF);   // mov rdi, rbx
+    jit_emit8(jit, 0x48); jit_emit8(jit, 0xB8);                         // mov rax, imm64
+    jit_emit32(jit, (uint32_t)address);
+    jit_emit32(jit, (uint32_t)(address >> 32));
+    jit_emit8(jit, 0xFF); jit_emit8(jit, 0xD0);                         // call rax
+}
+
+#elif defined(JIT_AARCH64)
+// AArch64 AAPCS64 backend
+// x19 points at chip8->V so every field the blocks touch is in reach of the signed
+// 9-bit unscaled load/store offsets, w0-w2 are scratch and all sixteen V registers fit
+// in x20-x28 and x9-x15
+#define JIT_T0 0
+#define JIT_T1 1
+#define JIT_T2 2
+#define JIT_BASE 19
+const uint8_t jit_pin_regs[] = {20, 21, 22, 23, 24, 25, 26, 27, 28, 9, 10, 11, 12, 13, 14, 15};
+
+// chip8_t field offset relative to x19
+int32_t jit_rel(uint32_t offset){
+    return (int32_t)offset - (int32_t)offsetof(chip8_t, V);
+}
+
+void jit_prologue(jit_t *jit){
+    const uint32_t v = offsetof(chip8_t, V);
+    jit_emit32(jit, 0xA9BA7BFD);                                // stp x29, x30, [sp, #-96]!
+    jit_emit32(jit, 0x910003FD);                                // mov x29, sp
+    for(uint32_t r = 19, slot = 2; r < 29; r += 2, slot += 2)   // stp x19-x28, [sp, #16..80]
+        jit_emit32(jit, 0xA9000000 | slot << 15 | (r + 1) << 10 | 31 << 5 | r);
+    jit_emit32(jit, 0x91400000 | (v >> 12) << 10 | 0 << 5 | JIT_BASE);        // add x19, x0, #hi, lsl 12
+    jit_emit32(jit, 0x91000000 | (v & 0xFFF) << 10 | JIT_BASE << 5 | JIT_BASE); // add x19, x19, #lo
+}
+
+void jit_epilogue(jit_t *jit){
+    for(uint32_t r = 19, slot = 2; r < 29; r += 2, slot += 2)   // ldp x19-x28, [sp, #16..80]
+        jit_emit32(jit, 0xA9400000 | slot << 15 | (r + 1) << 10 | 31 << 5 | r);
+    jit_emit32(jit, 0xA8C67BFD);                                // ldp x29, x30, [sp], #96
+    jit_emit32(jit, 0xD65F03C0);                                // ret
+}
+
+void jit_mov_imm(jit_t *jit, uint8_t r, uint32_t imm){
+    jit_emit32(jit, 0x52800000 | (imm & 0xFFFF) << 5 | r);      // movz wr, #imm16
+}
+
+void jit_mov(jit_t *jit, uint8_t d, uint8_t s){
+    if(d == s) return;
+    jit_emit32(jit, 0x2A0003E0 | s << 16 | d);                  // mov wd, ws
+}
+
+void jit_alu(jit_t *jit, jit_alu_t op, uint8_t d, uint8_t s){
+    static const uint32_t opcodes[] = {[JIT_ADD] = 0x0B000000, [JIT_SUB] = 0x4B000000,
+                                       [JIT_OR] = 0x2A000000, [JIT_AND] = 0x0A000000,
+                                       [JIT_XOR] = 0x4A000000};
+    jit_emit32(jit, opcodes[op] | s << 16 | d << 5 | d);        // op wd, wd, ws
+}
+
+void jit_alu_imm(jit_t *jit, jit_alu_t op, uint8_t d, uint32_t imm){
+    if(op == JIT_ADD && imm < 0x1000){
+        jit_emit32(jit, 0x11000000 | imm << 10 | d << 5 | d);   // add wd, wd, #imm12
+        return;
+    }
+    if(op != JIT_ADD && op != JIT_SUB && imm && imm < 0xFFFFFFFF && !(imm & (imm + 1))){
+        // low bit masks are encodable logical immediates (N=0, immr=0, imms=ones-1)
+        static const uint32_t opcodes[] = {[JIT_OR] = 0x32000000, [JIT_AND] = 0x12000000,
+                                           [JIT_XOR] = 0x52000000};
+        const uint32_t ones = __builtin_popcount(imm);
+        jit_emit32(jit, opcodes[op] | (ones - 1) << 10 | d << 5 | d);
+        return;
+    }
+    jit_mov_imm(jit, JIT_T2, imm);
+    jit_alu(jit, op, d, JIT_T2);
+}
+
+void jit_shr(jit_t *jit, uint8_t r, uint8_t bits){
+    jit_emit32(jit, 0x53007C00 | bits << 16 | r << 5 | r);      // lsr wr, wr, #bits
+}
+
+void jit_shl(jit_t *jit, uint8_t r, uint8_t bits){
+    jit_emit32(jit, 0x53000000 | ((32 - bits) & 31) << 16 | (31 - bits) << 10 | r << 5 | r); // lsl wr, wr, #bits
+}
+
+// Truncate to 8 bits
+void jit_zx8(jit_t *jit, uint8_t r){
+    jit_emit32(jit, 0x53001C00 | r << 5 | r);                   // uxtb wr, wr
+}
+
+void jit_mul5(jit_t *jit, uint8_t r){
+    jit_emit32(jit, 0x0B000000 | r << 16 | 2 << 10 | r << 5 | r); // add wr, wr, wr, lsl #2
+}
+
+// Zero extending load of a 8 or 16 bit chip8_t field
+void jit_load(jit_t *jit, uint8_t bits, uint8_t r, uint32_t offset){
+    const uint32_t imm9 = jit_rel(offset) & 0x1FF;
+    jit_emit32(jit, (bits == 8 ? 0x38400000 : 0x78400000) | imm9 << 12 | JIT_BASE << 5 | r); // ldurb/ldurh
+}
+
+void jit_store(jit_t *jit, uint8_t bits, uint8_t r, uint32_t offset){
+    const uint32_t imm9 = jit_rel(offset) & 0x1FF;
+    jit_emit32(jit, (bits == 8 ? 0x38000000 : 0x78000000) | imm9 << 12 | JIT_BASE << 5 | r); // sturb/sturh
+}
+
+// PC = (a == b) ? taken : not_taken (or != when equal is false), b is a register or an immediate
+void jit_select_pc(jit_t *jit, bool equal, uint8_t a, bool b_imm, uint32_t b,
+                   uint16_t taken, uint16_t not_taken, uint32_t pc_offset){
+    jit_mov_imm(jit, JIT_T0, not_taken);
+    jit_mov_imm(jit, JIT_T1, taken);
+    if(b_imm) jit_emit32(jit, 0x7100001F | b << 10 | a << 5);   // cmp wa, #imm12
+    else jit_emit32(jit, 0x6B00001F | b << 16 | a << 5);        // cmp wa, wb
+    jit_emit32(jit, 0x1A800000 | JIT_T0 << 16 | (equal ? 0 : 1) << 12 | JIT_T1 << 5 | JIT_T0); // csel w0, w1, w0, eq/ne
+    jit_store(jit, 16, JIT_T0, pc_offset);
+}
+
+// Call fn(chip8)
+void jit_call(jit_t *jit, void (*fn)(chip8_t *)){
+    const uint32_t v = offsetof(chip8_t, V);
+    const uint64_t address = (uintptr_t)fn;
+    jit_emit32(jit, 0xD1400000 | (v >> 12) << 10 | JIT_BASE << 5 | 0);   // sub x0, x19, #hi, lsl 12
+    jit_emit32(jit, 0xD1000000 | (v & 0xFFF) << 10 | 0 << 5 | 0);        // sub x0, x0, #lo
+    jit_emit32(jit, 0xD2800000 | (address & 0xFFFF) << 5 | 16);          // movz x16, #imm16
+    for(uint32_t hw = 1; hw < 4; hw++)                                   // movk x16, #imm16, lsl 16*hw
+        jit_emit32(jit, 0xF2800000 | hw << 21 | ((address >> (16 * hw)) & 0xFFFF) << 5 | 16);
+    jit_emit32(jit, 0xD63F0200);                                         // blr x16
+}
+
+_Static_assert(offsetof(chip8_t, sound_timer) - offsetof(chip8_t, V) < 256,
+               "JIT fields must be within ldur/stur reach of chip8_t.V");
+#endif
+
+#define JIT_PINS (sizeof jit_pin_regs)
+
+// Host register holding V[v], pinned on first use; load is false when the
+// instruction overwrites V[v] without reading it
+uint8_t jit_pin(jit_t *jit, uint8_t v, bool load){
+    if(jit->pin[v] < 0){
+        jit->pin[v] = jit->pins++;
+        if(load) jit_load(jit, 8, jit_pin_regs[jit->pin[v]], offsetof(chip8_t, V) + v);
+    }
+    return jit_pin_regs[jit->pin[v]];
+}
+
+// Write modified V registers back to chip8->V
+void jit_spill(jit_t *jit){
+    for(uint8_t v = 0; v < 16; v++){
+        if(jit->dirty & (1 << v))
+            jit_store(jit, 8, jit_pin_regs[jit->pin[v]], offsetof(chip8_t, V) + v);
+    }
+    jit->dirty = 0;
+}
+
+// Hand the instruction at pc to emulate_chip8; pinned registers are written back
+// before and forgotten after since the interpreter may change any of them
+void jit_emit_interpret(jit_t *jit, uint16_t pc){
+    jit_spill(jit);
+    memset(jit->pin, -1, sizeof jit->pin);
+    jit->pins = 0;
+    jit_mov_imm(jit, JIT_T0, pc);
+    jit_store(jit, 16, JIT_T0, offsetof(chip8_t, PC));
+    jit_call(jit, jit_interpret);
+}
+
+// Leave the block, pc < 0 means PC was already stored
+void jit_emit_exit(jit_t *jit, int32_t pc){
+    jit_spill(jit);
+    if(pc >= 0){
+        jit_mov_imm(jit, JIT_T0, pc);
+        jit_store(jit, 16, JIT_T0, offsetof(chip8_t, PC));
+    }
+    jit_epilogue(jit);
+}
+
+// V registers a translated opcode reads or writes under the given quirks
+uint16_t jit_registers_used(uint16_t opcode, uint8_t quirks){
+    const uint16_t X = 1 << ((opcode >> 8) & 0x0F);
+    const uint16_t Y = 1 << ((opcode >> 4) & 0x0F);
+    switch((opcode >> 12) & 0x0F){
+        case 0x3: case 0x4: case 0x6: case 0x7:
+            return X;
+        case 0x5: case 0x9:
+            return X | Y;
+        case 0x8:
+            switch(opcode & 0x0F){
+                case 0x4: case 0x5: case 0x6: case 0x7: case 0xE: return X | Y | 0x8000;
+                case 0x1: case 0x2: case 0x3: return X | Y | (quirks & QUIRK_VF_RESET ? 0x8000 : 0);
+                default: return X | Y;
+            }
+        case 0xB:
+            return quirks & QUIRK_JUMP_VX ? X : 1;
+        case 0xF:
+            switch(opcode & 0xFF){
+                case 0x07: case 0x15: case 0x18: case 0x1E: case 0x29: return X;
+                default: return 0;
+            }
+        default:
+            return 0;
+    }
+}
+
+// Translate the basic block starting at start, NULL when the buffer is full
+jit_block_t jit_translate(chip8_t *chip8, uint16_t start){
+    jit_t *jit = chip8->jit;
+    if(JIT_BUFFER_SIZE - jit->used < JIT_MAX_BLOCK * JIT_MAX_INST_BYTES) return NULL;
+
+    uint8_t *code = jit->buffer + jit->used;
+    jit->out = code;
+    memset(jit->pin, -1, sizeof jit->pin);
+    jit->pins = 0;
+    jit->dirty = 0;
+#if defined(__APPLE__) && defined(JIT_AARCH64)
+    pthread_jit_write_protect_np(0);
+#endif
+    jit_prologue(jit);
+
+    const uint32_t PC_field = offsetof(chip8_t, PC);
+    const uint32_t I_field = offsetof(chip8_t, I);
+    uint16_t pc = start;
+    uint8_t length = 0;
+    bool open = true;
+    while(open){
+        if(length == JIT_MAX_BLOCK || pc > 0xFFE){
+            jit_emit_exit(jit, pc);
+            break;
+        }
+        const uint16_t opcode = chip8->ram[pc] << 8 | chip8->ram[pc+1];
+        // end the block early rather than run out of host registers
+        const uint16_t used = jit_registers_used(opcode, chip8->quirks);
+        uint8_t needed = 0;
+        for(uint8_t v = 0; v < 16; v++)
+            needed += (used >> v & 1) && jit->pin[v] < 0;
+        if(jit->pins + needed > JIT_PINS){
+            jit_emit_exit(jit, pc);
+            break;
+        }
+        jit->code_map[pc >> 3] |= 1 << (pc & 7);
+        jit->code_map[(pc + 1) >> 3] |= 1 << ((pc + 1) & 7);
+        length++;
+
+        const uint8_t X = (opcode >> 8) & 0x0F;
+        const uint8_t Y = (opcode >> 4) & 0x0F;
+        const uint8_t NN = opcode & 0xFF;
+        const uint16_t NNN = opcode & 0x0FFF;
+        const uint16_t next = pc + 2;
+        uint8_t x, y, f;
+        switch((opcode >> 12) & 0x0F){
+            case 0x0:
+                if(NN == 0xEE){
+                    //0x00EE: the interpreter checks for an empty stack
+                    jit_emit_interpret(jit, pc);
+                    jit_emit_exit(jit, -1);
+                    open = false;
+                }
+                else if(NN == 0xE0) jit_emit_interpret(jit, pc);
+                else if(opcode == 0x00FD){
+                    // halts, PC stays on it
+                    jit_emit_interpret(jit, pc);
+                    jit_emit_exit(jit, -1);
+                    open = false;
+                }
+                else if(extended_0nnn(opcode)) jit_emit_interpret(jit, pc);
+                break;
+            case 0x1:
+                //0x1NNN: jump
+                jit_emit_exit(jit, NNN);
+                open = false;
+                break;
+            case 0x2:
+                //0x2NNN: the interpreter checks for a full stack
+                jit_emit_interpret(jit, pc);
+                jit_emit_exit(jit, -1);
+                open = false;
+                break;
+            case 0x3: case 0x4:
+                //0x3XNN/0x4XNN: skip if VX ==/!= NN
+                x = jit_pin(jit, X, true);
+                jit_select_pc(jit, (opcode >> 12) == 0x3, x, true, NN, next + 2, next, PC_field);
+                jit_emit_exit(jit, -1);
+                open = false;
+                break;
+            case 0x5: case 0x9:
+                //0x5XY0/0x9XY0: skip if VX ==/!= VY
+                x = jit_pin(jit, X, true);
+                y = jit_pin(jit, Y, true);
+                jit_select_pc(jit, (opcode >> 12) == 0x5, x, false, y, next + 2, next, PC_field);
+                jit_emit_exit(jit, -1);
+                open = false;
+                break;
+            case 0x6:
+                //0x6XNN: VX = NN
+                x = jit_pin(jit, X, false);
+                jit_mov_imm(jit, x, NN);
+                jit->dirty |= 1 << X;
+                break;
+            case 0x7:
+                //0x7XNN: VX += NN
+                x = jit_pin(jit, X, true);
+                jit_alu_imm(jit, JIT_ADD, x, NN);
+                jit_zx8(jit, x);
+                jit->dirty |= 1 << X;
+                break;
+            case 0x8:
+                // same statement order as emulate_chip8 so X or Y == F behave identically
+                // VF is only pinned by the opcodes that overwrite it
+                y = jit_pin(jit, Y, true);
+                x = jit_pin(jit, X, (opcode & 0x0F) != 0);
+                f = used & 0x8000 ? jit_pin(jit, 0xF, false) : 0;
+                switch(opcode & 0x0F){
+                    case 0x0: jit_mov(jit, x, y); break;
+                    // the quirks are known at translation time, blocks only contain the profile's code
+                    case 0x1: jit_alu(jit, JIT_OR, x, y); break;
+                    case 0x2: jit_alu(jit, JIT_AND, x, y); break;
+                    case 0x3: jit_alu(jit, JIT_XOR, x, y); break;
+                    case 0x4:
+                        // VF = carry out of the 9 bit sum
+                        jit_mov(jit, JIT_T0, x);
+                        jit_alu(jit, JIT_ADD, JIT_T0, y);
+                        jit_shr(jit, JIT_T0, 8);
+                        jit_mov(jit, f, JIT_T0);
+                        jit_alu(jit, JIT_ADD, x, y);
+                        jit_zx8(jit, x);
+                        break;
+                    case 0x5:
+                        // VF = no borrow, the sign of the 32 bit difference
+                        jit_mov(jit, JIT_T0, x);
+                        jit_alu(jit, JIT_SUB, JIT_T0, y);
+                        jit_shr(jit, JIT_T0, 31);
+                        jit_alu_imm(jit, JIT_XOR, JIT_T0, 1);
+                        jit_mov(jit, f, JIT_T0);
+                        jit_alu(jit, JIT_SUB, x, y);
+                        jit_zx8(jit, x);
+                        break;
+                    case 0x6:
+                        jit_mov(jit, JIT_T0, chip8->quirks & QUIRK_SHIFT_VY ? y : x);
+                        jit_alu_imm(jit, JIT_AND, JIT_T0, 1);
+                        jit_mov(jit, f, JIT_T0);
+                        if(chip8->quirks & QUIRK_SHIFT_VY) jit_mov(jit, x, y);
+                        jit_shr(jit, x, 1);
+                        break;
+                    case 0x7:
+                        jit_mov(jit, JIT_T1, y);
+                        jit_alu(jit, JIT_SUB, JIT_T1, x);
+                        jit_shr(jit, JIT_T1, 31);
+                        jit_alu_imm(jit, JIT_XOR, JIT_T1, 1);
+                        jit_mov(jit, f, JIT_T1);
+                        jit_mov(jit, JIT_T0, y);
+                        jit_alu(jit, JIT_SUB, JIT_T0, x);
+                        jit_zx8(jit, JIT_T0);
+                        jit_mov(jit, x, JIT_T0);
+                        break;
+                    case 0xE:
+                        jit_mov(jit, JIT_T0, chip8->quirks & QUIRK_SHIFT_VY ? y : x);
+                        jit_shr(jit, JIT_T0, 7);
+                        jit_mov(jit, f, JIT_T0);
+                        if(chip8->quirks & QUIRK_SHIFT_VY) jit_mov(jit, x, y);
+                        jit_shl(jit, x, 1);
+                        jit_zx8(jit, x);
+                        break;
+                    default:
+                        break; //unexpected N, nothing changes
+                }
+                if((opcode & 0x0F) >= 1 && (opcode & 0x0F) <= 3 && (chip8->quirks & QUIRK_VF_RESET))
+                    jit_mov_imm(jit, f, 0);
+                if((opcode & 0x0F) <= 7 || (opcode & 0x0F) == 0xE){
+                    jit->dirty |= 1 << X;
+                    if(used & 0x8000) jit->dirty |= 1 << 0xF;
+                }
+                break;
+            case 0xA:
+                //0xANNN: I = NNN
+                jit_mov_imm(jit, JIT_T0, NNN);
+                jit_store(jit, 16, JIT_T0, I_field);
+                break;
+            case 0xB:
+                //0xBNNN: PC = V0 + NNN, or BXNN: PC = VX + XNN
+                jit_mov(jit, JIT_T0, jit_pin(jit, chip8->quirks & QUIRK_JUMP_VX ? X : 0, true));
+                jit_alu_imm(jit, JIT_ADD, JIT_T0, NNN);
+                jit_store(jit, 16, JIT_T0, PC_field);
+                jit_emit_exit(jit, -1);
+                open = false;
+                break;
+            case 0xC: case 0xD:
+                jit_emit_interpret(jit, pc);
+                break;
+            case 0xE:
+                // key skips
+                jit_emit_interpret(jit, pc);
+                jit_emit_exit(jit, -1);
+                open = false;
+                break;
+            case 0xF:
+                switch(NN){
+                    case 0x07:
+                        x = jit_pin(jit, X, false);
+                        jit_load(jit, 8, x, offsetof(chip8_t, delay_timer));
+                        jit->dirty |= 1 << X;
+                        break;
+                    case 0x15:
+                        jit_store(jit, 8, jit_pin(jit, X, true), offsetof(chip8_t, delay_timer));
+                        break;
+                    case 0x18:
+                        jit_store(jit, 8, jit_pin(jit, X, true), offsetof(chip8_t, sound_timer));
+                        break;
+                    case 0x1E:
+                        jit_load(jit, 16, JIT_T0, I_field);
+                        jit_alu(jit, JIT_ADD, JIT_T0, jit_pin(jit, X, true));
+                        jit_store(jit, 16, JIT_T0, I_field);
+                        break;
+                    case 0x29:
+                        jit_mov(jit, JIT_T0, jit_pin(jit, X, true));
+                        jit_alu_imm(jit, JIT_AND, JIT_T0, 0x0F);
+                        jit_mul5(jit, JIT_T0);
+                        jit_store(jit, 16, JIT_T0, I_field);
+                        break;
+                    case 0x01: case 0x65:
+                        jit_emit_interpret(jit, pc);
+                        break;
+                    case 0x0A: case 0x33: case 0x55:
+                        // may rewind PC or write RAM under this block
+                        jit_emit_interpret(jit, pc);
+                        jit_emit_exit(jit, -1);
+                        open = false;
+                        break;
+                    default:
+                        break; //unimplemented, nothing changes
+                }
+                break;
+        }
+        pc = next;
+    }
+
+#if defined(__APPLE__) && defined(JIT_AARCH64)
+    pthread_jit_write_protect_np(1);
+#endif
+    __builtin___clear_cache((char *)code, (char *)jit->out);
+    jit->used = (jit->out - jit->buffer + 15) & ~(size_t)15;
+    jit->lengths[start >> 1] = length;
+    jit->blocks[start >> 1] = (jit_block_t)code;
+    return (jit_block_t)code;
+}
+
+// Drop every translated block
+void jit_flush(jit_t *jit){
+    jit->used = 0;
+    memset(jit->blocks, 0, sizeof jit->blocks);
+    memset(jit->code_map, 0, sizeof jit->code_map);
+}
+
+// Release the translation cache and its executable memory
+void jit_free(jit_t *jit){
+    munmap(jit->buffer, JIT_BUFFER_SIZE);
+    free(jit);
+}
+
+// RAM from addr to addr+len-1 was written, flush if any of it was translated
+void jit_invalidate(chip8_t *chip8, uint16_t addr, uint16_t len){
+    for(uint32_t i = addr; i < (uint32_t)addr + len && i < sizeof chip8->ram; i++){
+        if(chip8->jit->code_map[i >> 3] & (1 << (i & 7))){
+            jit_flush(chip8->jit);
+            return;
+        }
+    }
+}
+
+// Allocate the translation cache and its executable memory
+bool jit_init(chip8_t *chip8){
+    if(chip8->jit_failed) return false;     // logged once, the host will refuse again
+    jit_t *jit = calloc(1, sizeof *jit);
+    if(!jit) return false;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(__APPLE__) && defined(JIT_AARCH64)
+    flags |= MAP_JIT;
+#endif
+    jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, flags, -1, 0);
+    if(jit->buffer == MAP_FAILED){
+        SDL_Log("Could not map JIT memory, using the pre-decoded core\n");
+        free(jit);
+        chip8->jit_failed = true;
+        return false;
+    }
+    chip8->jit = jit;
+    return true;
+}
+
+// Run count instructions through translated blocks
+void run_jit(chip8_t *chip8, const config_t config, uint64_t count){
+    if(!chip8->jit && !jit_init(chip8)){
+        run_predecoded(chip8, config, count);
+        return;
+    }
+    jit_t *jit = chip8->jit;
+    jit->config = config;
+    while(count){
+        const uint16_t PC = chip8->PC;
+        if(PC & 0xF001){
+            // odd or out of range PC, not translated
+            emulate_chip8(chip8, config);
+            count--;
+            continue;
+        }
+        jit_block_t block = jit->blocks[PC >> 1];
+        if(!block){
+            block = jit_translate(chip8, PC);
+            if(!block){
+                // translation cache is full, start over
+                jit_flush(jit);
+                block = jit_translate(chip8, PC);
+            }
+        }
+        const uint8_t length = jit->lengths[PC >> 1];
+        if(length > count){
+            // the block would overrun the budget, finish the tail pre-decoded
+            run_predecoded(chip8, config, count);
+            return;
+        }
+        count -= length;
+        block(chip8);
+        // landing inside or before the block means it looped
+        if(chip8->PC < PC + 2 * length) count -= idle_skip(chip8, config, chip8->PC, count);
+    }
+}
+#endif
+
+// Static analysis
+//
+// A ROM's code is found by walking it from 0x200 along every way an instruction can
+// continue: jumps and calls to NNN, skips to both of the next two instructions, returns
+// to every address a reachable call pushes (and on to the next instruction, as returning
+// with an empty stack does) and everything else to the next instruction. I is tracked
+// along the way as a range, giving the RAM that FX33 and FX55 can write. When no jump is
+// computed (BNNN) and no write can land on reachable code, the walk found every
+// instruction that can ever run. Writes to RAM outside the code pages then skip code
+// invalidation, and the loops can be decoded or translated before the ROM starts.
+#define ANALYSIS_WIDEN 8            // times an address's I range may grow before it becomes all of RAM
+
+// What the static analysis of a ROM found, see analyze_code
+typedef struct{
+    uint8_t reachable[4096 / 8];    // addresses of reachable instructions
+    uint8_t leaders[4096 / 8];      // reachable instructions starting a basic block
+    uint8_t loops[4096 / 8];        // leaders some later instruction jumps, skips or returns back to
+    uint8_t code[4096 / 8];         // RAM bytes of reachable instructions
+    uint8_t written[4096 / 8];      // RAM bytes FX33 and FX55 can write
+    uint64_t code_pages;            // pages holding reachable instruction bytes
+    uint64_t written_pages;         // pages FX33 and FX55 can write
+    bool computed_jump;             // BNNN is reachable, its targets are unknown
+    bool self_modifying;            // a write can land on a reachable instruction
+    uint32_t instructions;          // reachable instructions
+    uint32_t blocks;                // basic blocks
+} analysis_t;
+
+// Range of values I can hold, lo > hi = not reached yet
+typedef struct{
+    uint32_t lo, hi;
+} i_range_t;
+
+// Working state of analyze_code
+typedef struct{
+    const chip8_t *chip8;
+    analysis_t *analysis;
+    i_range_t I[4096];              // I range on entry to each address
+    uint8_t grown[4096];            // times the I range of each address grew
+    uint16_t work[4096];            // addresses whose I range changed since they were walked
+    bool queued[4096];
+    uint32_t pending;
+    uint8_t returns[4096 / 8];      // addresses reachable calls push
+    i_range_t ret;                  // I range at reachable returns
+} walk_t;
+
+bool map_test(const uint8_t *map, uint16_t addr){
+    return map[addr >> 3] & 1 << (addr & 7);
+}
+
+void map_set(uint8_t *map, uint16_t addr){
+    map[addr >> 3] |= 1 << (addr & 7);
+}
+
+// Pages no instruction can ever run from, 0 when the analysis could not prove it
+uint64_t data_pages(const analysis_t *analysis){
+    if(analysis->computed_jump || analysis->self_modifying) return 0;
+    return ~analysis->code_pages;
+}
+
+// Continue the walk at addr with I in lo..hi. A leader reached from the instruction at
+// from or later heads a loop, from is -1 for returns and the entry point
+void walk_to(walk_t *walk, int32_t from, uint16_t addr, uint32_t lo, uint32_t hi, bool leader){
+    analysis_t *analysis = walk->analysis;
+    addr &= 0xFFF;
+    if(leader){
+        map_set(analysis->leaders, addr);
+        if((int32_t)addr <= from) map_set(analysis->loops, addr);
+    }
+    // I is 16 bits, a range that overflows it could be anything
+    if(hi > 0xFFFF) lo = 0, hi = 0xFFFF;
+    i_range_t *I = &walk->I[addr];
+    const bool reached = map_test(analysis->reachable, addr);
+    if(reached && lo >= I->lo && hi <= I->hi) return;
+    if(!reached){
+        map_set(analysis->reachable, addr);
+        *I = (i_range_t){lo, hi};
+    }
+    else if(++walk->grown[addr] > ANALYSIS_WIDEN) *I = (i_range_t){0, 0xFFFF};
+    else *I = (i_range_t){lo < I->lo ? lo : I->lo, hi > I->hi ? hi : I->hi};
+    if(!walk->queued[addr]){
+        walk->queued[addr] = true;
+        walk->work[walk->pending++] = addr;
+    }
+}
+
+// FX33 or FX55 with I in lo..hi writes I+0 to I+last
+void walk_write(walk_t *walk, i_range_t I, uint32_t last){
+    const uint32_t end = I.hi + last;
+    for(uint32_t a = I.lo; a <= end && a < I.lo + 4096; a++) map_set(walk->analysis->written, a & 0xFFF);
+}
+
+// Walk the instruction at addr with the I range it is reached with
+void walk_instruction(walk_t *walk, uint16_t addr){
+    const chip8_t *chip8 = walk->chip8;
+    analysis_t *analysis = walk->analysis;
+    const uint16_t opcode = chip8->ram[addr] << 8 | chip8->ram[(addr + 1) & 0xFFF];
+    const uint16_t next = addr + 2, NNN = opcode & 0x0FFF;
+    const uint8_t X = (opcode >> 8) & 0x0F, NN = opcode & 0xFF;
+    const i_range_t I = walk->I[addr];
+    map_set(analysis->code, addr);
+    map_set(analysis->code, (addr + 1) & 0xFFF);
+    switch(opcode >> 12){
+        case 0x0:
+            if(opcode == 0x00EE){
+                // each return can go back to any call, grow the range they all continue with
+                const i_range_t ret = walk->ret;
+                if(ret.lo > ret.hi) walk->ret = I;
+                else walk->ret = (i_range_t){I.lo < ret.lo ? I.lo : ret.lo, I.hi > ret.hi ? I.hi : ret.hi};
+                if(walk->ret.lo != ret.lo || walk->ret.hi != ret.hi)
+                    for(uint32_t a = 0; a < 4096; a++)
+                        if(map_test(walk->returns, a)) walk_to(walk, -1, a, walk->ret.lo, walk->ret.hi, true);
+                walk_to(walk, addr, next, I.lo, I.hi, true);
+            }
+            else walk_to(walk, addr, next, I.lo, I.hi, false);
+            break;
+        case 0x1:
+            walk_to(walk, addr, NNN, I.lo, I.hi, true);
+            break;
+        case 0x2:
+            walk_to(walk, addr, NNN, I.lo, I.hi, true);
+            map_set(walk->returns, next & 0xFFF);
+            if(walk->ret.lo <= walk->ret.hi) walk_to(walk, -1, next, walk->ret.lo, walk->ret.hi, true);
+            break;
+        case 0x3: case 0x4: case 0x5: case 0x9:
+            walk_to(walk, addr, next, I.lo, I.hi, true);
+            walk_to(walk, addr, next + 2, I.lo, I.hi, true);
+            break;
+        case 0xA:
+            walk_to(walk, addr, next, NNN, NNN, false);
+            break;
+        case 0xB:
+            analysis->computed_jump = true;
+            break;
+        case 0xE:
+            walk_to(walk, addr, next, I.lo, I.hi, NN == 0x9E || NN == 0xA1);
+            if(NN == 0x9E || NN == 0xA1) walk_to(walk, addr, next + 2, I.lo, I.hi, true);
+            break;
+        case 0xF:{
+            const uint32_t advance = chip8->quirks & QUIRK_MEMORY_I ? X + 1u : 0;
+            if(NN == 0x1E) walk_to(walk, addr, next, I.lo, I.hi + 0xFF, false);
+            else if(NN == 0x29) walk_to(walk, addr, next, 0, 15 * 5, false);
+            else if(NN == 0x33){
+                walk_write(walk, I, 2);
+                walk_to(walk, addr, next, I.lo, I.hi, false);
+            }
+            else if(NN == 0x55){
+                walk_write(walk, I, X);
+                walk_to(walk, addr, next, I.lo + advance, I.hi + advance, false);
+            }
+            else if(NN == 0x65) walk_to(walk, addr, next, I.lo + advance, I.hi + advance, false);
+            else walk_to(walk, addr, next, I.lo, I.hi, false);
+            break;
+        }
+        default:
+            walk_to(walk, addr, next, I.lo, I.hi, false);
+            break;
+    }
+}
+
+// Find the ROM's reachable code, its basic blocks and the RAM it can write, starting
+// from the machine as load_chip8 left it (PC 0x200, I 0) under its quirk profile
+void analyze_code(const chip8_t *chip8, analysis_t *analysis){
+    static walk_t walk;
+    memset(&walk, 0, sizeof walk);
+    memset(analysis, 0, sizeof *analysis);
+    walk.chip8 = chip8;
+    walk.analysis = analysis;
+    walk.ret = (i_range_t){1, 0};
+    walk_to(&walk, -1, chip8->PC, chip8->I, chip8->I, true);
+    while(walk.pending){
+        const uint16_t addr = walk.work[--walk.pending];
+        walk.queued[addr] = false;
+        walk_instruction(&walk, addr);
+    }
+    for(uint32_t a = 0; a < 4096; a++){
+        if(map_test(analysis->reachable, a)) analysis->instructions++;
+        if(map_test(analysis->leaders, a)) analysis->blocks++;
+        if(map_test(analysis->code, a)){
+            analysis->code_pages |= 1ull << (a >> CODE_PAGE_SHIFT);
+            if(map_test(analysis->written, a)) analysis->self_modifying = true;
+        }
+        if(map_test(analysis->written, a)) analysis->written_pages |= 1ull << (a >> CODE_PAGE_SHIFT);
+    }
+}
+
+// What a RAM page holds: code, data FX33/FX55 write, both or neither
+const char *page_class(const analysis_t *analysis, uint32_t page){
+    const bool code = analysis->code_pages >> page & 1, written = analysis->written_pages >> page & 1;
+    return code && written ? "self-modifying" : code ? "code" : written ? "data" : "unused";
+}
+
+// Print the summary of an analysis on stderr
+void print_analysis(const analysis_t *analysis){
+    uint32_t loops = 0, code = 0, data = 0, both = 0;
+    for(uint32_t a = 0; a < 4096; a++) loops += map_test(analysis->loops, a);
+    for(uint32_t page = 0; page < 64; page++){
+        const bool c = analysis->code_pages >> page & 1, w = analysis->written_pages >> page & 1;
+        code += c && !w;
+        data += w && !c;
+        both += c && w;
+    }
+    fprintf(stderr, "Analysis:        %u instructions, %u blocks, %u loops\n",
+            analysis->instructions, analysis->blocks, loops);
+    fprintf(stderr, "RAM pages:       %u code, %u data, %u self-modifying\n", code, data, both);
+    fprintf(stderr, "Code map:        %s\n", data_pages(analysis) ? "complete, data page writes skip invalidation" :
+            analysis->computed_jump ? "incomplete, BNNN jumps to computed addresses" :
+            "incomplete, the ROM may write its own code");
+}
+
+// --print-cfg: the basic blocks with their instruction ranges and exits, then the class of
+// every RAM page, as CSV
+void print_cfg(const chip8_t *chip8, const analysis_t *analysis){
+    printf("kind,first,last,instructions,exits\n");
+    for(uint32_t a = 0; a < 4096; a++){
+        if(!map_test(analysis->leaders, a)) continue;
+        uint16_t last = a;
+        uint32_t length = 1;
+        uint16_t opcode;
+        // a block ends before the next leader or at an instruction that does not just go on
+        for(;;){
+            opcode = chip8->ram[last] << 8 | chip8->ram[(last + 1) & 0xFFF];
+            const uint16_t next = (last + 2) & 0xFFF;
+            if(!map_test(analysis->reachable, next) || map_test(analysis->leaders, next)) break;
+            if(opcode == 0x00EE || (opcode >> 12) == 0x1 || (opcode >> 12) == 0x2 || (opcode >> 12) == 0xB) break;
+            last = next;
+            length++;
+        }
+        printf("block,0x%03X,0x%03X,%u,", a, last, length);
+        const uint16_t next = (last + 2) & 0xFFF, NNN = opcode & 0x0FFF;
+        switch(opcode >> 12){
+            case 0x0:
+                if(opcode == 0x00EE) printf("return 0x%03X", next);
+                else if(map_test(analysis->reachable, next)) printf("0x%03X", next);
+                break;
+            case 0x1: printf("0x%03X", NNN); break;
+            case 0x2: printf("call 0x%03X", NNN); break;
+            case 0x3: case 0x4: case 0x5: case 0x9:
+                printf("0x%03X 0x%03X", next, (next + 2) & 0xFFF);
+                break;
+            case 0xB: printf("computed"); break;
+            case 0xE:
+                if((opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1){
+                    printf("0x%03X 0x%03X", next, (next + 2) & 0xFFF);
+                    break;
+                }
+                // fall through
+            default:
+                if(map_test(analysis->reachable, next)) printf("0x%03X", next);
+                break;
+        }
+        printf("\n");
+    }
+    for(uint32_t page = 0; page < 64; page++)
+        printf("page,0x%03X,0x%03X,,%s\n", page << CODE_PAGE_SHIFT, ((page + 1) << CODE_PAGE_SHIFT) - 1,
+               page_class(analysis, page));
+}
+
+// Decode or translate the code the analysis found before the ROM starts: every reachable
+// instruction for the pre-decoded core, the entry point and every loop for the JIT
+void precompile_code(chip8_t *chip8, const config_t config, const analysis_t *analysis){
+#if defined(DEBUG) || defined(PROFILE) || defined(TRACE)
+    // debug, profiling and tracing builds only run the reference interpreter
+    (void)chip8, (void)config, (void)analysis;
+#else
+    if(config.cpu_mode == CPU_PREDECODED){
+        if(!chip8->decoded && !(chip8->decoded = calloc(sizeof chip8->ram / 2, sizeof *chip8->decoded))) return;
+        for(uint16_t pc = 0; pc < sizeof chip8->ram; pc += 2)
+            if(map_test(analysis->reachable, pc)) chip8->decoded[pc >> 1] = decode_instruction(chip8, pc);
+    }
+#ifdef HAVE_JIT
+    if(config.cpu_mode == CPU_JIT){
+        if(!chip8->jit && !jit_init(chip8)) return;
+        chip8->jit->config = config;
+        for(uint16_t pc = 0; pc < sizeof chip8->ram; pc += 2){
+            if(pc != chip8->PC && !map_test(analysis->loops, pc)) continue;
+            if(!chip8->jit->blocks[pc >> 1] && !jit_translate(chip8, pc)) break;    // cache full
+        }
+    }
+#endif
+#endif
+}
+
+// Reference interpreter run loop, inlined with a constant quirks like emulate_quirks
+static inline __attribute__((always_inline)) void interpret(chip8_t *chip8, const config_t config, uint64_t count,
+                                                            const uint8_t quirks){
+    for(uint64_t i = 0; i < count; i++){
+        const uint16_t PC = chip8->PC;
+        emulate_quirks(chip8, config, quirks);
+        if(chip8->PC <= PC) i += idle_skip(chip8, config, chip8->PC, count - i - 1);
+    }
+}
+
+// Run count instructions with the configured CPU core
+void run_chip8(chip8_t *chip8, const config_t config, uint64_t count){
+    // timers and keys may have changed since the last run
+    chip8->idle.PC = 0xFFFF;
+    chip8->idle.countdown = 1;
+#if defined(DEBUG) || defined(PROFILE) || defined(TRACE)
+    // debug, profiling and tracing builds watch every instruction in the reference interpreter
+#else
+    if(config.cpu_mode == CPU_PREDECODED){
+        run_predecoded(chip8, config, count);
+        return;
+    }
+#ifdef HAVE_JIT
+    if(config.cpu_mode == CPU_JIT){
+        run_jit(chip8, config, count);
+        return;
+    }
+#endif
+#endif
+#ifdef PROFILE
+    const uint64_t start = SDL_GetPerformanceCounter();
+#endif
+    // the profile is chosen here once, the loop runs its own copy of the interpreter
+    switch(chip8->quirks){
+        case QUIRKS_VIP: interpret(chip8, config, count, QUIRKS_VIP); break;
+        case QUIRKS_SCHIP: interpret(chip8, config, count, QUIRKS_SCHIP); break;
+        case QUIRKS_XOCHIP: interpret(chip8, config, count, QUIRKS_XOCHIP); break;
+        default: interpret(chip8, config, count, QUIRKS_CHIP8); break;
+    }
+#ifdef PROFILE
+    if(chip8->profile) chip8->profile->emulate_ticks += SDL_GetPerformanceCounter() - start;
+#endif
+}
+
+//update the timers
+void update_timers(chip8_t *chip8){
+    if(chip8->delay_timer > 0) chip8->delay_timer--;
+    if(chip8->sound_timer > 0) chip8->sound_timer--;
+    // play sound if sound timer is greater than 0
+    // else stop the sound
+    if(chip8->beeper_gate) SDL_AtomicSet(chip8->beeper_gate, chip8->sound_timer > 0);
+}
+
+#ifdef PROFILE
+// One nonzero counter, key is an address or top nibble << 8 | sub-opcode
+typedef struct{
+    uint16_t key;
+    uint64_t count;
+} profile_entry_t;
+
+// Hottest first, ties by key so the output is stable
+int compare_profile_entries(const void *a, const void *b){
+    const profile_entry_t *x = a, *y = b;
+    if(x->count != y->count) return x->count < y->count ? 1 : -1;
+    return x->key - y->key;
+}
+
+// Name an opcode class the way the CHIP8 references write it
+void opcode_name(char name[5], uint16_t key){
+    static const char *const names[16] = {
+        "0NNN", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN", "7XNN",
+        "8XY", "9XY0", "ANNN", "BNNN", "CXNN", "DXYN", "EX", "FX",
+    };
+    const uint8_t op = key >> 8, sub = key & 0xFF;
+    if(op == 0x8) snprintf(name, 5, "8XY%X", sub & 0xF);
+    else if(op == 0xE || op == 0xF) snprintf(name, 5, "%s%02X", names[op], sub);
+    else if(op == 0x0 && sub) snprintf(name, 5, "00%02X", sub);
+    else snprintf(name, 5, "%s", names[op]);
+}
+
+// Dump the counters at exit: totals, then opcode classes and addresses hottest first,
+// then sprite heights. CSV rows of section,key,value unless the file name ends in .json
+bool write_profile(const chip8_t *chip8, const config_t config){
+    const profile_t *profile = chip8->profile;
+    if(!profile) return true;
+    FILE *out = fopen(config.profile, "w");
+    if(!out){
+        SDL_Log("Could not write profile %s\n", config.profile);
+        return false;
+    }
+    const size_t name_len = strlen(config.profile);
+    const bool json = name_len >= 5 && strcmp(config.profile + name_len - 5, ".json") == 0;
+
+    static profile_entry_t opcodes[16 * 256], pcs[4096];
+    size_t opcode_count = 0, pc_count = 0;
+    uint64_t instructions = 0;
+    for(uint16_t key = 0; key < 16 * 256; key++)
+        if(profile->opcodes[key >> 8][key & 0xFF])
+            opcodes[opcode_count++] = (profile_entry_t){key, profile->opcodes[key >> 8][key & 0xFF]};
+    for(uint16_t pc = 0; pc < 4096; pc++){
+        instructions += profile->pcs[pc];
+        if(profile->pcs[pc]) pcs[pc_count++] = (profile_entry_t){pc, profile->pcs[pc]};
+    }
+    qsort(opcodes, opcode_count, sizeof *opcodes, compare_profile_entries);
+    qsort(pcs, pc_count, sizeof *pcs, compare_profile_entries);
+    const double freq = SDL_GetPerformanceFrequency();
+    const double emulate_seconds = profile->emulate_ticks / freq;
+    const double redraw_seconds = profile->redraw_ticks / freq;
+
+    char name[5];
+    if(json){
+        fprintf(out, "{\n  \"instructions\": %llu,\n  \"idle_skipped\": %llu,\n",
+                (unsigned long long)instructions, (unsigned long long)chip8->idle.skipped);
+        fprintf(out, "  \"emulate_seconds\": %.6f,\n  \"redraw_seconds\": %.6f,\n",
+                emulate_seconds, redraw_seconds);
+        fprintf(out, "  \"opcodes\": [");
+        for(size_t i = 0; i < opcode_count; i++){
+            opcode_name(name, opcodes[i].key);
+            fprintf(out, "%s\n    {\"opcode\": \"%s\", \"count\": %llu}", i ? "," : "",
+                    name, (unsigned long long)opcodes[i].count);
+        }
+        fprintf(out, "\n  ],\n  \"hotspots\": [");
+        for(size_t i = 0; i < pc_count; i++)
+            fprintf(out, "%s\n    {\"pc\": \"0x%03X\", \"count\": %llu}", i ? "," : "",
+                    pcs[i].key, (unsigned long long)pcs[i].count);
+        fprintf(out, "\n  ],\n  \"sprite_rows\": [");
+        bool first = true;
+        for(uint8_t n = 0; n < 16; n++){
+            if(!profile->sprite_rows[n]) continue;
+            fprintf(out, "%s\n    {\"rows\": %u, \"count\": %llu}", first ? "" : ",",
+                    n, (unsigned long long)profile->sprite_rows[n]);
+            first = false;
+        }
+        fprintf(out, "\n  ]\n}\n");
+    }
+    else{
+        fprintf(out, "section,key,value\n");
+        fprintf(out, "total,instructions,%llu\n", (unsigned long long)instructions);
+        fprintf(out, "total,idle_skipped,%llu\n", (unsigned long long)chip8->idle.skipped);
+        fprintf(out, "time,emulate_seconds,%.6f\n", emulate_seconds);
+        fprintf(out, "time,redraw_seconds,%.6f\n", redraw_seconds);
+        for(size_t i = 0; i < opcode_count; i++){
+            opcode_name(name, opcodes[i].key);
+            fprintf(out, "opcode,%s,%llu\n", name, (unsigned long long)opcodes[i].count);
+        }
+        for(size_t i = 0; i < pc_count; i++)
+            fprintf(out, "pc,0x%03X,%llu\n", pcs[i].key, (unsigned long long)pcs[i].count);
+        for(uint8_t n = 0; n < 16; n++)
+            if(profile->sprite_rows[n])
+                fprintf(out, "sprite_rows,%u,%llu\n", n, (unsigned long long)profile->sprite_rows[n]);
+    }
+    const bool ok = !ferror(out);
+    if(fclose(out) != 0 || !ok){
+        SDL_Log("Could not write profile %s\n", config.profile);
+        return false;
+    }
+    return true;
+}
+#endif
+
+#ifdef TRACE
+// Write the ring oldest record first after a C8TR header. Only open/write/close so the
+// crash handler can call it too
+bool flush_trace(const trace_t *trace){
+    const uint64_t kept = trace->count < TRACE_RECORDS ? trace->count : TRACE_RECORDS;
+    const uint64_t first = (trace->count - kept) & (TRACE_RECORDS - 1);
+    const uint64_t tail = kept < TRACE_RECORDS - first ? kept : TRACE_RECORDS - first;
+    const uint32_t header[4] = {TRACE_MAGIC, TRACE_VERSION, (uint32_t)kept, sizeof(trace_record_t)};
+    const int fd = open(trace->file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return false;
+    const size_t sizes[3] = {sizeof header, tail * sizeof(trace_record_t), (kept - tail) * sizeof(trace_record_t)};
+    const void *parts[3] = {header, &trace->records[first], &trace->records[0]};
+    bool ok = true;
+    for(int i = 0; i < 3 && ok; i++)
+        for(size_t done = 0; ok && done < sizes[i];){
+            const ssize_t n = write(fd, (const uint8_t *)parts[i] + done, sizes[i] - done);
+            ok = n > 0;
+            if(ok) done += n;
+        }
+    return close(fd) == 0 && ok;
+}
+
+// The trace being recorded, for the exit and crash handlers
+trace_t *active_trace;
+
+void flush_trace_at_exit(void){
+    if(!flush_trace(active_trace)) SDL_Log("Could not write trace %s\n", active_trace->file);
+}
+
+// Save what led up to a crash, then crash as the signal would have
+void flush_trace_on_signal(int sig){
+    flush_trace(active_trace);
+    raise(sig);
+}
+
+// Record chip8 into trace, written to <rom>.trace at exit, on F9 and on crashes
+bool start_trace(chip8_t *chip8, trace_t *trace){
+    if(snprintf(trace->file, sizeof trace->file, "%s.trace", chip8->rom_name) >= (int)sizeof trace->file){
+        SDL_Log("Trace file name for %s is too long\n", chip8->rom_name);
+        return false;
+    }
+    chip8->trace = active_trace = trace;
+    atexit(flush_trace_at_exit);
+    const struct sigaction action = {.sa_handler = flush_trace_on_signal, .sa_flags = SA_RESETHAND};
+    const int signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    for(size_t i = 0; i < sizeof signals / sizeof *signals; i++) sigaction(signals[i], &action, NULL);
+    return true;
+}
+
+// Print a trace file with the debug build's instruction descriptions. Registers are rebuilt
+// from the records, so descriptions that show V values are exact once the instructions
+// that set them are in the trace. 00EE targets and EX9E/EXA1 keys are read off the next PC
+bool decode_trace(const char *name){
+    FILE *file = fopen(name, "rb");
+    if(!file){
+        SDL_Log("Could not open trace %s\n", name);
+        return false;
+    }
+    uint32_t header[4];
+    if(fread(header, sizeof header, 1, file) != 1 || header[0] != TRACE_MAGIC ||
+       header[1] != TRACE_VERSION || header[3] != sizeof(trace_record_t)){
+        SDL_Log("%s is not a trace file of this version\n", name);
+        fclose(file);
+        return false;
+    }
+    chip8_t *chip8 = alloc_machines(1);
+    if(!chip8){
+        fclose(file);
+        return false;
+    }
+    trace_record_t record, next;
+    bool have = fread(&record, sizeof record, 1, file) == 1;
+    while(have){
+        const bool have_next = fread(&next, sizeof next, 1, file) == 1;
+        chip8->inst.opcode = record.opcode;
+        chip8->inst.NNN = record.opcode & 0x0FFF;
+        chip8->inst.NN = record.opcode & 0x00FF;
+        chip8->inst.N = record.opcode & 0x000F;
+        chip8->inst.X = (record.opcode & 0x0F00) >> 8;
+        chip8->inst.Y = (record.opcode & 0x00F0) >> 4;
+        chip8->PC = record.PC + 2;
+        chip8->stack[0] = have_next ? next.PC : 0;
+        chip8->sp = 1;
+        if((record.opcode >> 12) == 0xE && have_next)
+            chip8->keypad = ((chip8->inst.NN == 0x9E) == (next.PC == record.PC + 4)) << (chip8->V[chip8->inst.X] & 0xF);
+        if((record.opcode & 0xF0FF) == 0xF007) chip8->delay_timer = record.VX;
+        printf("%12llu ", (unsigned long long)record.cycle);
+        print_debug_info(chip8);
+        // the next instruction sees what this one left behind
+        chip8->V[chip8->inst.X] = record.VX;
+        chip8->V[0xF] = record.VF;
+        chip8->I = record.I;
+        record = next;
+        have = have_next;
+    }
+    free(chip8);
+    fclose(file);
+    return true;
+}
+#endif
+
+// Full machine state, everything that decides how the machine runs from here on
+// Zero filled before saving, so padding bytes compare and compress consistently
+typedef struct{
+    uint8_t ram[4096];
+    uint64_t display[DISPLAY_PLANES][DISPLAY_ROWS][DISPLAY_WORDS];
+    uint8_t hires;          // a byte, not a bool, since state files are read back verbatim
+    uint8_t planes;
+    uint16_t stack[12];
+    uint16_t PC;
+    uint16_t I;
+    uint8_t V[16];
+    uint8_t sp;             // stack depth
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint32_t rng;
+} savestate_t;
+
+void save_state(const chip8_t *chip8, savestate_t *state){
+    memset(state, 0, sizeof *state);
+    memcpy(state->ram, chip8->ram, sizeof state->ram);
+    memcpy(state->display, chip8->display, sizeof state->display);
+    state->hires = chip8->hires;
+    state->planes = chip8->planes;
+    memcpy(state->stack, chip8->stack, sizeof state->stack);
+    state->PC = chip8->PC;
+    state->I = chip8->I;
+    memcpy(state->V, chip8->V, sizeof state->V);
+    state->sp = chip8->sp;
+    state->delay_timer = chip8->delay_timer;
+    state->sound_timer = chip8->sound_timer;
+    state->rng = chip8->rng;
+}
+
+// Restore a saved state, only the code caches for RAM that differs are dropped
+void load_state(chip8_t *chip8, const savestate_t *state){
+    const uint32_t chunk = 64;
+    chip8->data_pages = 0;      // the state may hold code the static analysis never saw
+    for(uint32_t addr = 0; addr < sizeof state->ram; addr += chunk){
+        if(memcmp(&chip8->ram[addr], &state->ram[addr], chunk) == 0) continue;
+        chip8->effects++;
+        invalidate_changed(chip8, state->ram, addr, chunk);
+        memcpy(&chip8->ram[addr], &state->ram[addr], chunk);
+    }
+    memcpy(chip8->display, state->display, sizeof chip8->display);
+    chip8->hires = state->hires != 0;
+    chip8->planes = state->planes & 0x3;
+    memcpy(chip8->stack, state->stack, sizeof chip8->stack);
+    chip8->PC = state->PC;
+    chip8->I = state->I;
+    memcpy(chip8->V, state->V, sizeof chip8->V);
+    chip8->sp = state->sp < 12 ? state->sp : 12;
+    chip8->delay_timer = state->delay_timer;
+    chip8->sound_timer = state->sound_timer;
+    chip8->rng = state->rng;
+    add_damage(chip8, 0, 0, 0xFF, 0xFF);
+}
+
+#define SAVESTATE_MAGIC 0x54533843  // "C8ST"
+#define SAVESTATE_VERSION 2
+
+// Save state file for the current ROM, <rom_name>.state
+bool state_file_name(const chip8_t *chip8, char *name, size_t size){
+    if(snprintf(name, size, "%s.state", chip8->rom_name) < (int)size) return true;
+    SDL_Log("Save state file name for %s is too long\n", chip8->rom_name);
+    return false;
+}
+
+bool save_state_file(const chip8_t *chip8){
+    char name[FILENAME_MAX];
+    if(!state_file_name(chip8, name, sizeof name)) return false;
+    savestate_t state;
+    save_state(chip8, &state);
+    const uint32_t header[2] = {SAVESTATE_MAGIC, SAVESTATE_VERSION};
+    FILE *file = fopen(name, "wb");
+    if(!file){
+        SDL_Log("Could not open save state file %s\n", name);
+        return false;
+    }
+    const bool ok = fwrite(header, sizeof header, 1, file) == 1 && fwrite(&state, sizeof state, 1, file) == 1;
+    if(fclose(file) != 0 || !ok){
+        SDL_Log("Could not write save state file %s\n", name);
+        return false;
+    }
+    printf("Saved state to %s\n", name);
+    return true;
+}
+
+bool load_state_file(chip8_t *chip8){
+    char name[FILENAME_MAX];
+    if(!state_file_name(chip8, name, sizeof name)) return false;
+    FILE *file = fopen(name, "rb");
+    if(!file){
+        SDL_Log("Could not open save state file %s\n", name);
+        return false;
+    }
+    uint32_t header[2];
+    savestate_t state;
+    const bool ok = fread(header, sizeof header, 1, file) == 1 && fread(&state, sizeof state, 1, file) == 1;
+    fclose(file);
+    if(!ok || header[0] != SAVESTATE_MAGIC || header[1] != SAVESTATE_VERSION){
+        SDL_Log("Save state file %s is invalid or from another version\n", name);
+        return false;
+    }
+    load_state(chip8, &state);
+    printf("Loaded state from %s\n", name);
+    return true;
+}
+
+// Act on hotkeys raised by handle_input
+// A recording replays from the start, so it cannot jump to a loaded state
+void handle_hotkeys(chip8_t *chip8, uint8_t hotkeys, bool recording){
+    if(hotkeys & HOTKEY_SAVE) save_state_file(chip8);
+#ifdef TRACE
+    if(hotkeys & HOTKEY_TRACE && chip8->trace){
+        if(flush_trace(chip8->trace)) printf("Wrote trace to %s\n", chip8->trace->file);
+        else SDL_Log("Could not write trace %s\n", chip8->trace->file);
+    }
+#endif
+    if(hotkeys & HOTKEY_LOAD){
+        if(recording) SDL_Log("Save states cannot be loaded while recording\n");
+        else load_state_file(chip8);
+    }
+}
+
+#define REWIND_BYTES (512 * 1024)       // compressed history budget
+#define REWIND_ENTRIES (60 * 60 * 10)   // frames of history at most, ten minutes at 60hz
+#define REWIND_KEYFRAME_INTERVAL 240    // frames between full snapshots
+// worst case delta, every byte a literal behind a two byte header per 255
+#define REWIND_MAX_ENCODED (sizeof(savestate_t) + 2 * (sizeof(savestate_t) / 255 + 1))
+
+// One frame of rewind history
+typedef struct{
+    uint32_t offset;        // start of the encoded state in rewind_t.data
+    uint32_t size;          // encoded bytes
+    uint32_t key;           // entries index of the keyframe this is a delta against, itself for a keyframe
+} rewind_entry_t;
+
+// Per-frame rewind ring, keyframes every REWIND_KEYFRAME_INTERVAL frames and XOR deltas against them
+// between, all run-length encoded into one byte ring, oldest frames drop off when it fills up
+typedef struct{
+    uint8_t data[REWIND_BYTES];
+    rewind_entry_t entries[REWIND_ENTRIES];
+    uint32_t first;         // oldest entry
+    uint32_t count;         // entries held, the oldest is always a keyframe
+    uint32_t head;          // data offset the next entry is written at
+    uint32_t since_key;     // frames pushed since the newest keyframe
+    uint32_t key;           // entries index of the newest keyframe
+    savestate_t key_state;  // newest keyframe, decoded
+    uint8_t scratch[REWIND_MAX_ENCODED]; // encoder output
+} rewind_t;
+
+// XOR state against base and run-length encode the difference
+// as (zero run, literal count, literals) tokens, both counts up to 255
+uint32_t encode_delta(const uint8_t *state, const uint8_t *base, uint32_t size, uint8_t *out){
+    uint8_t *o = out;
+    for(uint32_t i = 0; i < size;){
+        uint32_t zeros = 0, literals = 0;
+        // most of the state is unchanged, skip it a word at a time
+        for(uint64_t x, y; i + 8 <= size && zeros <= 255 - 8; zeros += 8, i += 8){
+            memcpy(&x, &state[i], 8);
+            memcpy(&y, &base[i], 8);
+            if(x != y) break;
+        }
+        while(i < size && zeros < 255 && state[i] == base[i]){
+            zeros++;
+            i++;
+        }
+        uint8_t *token = o;
+        o += 2;
+        while(i < size && literals < 255 && state[i] != base[i]){
+            *o++ = state[i] ^ base[i];
+            literals++;
+            i++;
+        }
+        token[0] = zeros;
+        token[1] = literals;
+    }
+    return o - out;
+}
+
+// XOR an encoded difference back onto state
+void decode_delta(uint8_t *state, const uint8_t *in, uint32_t size){
+    const uint8_t *end = in + size;
+    for(uint32_t i = 0; in < end;){
+        i += *in++;
+        for(uint32_t literals = *in++; literals; literals--) state[i++] ^= *in++;
+    }
+}
+
+// Decode a history entry into a full state
+void rewind_decode(const rewind_t *rw, uint32_t index, savestate_t *state){
+    const rewind_entry_t *entry = &rw->entries[index];
+    const rewind_entry_t *key = &rw->entries[entry->key];
+    memset(state, 0, sizeof *state);
+    decode_delta((uint8_t *)state, &rw->data[key->offset], key->size);
+    if(entry != key) decode_delta((uint8_t *)state, &rw->data[entry->offset], entry->size);
+}
+
+// Drop the oldest entry and the deltas that depended on it if it was a keyframe
+void rewind_evict(rewind_t *rw){
+    do{
+        rw->first = (rw->first + 1) % REWIND_ENTRIES;
+        rw->count--;
+    }while(rw->count && rw->entries[rw->first].key != rw->first);
+    if(!rw->count) rw->head = 0;
+}
+
+// Whether an entries index is still in the ring
+bool rewind_holds(const rewind_t *rw, uint32_t index){
+    return (index + REWIND_ENTRIES - rw->first) % REWIND_ENTRIES < rw->count;
+}
+
+// Data offset to write size bytes at, evicting old entries until they fit
+uint32_t rewind_reserve(rewind_t *rw, uint32_t size){
+    while(rw->count){
+        const uint32_t tail = rw->entries[rw->first].offset;
+        if(tail < rw->head){
+            if(REWIND_BYTES - rw->head >= size) return rw->head;
+            if(tail >= size) return 0;      // wrap, the end of the ring goes unused
+        }
+        else if(tail - rw->head >= size) return rw->head;
+        rewind_evict(rw);
+    }
+    return 0;
+}
+
+// Record the machine's state at the end of a frame
+void rewind_push(rewind_t *rw, const chip8_t *chip8){
+    static const savestate_t zero;
+    savestate_t state;
+    save_state(chip8, &state);
+    if(rw->count == REWIND_ENTRIES) rewind_evict(rw);
+    // a delta needs its keyframe to still be in the ring
+    bool keyframe = !rw->count || rw->since_key >= REWIND_KEYFRAME_INTERVAL;
+    for(;;){
+        const uint32_t size = encode_delta((const uint8_t *)&state,
+                                           (const uint8_t *)(keyframe ? &zero : &rw->key_state),
+                                           sizeof state, rw->scratch);
+        const uint32_t key = rw->key;
+        const uint32_t offset = rewind_reserve(rw, size);
+        if(!keyframe && !rewind_holds(rw, key)){
+            keyframe = true;    // the keyframe was evicted to make room, start a new one
+            continue;
+        }
+        const uint32_t index = (rw->first + rw->count) % REWIND_ENTRIES;
+        memcpy(&rw->data[offset], rw->scratch, size);
+        rw->entries[index] = (rewind_entry_t){.offset = offset, .size = size, .key = keyframe ? index : key};
+        rw->count++;
+        rw->head = offset + size;
+        if(keyframe){
+            rw->key = index;
+            rw->key_state = state;
+            rw->since_key = 0;
+        }
+        else rw->since_key++;
+        return;
+    }
+}
+
+// Step back one frame, false once the history is used up
+bool rewind_pop(rewind_t *rw, chip8_t *chip8){
+    if(rw->count < 2) return false;
+    rw->count--;
+    const uint32_t newest = (rw->first + rw->count - 1) % REWIND_ENTRIES;
+    rw->head = rw->entries[newest].offset + rw->entries[newest].size;
+    savestate_t state;
+    rewind_decode(rw, newest, &state);
+    load_state(chip8, &state);
+    rw->since_key = REWIND_KEYFRAME_INTERVAL;   // the next push starts from a fresh keyframe
+    return true;
+}
+
+// 64-bit FNV-1a, continuing from hash
+uint64_t hash_more(uint64_t hash, const void *data, size_t size){
+    const uint8_t *bytes = data;
+    for(size_t i = 0; i < size; i++){
+        hash ^= bytes[i];
+        hash *= 0x100000001B3;
+    }
+    return hash;
+}
+
+uint64_t hash_bytes(const void *data, size_t size){
+    return hash_more(0xCBF29CE484222325, data, size);
+}
+
+// FNV-1a hash of the display, for comparing runs
+// Only the current resolution is hashed, so lo-res hashes are those of the 64x32 display
+// before hi-res existed. The second plane counts once anything in it is lit
+uint64_t display_hash(const chip8_t *chip8){
+    const uint32_t rows = 32 << chip8->hires;
+    const size_t row_size = sizeof(uint64_t) << chip8->hires;
+    uint64_t hash = hash_bytes(NULL, 0);
+    for(uint32_t y = 0; y < rows; y++) hash = hash_more(hash, chip8->display[0][y], row_size);
+    uint64_t lit = 0;
+    for(uint32_t y = 0; y < rows; y++) lit |= chip8->display[1][y][0] | chip8->display[1][y][1];
+    if(lit)
+        for(uint32_t y = 0; y < rows; y++) hash = hash_more(hash, chip8->display[1][y], row_size);
+    return hash;
+}
+
+// A key press being timed ends at the first present that shows a different display,
+// call after every present. Presses the ROM does not react to within a second are dropped
+void measure_latency(chip8_t *chip8){
+    latency_t *latency = &chip8->latency;
+    if(!latency->since) return;
+    const uint64_t elapsed = SDL_GetPerformanceCounter() - latency->since;
+    if(elapsed > SDL_GetPerformanceFrequency()){
+        latency->since = 0;
+        return;
+    }
+    if(display_hash(chip8) == latency->shown) return;
+    if(!latency->samples || elapsed < latency->min) latency->min = elapsed;
+    if(elapsed > latency->max) latency->max = elapsed;
+    latency->total += elapsed;
+    latency->samples++;
+    latency->since = 0;
+}
+
+void print_latency(const latency_t *latency){
+    const double ms = 1000.0 / SDL_GetPerformanceFrequency();
+    if(!latency->samples){
+        puts("Input latency:   no key press changed the display");
+        return;
+    }
+    printf("Input latency:   %llu presses, min %.2f ms, avg %.2f ms, max %.2f ms\n",
+           (unsigned long long)latency->samples, latency->min * ms,
+           (double)latency->total / latency->samples * ms, latency->max * ms);
+}
+
+#define INPUT_LOG_MAGIC 0x4E493843  // "C8IN"
+#define INPUT_LOG_VERSION 2
+
+// Input log header, everything besides the keypad that decides how a session runs
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seed;          // CXNN seed
+    uint32_t clock_speed;   // instructions per second
+    uint32_t rate;          // scheduler frames per second
+    uint32_t quirks;        // quirks_t profile
+} input_log_header_t;
+
+// Keypad log: after the header, one record per keypad change, at the instruction it happened before:
+// LEB128 (cycles since the previous record << 1), then the new keypad mask as 2 bytes.
+// The last record has the low bit set and is followed by the final display hash, 8 bytes.
+typedef struct{
+    FILE *file;
+    input_log_header_t header;
+    uint64_t cycle;         // cycle of the last record written or read
+    uint16_t keys;          // keypad as of that record
+    bool started;           // recording: header written
+    // replay only
+    bool pending;           // next_keys is due at next_cycle
+    uint64_t next_cycle;
+    uint16_t next_keys;
+    bool ended;             // the end record has been read
+    uint64_t hash;          // recorded final display hash
+} input_log_t;
+
+void write_varint(FILE *file, uint64_t value){
+    for(; value >= 0x80; value >>= 7) fputc((value & 0x7F) | 0x80, file);
+    fputc(value, file);
+}
+
+bool read_varint(FILE *file, uint64_t *value){
+    *value = 0;
+    for(uint32_t shift = 0; shift < 64; shift += 7){
+        const int byte = fgetc(file);
+        if(byte == EOF) return false;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// The header is written with the first frame, once the scheduler has set the frame rate
+bool open_recording(input_log_t *log, const char *name, const config_t config){
+    *log = (input_log_t){.header = {INPUT_LOG_MAGIC, INPUT_LOG_VERSION, config.seed, config.clock_speed, 60, config.quirks}};
+    log->file = fopen(name, "wb");
+    if(!log->file){
+        SDL_Log("Could not create input log %s\n", name);
+        return false;
+    }
+    return true;
+}
+
+// Log the keypad if it changed since the last record
+void record_input(input_log_t *log, uint16_t keys, uint64_t cycle){
+    if(!log->started){
+        fwrite(&log->header, sizeof log->header, 1, log->file);
+        log->started = true;
+    }
+    if(keys == log->keys) return;
+    write_varint(log->file, (cycle - log->cycle) << 1);
+    fputc(keys & 0xFF, log->file);
+    fputc(keys >> 8, log->file);
+    log->cycle = cycle;
+    log->keys = keys;
+}
+
+// Write the end record with the final display and close the log
+bool close_recording(input_log_t *log, const chip8_t *chip8, uint64_t cycle){
+    if(!log->started) fwrite(&log->header, sizeof log->header, 1, log->file);
+    write_varint(log->file, (cycle - log->cycle) << 1 | 1);
+    const uint64_t hash = display_hash(chip8);
+    for(uint32_t b = 0; b < 8; b++) fputc(hash >> (8 * b), log->file);
+    if(fclose(log->file) != 0){
+        SDL_Log("Could not write input log\n");
+        return false;
+    }
+    return true;
+}
+
+// Read the next record of a replay
+bool read_input_record(input_log_t *log){
+    uint64_t tag;
+    if(!read_varint(log->file, &tag)) return false;
+    log->next_cycle = log->cycle + (tag >> 1);
+    if(tag & 1){
+        log->ended = true;
+        log->hash = 0;
+        for(uint32_t b = 0; b < 8; b++){
+            const int byte = fgetc(log->file);
+            if(byte == EOF) return false;
+            log->hash |= (uint64_t)byte << (8 * b);
+        }
+        return true;
+    }
+    const int lo = fgetc(log->file), hi = fgetc(log->file);
+    if(hi == EOF) return false;
+    log->next_keys = lo | hi << 8;
+    log->pending = true;
+    return true;
+}
+
+bool open_replay(input_log_t *log, const char *name){
+    *log = (input_log_t){0};
+    log->file = fopen(name, "rb");
+    if(!log->file){
+        SDL_Log("Could not open input log %s\n", name);
+        return false;
+    }
+    if(fread(&log->header, sizeof log->header, 1, log->file) != 1 ||
+       log->header.magic != INPUT_LOG_MAGIC || log->header.version != INPUT_LOG_VERSION ||
+       !log->header.rate || !read_input_record(log)){
+        SDL_Log("Input log %s is invalid or from another version\n", name);
+        fclose(log->file);
+        return false;
+    }
+    return true;
+}
+
+// Apply the keypad records due by cycle
+bool replay_input(input_log_t *log, chip8_t *chip8, uint64_t cycle){
+    while(log->pending && log->next_cycle <= cycle){
+        chip8->keypad = log->next_keys;
+        log->cycle = log->next_cycle;
+        log->pending = false;
+        if(!read_input_record(log)){
+            SDL_Log("Input log is truncated\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef HAVE_STREAM
+// Frame stream: an 8 byte header, "C8FS", the version and 3 zero bytes, then one record per
+// emulated frame, integers little endian:
+//   u16 size of the rest of the record, u32 frame number, u8 flags, u8 number of rows
+// and per row that changed: u8 plane << 7 | y, a mask of the row bytes that changed (1 byte in
+// lo-res, 2 in hi-res, bit i = byte i) and the new values of those bytes. Row byte i holds
+// pixels 8i to 8i+7, MSB leftmost. Frames without display writes cost 8 bytes and no scan
+#define STREAM_MAGIC "C8FS"
+#define STREAM_VERSION 1
+#define STREAM_HIRES 0x1    // the frame is 128x64
+#define STREAM_CLEAR 0x2    // blank the screen before applying the rows, first frame and resolution changes
+#define STREAM_RECORD_MAX (8 + DISPLAY_PLANES * DISPLAY_ROWS * (1 + DISPLAY_WORDS + DISPLAY_WORDS * 8))
+
+struct frame_stream{
+    int fd;                 // record destination, -1 once a write failed
+    bool close_fd;          // fd was opened here, stdout is left alone
+    bool started;           // the first frame has been written
+    bool hires;             // resolution the reader shows
+    uint32_t frame;         // frames written
+    uint32_t effects;       // chip8_t.effects at the last frame, unchanged = nothing drawn
+    uint64_t display[DISPLAY_PLANES][DISPLAY_ROWS][DISPLAY_WORDS];  // what the reader shows
+    uint8_t record[STREAM_RECORD_MAX];
+};
+
+// write() until everything is out, false when the reader went away
+bool write_all(int fd, const uint8_t *data, size_t size){
+    while(size){
+        const ssize_t written = write(fd, data, size);
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) return false;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Connect to HOST:PORT, -1 on failure
+int connect_stream(const char *address){
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    if(!colon || (size_t)(colon - address) >= sizeof host) return -1;
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    struct addrinfo *list, hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    if(getaddrinfo(host, colon + 1, &hints, &list) != 0) return -1;
+    int fd = -1;
+    for(const struct addrinfo *ai = list; ai && fd < 0; ai = ai->ai_next){
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0){
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(list);
+    // records are small and sent once a frame, do not hold them back for more
+    if(fd >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    return fd;
+}
+
+// Open a frame stream to a file, - for stdout or tcp:HOST:PORT and write its header
+frame_stream_t *open_stream(const char *target){
+    frame_stream_t *stream = calloc(1, sizeof *stream);
+    if(!stream){
+        SDL_Log("Could not allocate the frame stream\n");
+        return NULL;
+    }
+    stream->close_fd = strcmp(target, "-") != 0;
+    if(!stream->close_fd) stream->fd = STDOUT_FILENO;
+    else if(strncmp(target, "tcp:", 4) == 0) stream->fd = connect_stream(target + 4);
+    else stream->fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    // a reader that goes away shows up as a failed write instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+    const uint8_t header[8] = {STREAM_MAGIC[0], STREAM_MAGIC[1], STREAM_MAGIC[2], STREAM_MAGIC[3], STREAM_VERSION};
+    if(stream->fd < 0 || !write_all(stream->fd, header, sizeof header)){
+        SDL_Log("Could not open frame stream %s\n", target);
+        if(stream->fd >= 0 && stream->close_fd) close(stream->fd);
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+void close_stream(frame_stream_t *stream){
+    if(stream->fd >= 0 && stream->close_fd) close(stream->fd);
+    free(stream);
+}
+
+// Encode a frame record with the rows that differ from what the reader last got into
+// stream->record, returns its length
+uint32_t encode_frame(frame_stream_t *stream, const chip8_t *chip8){
+    uint8_t flags = chip8->hires ? STREAM_HIRES : 0;
+    bool scan = chip8->effects != stream->effects;
+    if(!stream->started || chip8->hires != stream->hires){
+        flags |= STREAM_CLEAR;
+        memset(stream->display, 0, sizeof stream->display);
+        stream->started = true;
+        stream->hires = chip8->hires;
+        scan = true;
+    }
+    stream->effects = chip8->effects;
+
+    uint8_t *out = &stream->record[8];
+    uint8_t rows = 0;
+    const uint32_t height = 32 << chip8->hires, bytes = 8 << chip8->hires;
+    for(uint8_t p = 0; scan && p < DISPLAY_PLANES; p++){
+        for(uint32_t y = 0; y < height; y++){
+            const uint64_t *row = chip8->display[p][y];
+            uint64_t *seen = stream->display[p][y];
+            if(row[0] == seen[0] && row[1] == seen[1]) continue;
+            uint8_t *mask = out;
+            *out++ = p << 7 | y;
+            out += bytes / 8;
+            uint32_t changed = 0;
+            for(uint32_t b = 0; b < bytes; b++){
+                const uint8_t value = row[b >> 3] >> (56 - 8 * (b & 7));
+                if(value == (uint8_t)(seen[b >> 3] >> (56 - 8 * (b & 7)))) continue;
+                changed |= 1 << b;
+                *out++ = value;
+            }
+            mask[1] = changed;
+            if(bytes > 8) mask[2] = changed >> 8;
+            seen[0] = row[0];
+            seen[1] = row[1];
+            rows++;
+        }
+    }
+    const uint32_t size = out - stream->record - 2;
+    const uint32_t frame = stream->frame++;
+    const uint8_t head[8] = {size, size >> 8, frame, frame >> 8, frame >> 16, frame >> 24, flags, rows};
+    memcpy(stream->record, head, sizeof head);
+    return size + 2;
+}
+
+// Write one frame record to the stream
+void stream_frame(frame_stream_t *stream, const chip8_t *chip8){
+    if(stream->fd < 0) return;
+    if(!write_all(stream->fd, stream->record, encode_frame(stream, chip8))){
+        SDL_Log("Frame stream reader went away, no longer streaming\n");
+        if(stream->close_fd) close(stream->fd);
+        stream->fd = -1;
+    }
+}
+#endif
+
+// Instructions to run in the next of rate frames per second
+// The remainder of clock_speed / rate carries over so every second runs exactly clock_speed
+uint64_t frame_cycles(uint64_t *carry, uint32_t clock_speed, uint32_t rate){
+    *carry += clock_speed;
+    const uint64_t cycles = *carry / rate;
+    *carry %= rate;
+    return cycles;
+}
+
+// Main loop frame scheduler
+typedef struct{
+    uint64_t freq;          // performance counter ticks per second
+    uint64_t last;          // performance counter at the last update
+    uint64_t acc;           // real time since the current frame began, in counter ticks * rate
+    uint32_t rate;          // emulated frames per second
+    uint64_t cycle_carry;   // see frame_cycles
+    uint32_t timer_carry;   // 60hz timer ticks owed, in 1/rate units
+    bool locked;            // one frame per display refresh, the vsync present is the clock
+    rewind_t *rewind;       // history recorded every frame, NULL without --rewind
+    input_log_t *record;    // keypad log written on every change, NULL without --record
+    uint64_t cycles;        // instructions run so far
+    bool in_frame;          // a frame has begun and not ended, see begin_frame
+    bool rewinding;         // the current frame steps back through the history instead
+    uint64_t frame_total;   // instructions in the current frame
+    uint64_t frame_done;    // and how many of them have run
+    bool turbo;             // fast-forwarding, see run_turbo_frames
+    uint32_t turbo_speed;   // fast-forward speed as a multiple of real time, 0 = uncapped
+    uint64_t refresh;       // performance counter ticks per display refresh
+    bool vsync;             // presents wait for vsync
+    uint64_t presented;     // performance counter when fast-forwarding last handed back to present
+    bool background;        // window out of sight, paced once a frame off the timer, see set_background
+} scheduler_t;
+
+#define MAX_CATCHUP_FRAMES 4    // frames emulated back to back before dropping the backlog
+#define FRAME_SLICES 4          // timer pacing wakes up this often per frame to run the time gone by
+
+// Forget time spent paused or stalled so the loop does not race to catch up
+// A frame in progress picks up where it stopped
+void reset_scheduler(scheduler_t *sched){
+    sched->last = SDL_GetPerformanceCounter();
+    sched->acc = sched->in_frame && sched->frame_total ? sched->frame_done * sched->freq / sched->frame_total : 0;
+}
+
+void init_scheduler(scheduler_t *sched, const config_t config, const sdl_t sdl, rewind_t *rewind, input_log_t *record){
+    *sched = (scheduler_t){.freq = SDL_GetPerformanceFrequency(), .rewind = rewind, .record = record};
+    sched->locked = config.pacing == PACING_DISPLAY && sdl.vsync;
+    sched->turbo = config.turbo;
+    sched->turbo_speed = config.turbo_speed;
+    sched->refresh = sched->freq / (sdl.refresh_rate ? sdl.refresh_rate : 60);
+    sched->vsync = sdl.vsync;
+    sched->rate = sched->locked ? sdl.refresh_rate : 60;
+    if(record) record->header.rate = sched->rate;
+    reset_scheduler(sched);
+}
+
+// Start the next scheduler frame, it runs in pieces through run_frame_to until end_frame
+// While rewinding the frame steps back through the history instead and runs nothing
+void begin_frame(chip8_t *chip8, const config_t config, scheduler_t *sched){
+    sched->in_frame = true;
+    sched->frame_done = 0;
+    sched->rewinding = sched->rewind && chip8->rewind_held;
+    if(sched->rewinding){
+        rewind_pop(sched->rewind, chip8);
+        sched->frame_total = 0;
+        return;
+    }
+    sched->frame_total = frame_cycles(&sched->cycle_carry, config.clock_speed, sched->rate);
+}
+
+// Run the current frame until done of its instructions have run
+void run_frame_to(chip8_t *chip8, const config_t config, scheduler_t *sched, uint64_t done){
+    if(done <= sched->frame_done) return;
+    run_chip8(chip8, config, done - sched->frame_done);
+    sched->cycles += done - sched->frame_done;
+    sched->frame_done = done;
+}
+
+// Finish the current frame, the 60hz timers tick as often as they are due
+void end_frame(chip8_t *chip8, scheduler_t *sched){
+    sched->in_frame = false;
+#ifdef HAVE_STREAM
+    if(chip8->stream) stream_frame(chip8->stream, chip8);
+#endif
+    if(sched->rewinding) return;
+    for(sched->timer_carry += 60; sched->timer_carry >= sched->rate; sched->timer_carry -= sched->rate)
+        update_timers(chip8);
+    if(sched->rewind) rewind_push(sched->rewind, chip8);
+}
+
+// Change the keypad between two instructions and log it with the instruction count
+void set_keys(chip8_t *chip8, scheduler_t *sched, uint16_t keys){
+    if(keys == chip8->keypad) return;
+    chip8->keypad = keys;
+    if(sched->record) record_input(sched->record, keys, sched->cycles);
+}
+
+// Take the oldest queued keypad change
+void pop_key(chip8_t *chip8){
+    chip8->key_head = (chip8->key_head + 1) % KEY_QUEUE;
+    chip8->key_count--;
+}
+
+// Emulate one whole scheduler frame, queued keypad changes take effect at its start
+void emulate_frame(chip8_t *chip8, const config_t config, scheduler_t *sched){
+    begin_frame(chip8, config, sched);
+    for(; chip8->key_count; pop_key(chip8)) set_keys(chip8, sched, chip8->key_queue[chip8->key_head].keys);
+    run_frame_to(chip8, config, sched, sched->frame_total);
+    end_frame(chip8, sched);
+}
+
+// Out of sight presents stop pacing the loop, so frames come off the timer even with
+// --pacing display, and the loop sleeps a whole frame at a time without spinning for precision
+// Switching either way starts from now, the frame in progress carries on where it was
+void set_background(scheduler_t *sched, bool background){
+    if(background == sched->background) return;
+    sched->background = background;
+    reset_scheduler(sched);
+}
+
+// Start or stop fast-forwarding, the time already spent is not made up at the new speed
+void set_turbo(scheduler_t *sched, bool turbo){
+    sched->turbo = turbo;
+    puts(turbo ? "===TURBO===" : "===REAL TIME===");
+    reset_scheduler(sched);
+}
+
+// Fast-forward: emulate whole frames, turbo_speed times as many as real time allows or as
+// many as fit in a display refresh when uncapped, then hand back for one present. Every
+// frame runs its usual instructions and timer ticks, so the ROM sees the same machine as
+// at real time and only presents are dropped. Returns whether a frame ended
+bool run_turbo_frames(chip8_t *chip8, const config_t config, scheduler_t *sched){
+    const uint64_t start = SDL_GetPerformanceCounter();
+    // with vsync the present waits out the rest of the refresh, leave it time to
+    const uint64_t budget = sched->vsync ? sched->refresh / 2 : sched->refresh;
+    uint64_t owed = UINT64_MAX;
+    if(sched->turbo_speed){
+        sched->acc += (start - sched->last) * sched->rate * sched->turbo_speed;
+        owed = sched->acc / sched->freq;
+        sched->acc %= sched->freq;
+    }
+    sched->last = start;
+    sched->presented = start;
+    bool ended = false;
+    if(sched->in_frame && owed){
+        // finish the frame real time left off in
+        run_frame_to(chip8, config, sched, sched->frame_total);
+        end_frame(chip8, sched);
+        owed--;
+        ended = true;
+    }
+    for(; owed && SDL_GetPerformanceCounter() - start < budget; owed--){
+        emulate_frame(chip8, config, sched);
+        ended = true;
+    }
+    // frames the host could not keep up with are dropped beyond a few refreshes' worth
+    if(sched->turbo_speed){
+        const uint64_t most = MAX_CATCHUP_FRAMES * sched->turbo_speed;
+        sched->acc += (owed < most ? owed : most) * sched->freq;
+    }
+    return ended;
+}
+
+// Emulate up to now on a fixed timestep off an accumulator, returns whether a frame ended
+// Each frame runs as its time passes, so a queued keypad change lands between the
+// instructions that straddle the moment SDL saw it instead of on the next frame
+bool run_scheduled_frames(chip8_t *chip8, const config_t config, scheduler_t *sched){
+    if(sched->turbo) return run_turbo_frames(chip8, config, sched);
+    if(sched->locked && !sched->background){
+        emulate_frame(chip8, config, sched);
+        return true;
+    }
+    const uint64_t now = SDL_GetPerformanceCounter();
+    sched->acc += (now - sched->last) * sched->rate;
+    sched->last = now;
+    if(sched->acc >= MAX_CATCHUP_FRAMES * sched->freq)
+        sched->acc = MAX_CATCHUP_FRAMES * sched->freq;  // too far behind, drop the backlog
+    for(bool ended = false;; ended = true){
+        if(!sched->in_frame) begin_frame(chip8, config, sched);
+        // keypad changes that happened during this frame, earlier ones apply right away
+        while(chip8->key_count){
+            const key_event_t *event = &chip8->key_queue[chip8->key_head];
+            const uint64_t age = event->time < now ? (now - event->time) * sched->rate : 0;
+            const uint64_t at = sched->acc > age ? sched->acc - age : 0;
+            if(at >= sched->freq) break;        // in a later frame
+            run_frame_to(chip8, config, sched, at * sched->frame_total / sched->freq);
+            set_keys(chip8, sched, event->keys);
+            pop_key(chip8);
+        }
+        if(sched->acc < sched->freq){
+            run_frame_to(chip8, config, sched, sched->acc * sched->frame_total / sched->freq);
+            return ended;
+        }
+        run_frame_to(chip8, config, sched, sched->frame_total);
+        end_frame(chip8, sched);
+        sched->acc -= sched->freq;
+    }
+}
+
+// Machine state kept while running ahead, see begin_run_ahead
+typedef struct{
+    savestate_t state;
+    uint16_t keypad;        // the rest is what load_state leaves alone but emulation changes
+    idle_t idle;
+    uint32_t effects;
+    uint64_t data_pages;
+    SDL_atomic_t *beeper_gate;
+    frame_stream_t *stream;
+#ifdef PROFILE
+    profile_t *profile;
+#endif
+#ifdef TRACE
+    trace_t *trace;
+#endif
+} run_ahead_t;
+
+// Run-ahead: save the machine, then emulate config.run_ahead frames past the current one
+// with the newest keypad, queued changes included, so the frame presented next already
+// shows the response to a key the ROM would otherwise draw a frame or two later. Nothing
+// the future frames do is heard, streamed, recorded, traced or profiled, and
+// end_run_ahead puts the machine back as it was
+void begin_run_ahead(chip8_t *chip8, const config_t config, const scheduler_t *sched, run_ahead_t *saved){
+    save_state(chip8, &saved->state);
+    saved->keypad = chip8->keypad;
+    saved->idle = chip8->idle;
+    saved->effects = chip8->effects;
+    saved->data_pages = chip8->data_pages;
+    saved->beeper_gate = chip8->beeper_gate;
+    saved->stream = chip8->stream;
+    chip8->beeper_gate = NULL;
+    chip8->stream = NULL;
+#ifdef PROFILE
+    saved->profile = chip8->profile;
+    chip8->profile = NULL;
+#endif
+#ifdef TRACE
+    saved->trace = chip8->trace;
+    chip8->trace = NULL;
+#endif
+    if(chip8->key_count) chip8->keypad = chip8->key_queue[(chip8->key_head + chip8->key_count - 1) % KEY_QUEUE].keys;
+
+    // a copy of the schedule, without the rewind history and keypad log
+    scheduler_t ahead = *sched;
+    ahead.rewind = NULL;
+    ahead.record = NULL;
+    if(ahead.in_frame){
+        run_frame_to(chip8, config, &ahead, ahead.frame_total);
+        end_frame(chip8, &ahead);
+    }
+    for(uint32_t k = 0; k < config.run_ahead; k++){
+        begin_frame(chip8, config, &ahead);
+        run_frame_to(chip8, config, &ahead, ahead.frame_total);
+        end_frame(chip8, &ahead);
+    }
+    // any of the display may differ from the last future presented
+    chip8->draw = true;
+    chip8->damage = (damage_t){0, 0, 0xFF, 0xFF};
+}
+
+// Back from the future begin_run_ahead emulated, its display has been presented
+void end_run_ahead(chip8_t *chip8, const run_ahead_t *saved){
+    load_state(chip8, &saved->state);
+    chip8->keypad = saved->keypad;
+    chip8->idle = saved->idle;
+    chip8->effects = saved->effects;
+    chip8->data_pages = saved->data_pages;     // the state is the machine's own, its code is unchanged
+    chip8->beeper_gate = saved->beeper_gate;
+    chip8->stream = saved->stream;
+#ifdef PROFILE
+    chip8->profile = saved->profile;
+#endif
+#ifdef TRACE
+    chip8->trace = saved->trace;
+#endif
+    chip8->draw = false;    // the real frame is never presented, only futures are
+}
+
+// Sleep until the performance counter reaches deadline
+// The OS sleep stops a millisecond short to absorb wakeup latency, the rest is a spin
+void sleep_until(uint64_t deadline){
+    const uint64_t freq = SDL_GetPerformanceFrequency();
+    const uint64_t slack = freq / 1000;
+    for(uint64_t now; (now = SDL_GetPerformanceCounter()) < deadline;){
+        uint64_t left = deadline - now;
+        if(left <= slack) continue;
+        left = left - slack < freq ? left - slack : freq;
+#ifdef _WIN32
+        SDL_Delay(left * 1000 / freq);
+#else
+        const uint64_t ns = left * 1000000000 / freq;
+        nanosleep(&(struct timespec){.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000}, NULL);
+#endif
+    }
+}
+
+// Wait for the next slice of the frame to come due, vsync presents have waited already
+// In the background wait for the end of the frame instead, late by up to a millisecond
+void wait_next_frame(const scheduler_t *sched, const sdl_t sdl){
+    if(sched->background && !sched->turbo){
+        const uint64_t left = sched->acc < sched->freq ? sched->freq - sched->acc : 0;
+        const uint64_t due = sched->last + (left + sched->rate - 1) / sched->rate;
+        const uint64_t now = SDL_GetPerformanceCounter();
+        if(due > now) SDL_Delay((due - now) * 1000 / sched->freq + 1);
+        return;
+    }
+    if(sdl.vsync && !sched->background) return;
+    // fast-forwarding presents once a display refresh, however many frames that is
+    if(sched->turbo){
+        sleep_until(sched->presented + sched->refresh);
+        return;
+    }
+    const uint64_t slice = sched->freq / FRAME_SLICES;
+    uint64_t wait = slice - sched->acc % slice;
+    if(wait > sched->freq - sched->acc) wait = sched->freq - sched->acc;
+    sleep_until(sched->last + (wait + sched->rate - 1) / sched->rate);
+}
+
+// Emulate uncapped 60hz frames until the configured instruction or frame limit
+void run_headless_frames(chip8_t *chip8, const config_t config, uint64_t *instructions_out, uint64_t *frames_out){
+    uint64_t carry = 0;
+    uint64_t instructions = 0;
+    uint64_t frames = 0;
+
+    while(chip8->state != QUIT){
+        // emulate one 60hz frame, or what is left of the instruction limit
+        uint64_t count = frame_cycles(&carry, config.clock_speed, 60);
+        if(config.max_instructions && config.max_instructions - instructions < count)
+            count = config.max_instructions - instructions;
+        run_chip8(chip8, config, count);
+        instructions += count;
+        chip8->draw = false;    // nothing to present, drop the damage
+        update_timers(chip8);
+#ifdef HAVE_STREAM
+        if(chip8->stream) stream_frame(chip8->stream, chip8);
+#endif
+        frames++;
+
+        if(config.max_instructions && instructions >= config.max_instructions) break;
+        if(config.max_frames && frames >= config.max_frames) break;
+    }
+    *instructions_out = instructions;
+    *frames_out = frames;
+}
+
+// Run without SDL video as fast as possible and report emulation throughput
+void run_headless(chip8_t *chip8, const config_t config){
+    uint64_t instructions, frames;
+
+    const uint64_t before = SDL_GetPerformanceCounter();
+    run_headless_frames(chip8, config, &instructions, &frames);
+    const uint64_t after = SDL_GetPerformanceCounter();
+
+    const double seconds = (double)(after - before) / SDL_GetPerformanceFrequency();
+    // a frame stream on stdout keeps it to itself
+    FILE *out = config.stream && strcmp(config.stream, "-") == 0 ? stderr : stdout;
+    fprintf(out, "ROM:             %s\n", chip8->rom_name);
+    fprintf(out, "Seed:            %u\n", config.seed);
+    fprintf(out, "Instructions:    %llu\n", (unsigned long long)instructions);
+    fprintf(out, "Frames:          %llu\n", (unsigned long long)frames);
+    fprintf(out, "Idle skipped:    %llu\n", (unsigned long long)chip8->idle.skipped);
+    fprintf(out, "Wall time:       %.6f s\n", seconds);
+    fprintf(out, "MIPS:            %.3f\n", instructions / seconds / 1e6);
+    fprintf(out, "Frames/sec:      %.1f\n", frames / seconds);
+    fprintf(out, "ns/instruction:  %.3f\n", instructions ? seconds * 1e9 / instructions : 0.0);
+    fprintf(out, "Display hash:    %016llx\n", (unsigned long long)display_hash(chip8));
+}
+
+#ifdef HAVE_STREAM
+// Apply one frame record, from past its size field, to the display. False if it does not parse
+bool apply_stream_record(chip8_t *chip8, const uint8_t *record, uint32_t length){
+    const uint8_t flags = record[4], rows = record[5];
+    const uint8_t *in = record + 6, *end = record + length;
+    if(flags & STREAM_CLEAR){
+        chip8->hires = flags & STREAM_HIRES;
+        memset(chip8->display, 0, sizeof chip8->display);
+        add_damage(chip8, 0, 0, 0xFF, 0xFF);
+    }
+    const uint32_t bytes = 8 << chip8->hires;
+    for(uint8_t r = 0; r < rows; r++){
+        if(end - in < 1 + (ptrdiff_t)bytes / 8) return false;
+        const uint8_t p = in[0] >> 7, y = in[0] & 0x7F;
+        const uint32_t mask = in[1] | (bytes > 8 ? in[2] << 8 : 0);
+        in += 1 + bytes / 8;
+        if(y >= 32u << chip8->hires || end - in < __builtin_popcount(mask)) return false;
+        if(!mask) continue;
+        uint64_t *row = chip8->display[p][y];
+        for(uint32_t b = 0; b < bytes; b++){
+            if(!(mask & 1 << b)) continue;
+            const uint32_t shift = 56 - 8 * (b & 7);
+            row[b >> 3] = (row[b >> 3] & ~((uint64_t)0xFF << shift)) | (uint64_t)*in++ << shift;
+        }
+        add_damage(chip8, __builtin_ctz(mask) * 8, y, (31 - __builtin_clz(mask)) * 8 + 7, y);
+    }
+    return in == end;
+}
+
+// Show a frame stream (--play-stream) at 60 frames a second, or headless as fast as it can be
+// read, then print how many frames it had and the display hash it ended on
+bool play_stream(const char *name, const config_t config){
+    FILE *file = strcmp(name, "-") == 0 ? stdin : fopen(name, "rb");
+    if(!file){
+        SDL_Log("Could not open frame stream %s\n", name);
+        return false;
+    }
+    uint8_t header[8];
+    chip8_t *view = alloc_machines(1);
+    if(!view || fread(header, sizeof header, 1, file) != 1 ||
+       memcmp(header, STREAM_MAGIC, 4) != 0 || header[4] != STREAM_VERSION){
+        if(view) SDL_Log("%s is not a frame stream of this version\n", name);
+        free(view);
+        if(file != stdin) fclose(file);
+        return false;
+    }
+    view->state = RUNNING;
+    sdl_t sdl = {0};
+    bool ok = config.headless || init_sdl(&sdl, config);
+    if(ok && !config.headless) clear_screen(config, sdl);
+
+    const uint64_t freq = SDL_GetPerformanceFrequency();
+    uint64_t next = SDL_GetPerformanceCounter();
+    uint32_t frames = 0;
+    uint8_t record[STREAM_RECORD_MAX];
+    while(ok && view->state != QUIT){
+        if(!config.headless){
+            // only quit and pause mean anything here
+            handle_input(view);
+            view->hotkeys = 0;
+            view->key_count = 0;
+            if(view->state == PAUSED){
+                if(view->draw && !(view->window & WINDOW_HIDDEN)) redraw_screen(sdl, config, view);
+                wait_for_event();
+                next = SDL_GetPerformanceCounter();
+                continue;
+            }
+        }
+        uint8_t size[2];
+        if(fread(size, sizeof size, 1, file) != 1) break;   // end of the stream
+        const uint32_t length = size[0] | size[1] << 8;
+        if(length < 6 || length > sizeof record || fread(record, length, 1, file) != 1 ||
+           !apply_stream_record(view, record, length)){
+            SDL_Log("Frame stream %s is truncated or corrupt\n", name);
+            ok = false;
+            break;
+        }
+        frames++;
+        if(config.headless) continue;
+        // a hidden window shows nothing, the stream is still read in real time
+        const bool hidden = view->window & WINDOW_HIDDEN;
+        if(!hidden) redraw_screen(sdl, config, view);
+        if(!sdl.vsync || hidden){
+            // a live stream that stalled picks up from now instead of racing through the backlog
+            const uint64_t now = SDL_GetPerformanceCounter();
+            next = now > next + freq / 10 ? now : next + freq / 60;
+            sleep_until(next);
+        }
+    }
+    printf("Frames:          %u\n", frames);
+    printf("Display hash:    %016llx\n", (unsigned long long)display_hash(view));
+    if(!config.headless && sdl.window) final_cleanup(sdl);
+    free(view);
+    if(file != stdin) fclose(file);
+    return ok;
+}
+#endif
+
+// Rerun a recorded session headless as fast as possible and check it ends on the recorded display
+bool run_replay(chip8_t *chip8, config_t config){
+    input_log_t log;
+    if(!open_replay(&log, config.replay)) return false;
+    config.seed = log.header.seed;
+    config.clock_speed = log.header.clock_speed;
+    config.quirks = chip8->quirks = log.header.quirks;
+    seed_random(chip8, config.seed);
+    // the recorded schedule, one frame after another
+    scheduler_t sched = {.rate = log.header.rate};
+    uint64_t frames = 0;
+    bool ok = true;
+
+    const uint64_t before = SDL_GetPerformanceCounter();
+    while(ok && !(log.ended && sched.cycles >= log.next_cycle)){
+        begin_frame(chip8, config, &sched);
+        const uint64_t start = sched.cycles;
+        // keypad changes land between the instructions they were recorded at,
+        // and the recording may have stopped in the middle of a frame
+        for(;;){
+            const uint64_t due = log.next_cycle - start;
+            run_frame_to(chip8, config, &sched, due < sched.frame_total ? due : sched.frame_total);
+            if(log.ended || sched.cycles != log.next_cycle) break;
+            if(!(ok = replay_input(&log, chip8, sched.cycles))) break;
+        }
+        if(sched.frame_done < sched.frame_total) break;
+        end_frame(chip8, &sched);
+        chip8->draw = false;
+        frames++;
+    }
+    const uint64_t after = SDL_GetPerformanceCounter();
+    fclose(log.file);
+
+    const double seconds = (double)(after - before) / SDL_GetPerformanceFrequency();
+    const uint64_t hash = display_hash(chip8);
+    printf("ROM:             %s\n", chip8->rom_name);
+    printf("Seed:            %u\n", config.seed);
+    printf("Instructions:    %llu\n", (unsigned long long)sched.cycles);
+    printf("Frames:          %llu\n", (unsigned long long)frames);
+    printf("Wall time:       %.6f s\n", seconds);
+    printf("MIPS:            %.3f\n", sched.cycles / seconds / 1e6);
+    printf("Display hash:    %016llx\n", (unsigned long long)hash);
+    printf("Recorded hash:   %016llx\n", (unsigned long long)log.hash);
+    ok = ok && hash == log.hash && sched.cycles == log.next_cycle;
+    printf("Replay:          %s\n", ok ? "match" : "MISMATCH");
+    return ok;
+}
+
+// Final state of one batch instance
+typedef struct{
+    uint64_t instructions;  // instructions executed
+    uint64_t frames;        // 60hz frames emulated
+    uint64_t hash;          // display_hash of the final framebuffer
+    uint16_t PC;            // final program counter
+    uint16_t I;             // final index register
+    uint8_t V[16];          // final registers
+} batch_result_t;
+
+// Instances owned by one worker, claimed one at a time so idle workers can steal them
+typedef struct{
+    SDL_atomic_t next;      // next unclaimed instance
+    int end;                // one past the last instance of the range
+    char pad[CACHE_LINE - sizeof(SDL_atomic_t) - sizeof(int)]; // one counter per cache line
+} batch_range_t;
+
+// Batch shared by all workers, only the range counters are written concurrently
+typedef struct{
+    const chip8_t *rom;     // freshly loaded machine every instance starts from, read only
+    config_t config;        // run length and CPU core for every instance
+    batch_range_t *ranges;  // one range per worker
+    uint32_t workers;       // number of ranges
+    batch_result_t *results; // one slot per instance, written only by the worker that ran it
+} batch_t;
+
+// Worker thread argument
+typedef struct{
+    batch_t *batch;
+    uint32_t id;            // index of the worker's own range
+} batch_worker_t;
+
+// Reset a machine to the freshly loaded ROM, keeping its code caches allocated
+// Code the last instance left as the ROM has it stays decoded and translated, so running
+// the same ROM again costs a copy and a compare instead of decoding it all over
+void reset_instance(chip8_t *chip8, const chip8_t *rom){
+    decoded_t *decoded = chip8->decoded;
+    jit_t *jit = chip8->jit;
+    if(chip8->quirks == rom->quirks && chip8->data_pages == rom->data_pages){
+        // only the bytes the previous instance rewrote, as load_state does
+        const uint32_t chunk = 64;
+        chip8->data_pages = 0;
+        for(uint32_t addr = 0; addr < sizeof chip8->ram; addr += chunk)
+            if(memcmp(&chip8->ram[addr], &rom->ram[addr], chunk)) invalidate_changed(chip8, rom->ram, addr, chunk);
+    }
+    else{
+        // decoded handlers and translations follow the quirk profile and the analysis
+        if(decoded) memset(decoded, 0, sizeof chip8->ram / 2 * sizeof *decoded);
+#ifdef HAVE_JIT
+        if(jit) jit_flush(jit);
+#endif
+    }
+    const bool jit_failed = chip8->jit_failed;
+    *chip8 = *rom;
+    chip8->decoded = decoded;
+    chip8->jit = jit;
+    chip8->jit_failed = jit_failed;
+}
+
+// Release a machine's code caches, the machine itself belongs to whoever allocated it
+void free_caches(chip8_t *chip8){
+    free(chip8->decoded);
+#ifdef HAVE_JIT
+    if(chip8->jit) jit_free(chip8->jit);
+#endif
+    chip8->decoded = NULL;
+    chip8->jit = NULL;
+}
+
+#define POOL_BLOCK 64       // machines carved out of one arena allocation
+
+// Machines of one ROM for the batch runner and the server. The arena grows a block at a
+// time and never shrinks, released machines go on a free list and keep their code caches,
+// so handing one out again is a reset_instance instead of an allocation and a file read
+typedef struct{
+    const chip8_t *rom;     // freshly loaded machine everything handed out starts as
+    chip8_t **blocks;       // arena blocks of POOL_BLOCK machines
+    chip8_t **free;         // released machines, the last one is handed out next
+    uint32_t capacity;      // most machines out at once
+    uint32_t carved;        // machines ever taken from the arena
+    uint32_t free_count;
+} machine_pool_t;
+
+bool init_pool(machine_pool_t *pool, const chip8_t *rom, uint32_t capacity){
+    *pool = (machine_pool_t){.rom = rom, .capacity = capacity};
+    pool->blocks = calloc((capacity + POOL_BLOCK - 1) / POOL_BLOCK, sizeof *pool->blocks);
+    pool->free = calloc(capacity, sizeof *pool->free);
+    if(!pool->blocks || !pool->free){
+        SDL_Log("Could not allocate a pool of %u machines\n", capacity);
+        free(pool->blocks);
+        free(pool->free);
+        return false;
+    }
+    return true;
+}
+
+// A machine reset to the pool's ROM, NULL once capacity machines are out or memory ran out
+chip8_t *acquire_machine(machine_pool_t *pool){
+    chip8_t *chip8;
+    if(pool->free_count) chip8 = pool->free[--pool->free_count];
+    else if(pool->carved < pool->capacity){
+        chip8_t **block = &pool->blocks[pool->carved / POOL_BLOCK];
+        const uint32_t left = pool->capacity - pool->carved;
+        if(!*block && !(*block = alloc_machines(left < POOL_BLOCK ? left : POOL_BLOCK))) return NULL;
+        chip8 = &(*block)[pool->carved++ % POOL_BLOCK];
+    }
+    else return NULL;
+    reset_instance(chip8, pool->rom);
+    return chip8;
+}
+
+void release_machine(machine_pool_t *pool, chip8_t *chip8){
+    pool->free[pool->free_count++] = chip8;
+}
+
+void free_pool(machine_pool_t *pool){
+    for(uint32_t m = 0; m < pool->carved; m++) free_caches(&pool->blocks[m / POOL_BLOCK][m % POOL_BLOCK]);
+    for(uint32_t b = 0; b < (pool->capacity + POOL_BLOCK - 1) / POOL_BLOCK; b++) free(pool->blocks[b]);
+    free(pool->blocks);
+    free(pool->free);
+}
+
+// Copy a finished instance into its result slot
+void record_result(batch_result_t *result, const chip8_t *chip8){
+    result->hash = display_hash(chip8);
+    result->PC = chip8->PC;
+    result->I = chip8->I;
+    memcpy(result->V, chip8->V, sizeof result->V);
+}
+
+// Lockstep groups put one instance in each vector lane
+// 16 byte lanes fill an SSE2/NEON register, -mavx2 or -mavx512bw widen the group to 32 or 64
+#if defined(__AVX512BW__)
+#define LOCKSTEP_LANES 64
+#elif defined(__AVX2__)
+#define LOCKSTEP_LANES 32
+#else
+#define LOCKSTEP_LANES 16
+#endif
+typedef uint8_t lane8_t __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef int8_t mask8_t __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef uint16_t lane16_t __attribute__((vector_size(2 * LOCKSTEP_LANES)));
+typedef uint32_t lane32_t __attribute__((vector_size(4 * LOCKSTEP_LANES)));
+
+// Structure of arrays over a group of machines running the same ROM
+// While locked the registers live here and every lane follows one PC,
+// RAM, display and keypad always stay in the lane machines
+typedef struct{
+    lane8_t V[16];          // V[r][lane]
+    lane16_t I;             // index register of each lane
+    lane8_t delay_timer;    // delay timer of each lane
+    lane8_t sound_timer;    // sound timer of each lane
+    lane32_t rng;           // CXNN generator of each lane
+    uint16_t PC;            // program counter shared by all lanes
+    uint16_t stack[12];     // subroutine stack shared by all lanes
+    uint8_t sp;             // stack depth
+    bool locked;            // registers are held here, false while the lanes step on their own
+    chip8_t *lanes[LOCKSTEP_LANES]; // machine behind each lane
+    uint8_t written[4096];  // addresses some lane stored to, opcodes there may differ per lane
+} lockstep_t;
+
+// Whether every lane of a comparison is true
+bool lanes_all(const mask8_t *mask){
+    uint64_t words[LOCKSTEP_LANES / 8];
+    memcpy(words, mask, sizeof words);
+    uint64_t all = ~0ull;
+    for(uint32_t w = 0; w < LOCKSTEP_LANES / 8; w++) all &= words[w];
+    return all == ~0ull;
+}
+
+// Whether any lane of a comparison is true
+bool lanes_any(const mask8_t *mask){
+    uint64_t words[LOCKSTEP_LANES / 8];
+    memcpy(words, mask, sizeof words);
+    uint64_t any = 0;
+    for(uint32_t w = 0; w < LOCKSTEP_LANES / 8; w++) any |= words[w];
+    return any != 0;
+}
+
+// Hand the registers back to the lane machines so each can step on its own
+void lockstep_scatter(lockstep_t *group){
+    for(uint32_t l = 0; l < LOCKSTEP_LANES; l++){
+        chip8_t *chip8 = group->lanes[l];
+        for(uint32_t r = 0; r < 16; r++) chip8->V[r] = group->V[r][l];
+        chip8->I = group->I[l];
+        chip8->delay_timer = group->delay_timer[l];
+        chip8->sound_timer = group->sound_timer[l];
+        chip8->rng = group->rng[l];
+        chip8->PC = group->PC;
+        memcpy(chip8->stack, group->stack, sizeof chip8->stack);
+        chip8->sp = group->sp;
+    }
+    group->locked = false;
+}
+
+// Take the registers from the lane machines if they agree on PC and stack
+bool lockstep_gather(lockstep_t *group){
+    const chip8_t *first = group->lanes[0];
+    const uint8_t sp = first->sp;
+    if(sp > 12) return false;     // ran off the stack, leave that to the scalar cores
+    for(uint32_t l = 1; l < LOCKSTEP_LANES; l++){
+        const chip8_t *chip8 = group->lanes[l];
+        if(chip8->PC != first->PC || chip8->sp != sp ||
+           memcmp(chip8->stack, first->stack, sp * sizeof *first->stack))
+            return false;
+    }
+    // stores the scalar cores made while scattered never went through lockstep_written,
+    // so mark whatever RAM the lanes now disagree on
+    const uint32_t chunk = 64;
+    for(uint32_t l = 1; l < LOCKSTEP_LANES; l++){
+        const chip8_t *chip8 = group->lanes[l];
+        for(uint32_t addr = 0; addr < sizeof first->ram; addr += chunk){
+            if(memcmp(&chip8->ram[addr], &first->ram[addr], chunk) == 0) continue;
+            for(uint32_t i = addr; i < addr + chunk; i++)
+                if(chip8->ram[i] != first->ram[i]) group->written[i] = 1;
+        }
+    }
+    for(uint32_t l = 0; l < LOCKSTEP_LANES; l++){
+        const chip8_t *chip8 = group->lanes[l];
+        for(uint32_t r = 0; r < 16; r++) group->V[r][l] = chip8->V[r];
+        group->I[l] = chip8->I;
+        group->delay_timer[l] = chip8->delay_timer;
+        group->sound_timer[l] = chip8->sound_timer;
+        group->rng[l] = chip8->rng;
+    }
+    group->PC = first->PC;
+    memcpy(group->stack, first->stack, sizeof group->stack);
+    group->sp = sp;
+    group->locked = true;
+    return true;
+}
+
+// Remember that some lane stored to addr..addr+len-1, wrapping at the end of RAM
+void lockstep_written(lockstep_t *group, uint16_t addr, uint16_t len){
+    for(uint32_t i = addr; i < (uint32_t)addr + len; i++)
+        group->written[i & 0xFFF] = 1;
+}
+
+// Whether every lane has the same opcode at PC
+bool lockstep_same_code(const lockstep_t *group, uint16_t PC){
+    const chip8_t *first = group->lanes[0];
+    for(uint32_t l = 1; l < LOCKSTEP_LANES; l++)
+        if(group->lanes[l]->ram[PC] != first->ram[PC] || group->lanes[l]->ram[PC+1] != first->ram[PC+1])
+            return false;
+    return true;
+}
+
+// Step a locked group up to count instructions, one vector operation per instruction
+// Scatters the group and returns the instructions left when the lanes stop agreeing
+// Inlined with a constant quirks like emulate_quirks, every lane runs the same ROM
+static inline __attribute__((always_inline)) uint64_t lockstep_quirks(lockstep_t *group, const config_t config, uint64_t count,
+                                                                      const uint8_t quirks){
+    lane8_t *const V = group->V;
+    const chip8_t *const first = group->lanes[0];
+    while(count){
+        const uint16_t PC = group->PC;
+        if(PC > 0xFFE || ((group->written[PC] | group->written[PC+1]) && !lockstep_same_code(group, PC))){
+            // out of range or code rewritten differently per lane
+            lockstep_scatter(group);
+            return count;
+        }
+        count--;
+        const uint16_t opcode = first->ram[PC] << 8 | first->ram[PC+1];
+        const uint16_t NNN = opcode & 0x0FFF;
+        const uint8_t NN = opcode & 0x00FF;
+        const uint8_t N = opcode & 0x000F;
+        const uint8_t X = (opcode & 0x0F00) >> 8;
+        const uint8_t Y = (opcode & 0x00F0) >> 4;
+        group->PC = PC + 2;
+
+        mask8_t skip;
+        bool slow = false;  // no vector form, step every lane through emulate_chip8
+        switch(opcode >> 12){
+            case 0x0:
+                if(NN == 0xE0){
+                    for(uint32_t l = 0; l < LOCKSTEP_LANES; l++) clear_display(group->lanes[l]);
+                }
+                else if(NN == 0xEE){
+                    if(!group->sp){
+                        slow = true;
+                        break;
+                    }
+                    group->PC = group->stack[--group->sp];
+                }
+                else if(extended_0nnn(opcode)){
+                    // display state is per lane
+                    slow = true;
+                    break;
+                }
+                continue;
+            case 0x1:
+                group->PC = NNN;
+                continue;
+            case 0x2:
+                if(group->sp == 12){
+                    slow = true;
+                    break;
+                }
+                group->stack[group->sp++] = group->PC;
+                group->PC = NNN;
+                continue;
+            case 0x3:
+                skip = V[X] == NN;
+                break;
+            case 0x4:
+                skip = V[X] != NN;
+                break;
+            case 0x5:
+                skip = V[X] == V[Y];
+                break;
+            case 0x6:
+                V[X] = (lane8_t){0} + NN;
+                continue;
+            case 0x7:
+                V[X] += NN;
+                continue;
+            case 0x8:
+                // same statement order as the interpreter so X or Y == F behaves the same
+                switch(N){
+                    case 0x0: V[X] = V[Y]; break;
+                    case 0x1:
+                        V[X] |= V[Y];
+                        if(quirks & QUIRK_VF_RESET) V[0xF] = (lane8_t){0};
+                        break;
+                    case 0x2:
+                        V[X] &= V[Y];
+                        if(quirks & QUIRK_VF_RESET) V[0xF] = (lane8_t){0};
+                        break;
+                    case 0x3:
+                        V[X] ^= V[Y];
+                        if(quirks & QUIRK_VF_RESET) V[0xF] = (lane8_t){0};
+                        break;
+                    case 0x4:
+                        V[0xF] = (lane8_t)(V[Y] > (0xFF - V[X])) & 1;
+                        V[X] += V[Y];
+                        break;
+                    case 0x5:
+                        V[0xF] = (lane8_t)(V[Y] <= V[X]) & 1;
+                        V[X] -= V[Y];
+                        break;
+                    case 0x6:
+                        if(quirks & QUIRK_SHIFT_VY){
+                            V[0xF] = V[Y] & 1;
+                            V[X] = V[Y] >> 1;
+                        }
+                        else{
+                            V[0xF] = V[X] & 1;
+                            V[X] >>= 1;
+                        }
+                        break;
+                    case 0x7:
+                        V[0xF] = (lane8_t)(V[X] <= V[Y]) & 1;
+                        V[X] = V[Y] - V[X];
+                        break;
+                    case 0xE:
+                        if(quirks & QUIRK_SHIFT_VY){
+                            V[0xF] = (V[Y] & 0x80) >> 7;
+                            V[X] = V[Y] << 1;
+                        }
+                        else{
+                            V[0xF] = (V[X] & 0x80) >> 7;
+                            V[X] <<= 1;
+                        }
+                        break;
+                    default:
+                        break;
+                }
+                continue;
+            case 0x9:
+                skip = V[X] != V[Y];
+                break;
+            case 0xA:
+                group->I = (lane16_t){0} + NNN;
+                continue;
+            case 0xC:{
+                // xorshift32 in every lane, same steps as random_byte
+                lane32_t x = group->rng;
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                group->rng = x;
+                V[X] = __builtin_convertvector(x >> 24, lane8_t) & NN;
+                continue;
+            }
+            case 0xD:
+                // display and sprite data are per lane
+                for(uint32_t l = 0; l < LOCKSTEP_LANES; l++){
+                    chip8_t *chip8 = group->lanes[l];
+                    chip8->V[X] = V[X][l];
+                    chip8->V[Y] = V[Y][l];
+                    chip8->I = group->I[l];
+                    if(quirks & QUIRK_WRAP) draw_sprite_wrapped(chip8, config, X, Y, N);
+                    else draw_sprite(chip8, config, X, Y, N);
+                    V[0xF][l] = chip8->V[0xF];
+                }
+                continue;
+            case 0xF:
+                switch(NN){
+                    case 0x07: V[X] = group->delay_timer; continue;
+                    case 0x15: group->delay_timer = V[X]; continue;
+                    case 0x18: group->sound_timer = V[X]; continue;
+                    case 0x1E: group->I += __builtin_convertvector(V[X], lane16_t); continue;
+                    case 0x29: group->I = __builtin_convertvector(V[X] & 0x0F, lane16_t) * 5; continue;
+                    case 0x33:
+                        for(uint32_t l = 0; l < LOCKSTEP_LANES; l++){
+                            chip8_t *chip8 = group->lanes[l];
+                            const uint16_t I = group->I[l];
+                            uint8_t value = V[X][l];
+                            chip8->ram[(I+2) & 0xFFF] = value % 10;
+                            value /= 10;
+                            chip8->ram[(I+1) & 0xFFF] = value % 10;
+                            value /= 10;
+                            chip8->ram[I & 0xFFF] = value;
+                            invalidate_code(chip8, I, 3);
+                            lockstep_written(group, I, 3);
+                        }
+                        continue;
+                    case 0x55:
+                        for(uint32_t l = 0; l < LOCKSTEP_LANES; l++){
+                            chip8_t *chip8 = group->lanes[l];
+                            const uint16_t I = group->I[l];
+                            for(uint8_t i = 0; i <= X; i++) chip8->ram[(I + i) & 0xFFF] = V[i][l];
+                            invalidate_code(chip8, I, X + 1);
+                            lockstep_written(group, I, X + 1);
+                        }
+                        if(quirks & QUIRK_MEMORY_I) group->I += (uint16_t)(X + 1);
+                        continue;
+                    case 0x65:
+                        for(uint32_t l = 0; l < LOCKSTEP_LANES; l++){
+                            const chip8_t *chip8 = group->lanes[l];
+                            const uint16_t I = group->I[l];
+                            for(uint8_t i = 0; i <= X; i++) V[i][l] = chip8->ram[(I + i) & 0xFFF];
+                        }
+                        if(quirks & QUIRK_MEMORY_I) group->I += (uint16_t)(X + 1);
+                        continue;
+                    default:
+                        slow = true;
+                        break;
+                }
+                break;
+            default:
+                // BNNN jumps per lane, EX9E/EXA1 read per lane keypads
+                slow = true;
+                break;
+        }
+
+        if(slow){
+            group->PC = PC;
+            lockstep_scatter(group);
+            for(uint32_t l = 0; l < LOCKSTEP_LANES; l++) emulate_chip8(group->lanes[l], config);
+            if(!lockstep_gather(group)) return count;
+            continue;
+        }
+        // conditional skip, the group splits up unless every lane agrees
+        if(lanes_all(&skip)) group->PC += 2;
+        else if(lanes_any(&skip)){
+            lockstep_scatter(group);
+            for(uint32_t l = 0; l < LOCKSTEP_LANES; l++)
+                if(skip[l]) group->lanes[l]->PC += 2;
+            return count;
+        }
+    }
+    return 0;
+}
+
+uint64_t run_lockstep(lockstep_t *group, const config_t config, uint64_t count){
+    switch(group->lanes[0]->quirks){
+        case QUIRKS_VIP: return lockstep_quirks(group, config, count, QUIRKS_VIP);
+        case QUIRKS_SCHIP: return lockstep_quirks(group, config, count, QUIRKS_SCHIP);
+        case QUIRKS_XOCHIP: return lockstep_quirks(group, config, count, QUIRKS_XOCHIP);
+        default: return lockstep_quirks(group, config, count, QUIRKS_CHIP8);
+    }
+}
+
+// run_headless_frames for a lockstep group, lanes that split up run scalar until they meet
+// again at a frame boundary
+void run_lockstep_frames(lockstep_t *group, const config_t config, uint64_t *instructions_out, uint64_t *frames_out){
+    uint64_t carry = 0;
+    uint64_t instructions = 0;
+    uint64_t frames = 0;
+
+    lockstep_gather(group);
+    for(;;){
+        uint64_t count = frame_cycles(&carry, config.clock_speed, 60);
+        if(config.max_instructions && config.max_instructions - instructions < count)
+            count = config.max_instructions - instructions;
+        const uint64_t left = group->locked ? run_lockstep(group, config, count) : count;
+        for(uint32_t l = 0; l < LOCKSTEP_LANES; l++){
+            chip8_t *chip8 = group->lanes[l];
+            if(!group->locked){
+                run_chip8(chip8, config, left);
+                update_timers(chip8);
+            }
+            chip8->draw = false;    // nothing to present, drop the damage
+        }
+        if(group->locked){
+            group->delay_timer -= (lane8_t)(group->delay_timer != 0) & 1;
+            group->sound_timer -= (lane8_t)(group->sound_timer != 0) & 1;
+        }
+        instructions += count;
+        frames++;
+
+        if(config.max_instructions && instructions >= config.max_instructions) break;
+        if(config.max_frames && frames >= config.max_frames) break;
+        if(!group->locked) lockstep_gather(group);
+    }
+    if(group->locked) lockstep_scatter(group);
+    *instructions_out = instructions;
+    *frames_out = frames;
+}
+
+// Run n <= LOCKSTEP_LANES consecutive instances as one group, spare lanes repeat the first
+void run_lockstep_group(batch_t *batch, lockstep_t *group, int first, int n){
+    for(int l = 0; l < LOCKSTEP_LANES; l++){
+        reset_instance(group->lanes[l], batch->rom);
+        seed_random(group->lanes[l], batch->config.seed + first + (l < n ? l : 0));
+    }
+    memset(group->written, 0, sizeof group->written);
+    uint64_t instructions, frames;
+    run_lockstep_frames(group, batch->config, &instructions, &frames);
+    for(int l = 0; l < n; l++){
+        batch_result_t *result = &batch->results[first + l];
+        result->instructions = instructions;
+        result->frames = frames;
+        record_result(result, group->lanes[l]);
+    }
+}
+
+// Run every instance in a range until it is drained, by its owner or a thief
+// group is NULL unless the batch runs in lockstep, then instances are claimed a group at a time
+void run_batch_range(batch_t *batch, batch_range_t *range, chip8_t *chip8, lockstep_t *group){
+    const int step = group ? LOCKSTEP_LANES : 1;
+    int i;
+    while((i = SDL_AtomicAdd(&range->next, step)) < range->end){
+        if(group){
+            run_lockstep_group(batch, group, i, range->end - i < step ? range->end - i : step);
+            continue;
+        }
+        batch_result_t *result = &batch->results[i];
+        reset_instance(chip8, batch->rom);
+        seed_random(chip8, batch->config.seed + i);
+        run_headless_frames(chip8, batch->config, &result->instructions, &result->frames);
+        record_result(result, chip8);
+    }
+}
+
+// Batch worker, drains its own range then steals from the others
+int batch_worker(void *data){
+    const batch_worker_t *worker = data;
+    batch_t *batch = worker->batch;
+    const uint32_t machines = batch->config.lockstep ? LOCKSTEP_LANES : 1;
+    machine_pool_t pool;
+    if(!init_pool(&pool, batch->rom, machines)) return 1;   // the other workers steal this range
+    chip8_t *chip8 = acquire_machine(&pool);
+    lockstep_t *group = NULL;
+    if(batch->config.lockstep){
+        // vector members need their natural alignment, more than malloc promises
+        group = aligned_alloc(_Alignof(lockstep_t), sizeof *group);
+        if(group){
+            memset(group, 0, sizeof *group);
+            group->lanes[0] = chip8;
+            for(uint32_t l = 1; l < LOCKSTEP_LANES; l++)
+                if(!(group->lanes[l] = acquire_machine(&pool))) chip8 = NULL;
+        }
+    }
+    if(!chip8 || (batch->config.lockstep && !group)){
+        SDL_Log("Could not allocate batch worker %u\n", worker->id);
+        free_pool(&pool);
+        free(group);
+        return 1;
+    }
+    for(uint32_t v = 0; v < batch->workers; v++)
+        run_batch_range(batch, &batch->ranges[(worker->id + v) % batch->workers], chip8, group);
+
+    free_pool(&pool);
+    free(group);
+    return 0;
+}
+
+// Run config.batch_size instances of the loaded ROM across a thread pool
+// Prints one CSV row per instance on stdout and the totals on stderr
+// library: called per ROM of a --library run, rows start with the ROM name instead of
+// getting a header of their own and the summary is left to run_library
+bool run_batch(const chip8_t *rom, const config_t config, bool library){
+    const uint32_t count = config.batch_size;
+    uint32_t workers = config.threads ? config.threads : (uint32_t)SDL_GetCPUCount();
+    if(workers > count) workers = count;
+    if(workers < 1) workers = 1;
+
+    batch_t batch = {.rom = rom, .config = config, .workers = workers};
+    batch_worker_t *args = calloc(workers, sizeof *args);
+    SDL_Thread **threads = calloc(workers, sizeof *threads);
+    batch.ranges = calloc(workers, sizeof *batch.ranges);
+    batch.results = calloc(count, sizeof *batch.results);
+    if(!args || !threads || !batch.ranges || !batch.results){
+        SDL_Log("Could not allocate a batch of %u instances\n", count);
+        free(args);
+        free(threads);
+        free(batch.ranges);
+        free(batch.results);
+        return false;
+    }
+    // contiguous equal shares, the first count % workers ranges get one extra
+    for(uint32_t w = 0, start = 0; w < workers; w++){
+        const uint32_t size = count / workers + (w < count % workers);
+        SDL_AtomicSet(&batch.ranges[w].next, start);
+        batch.ranges[w].end = start + size;
+        start += size;
+        args[w] = (batch_worker_t){.batch = &batch, .id = w};
+    }
+
+    const uint64_t before = SDL_GetPerformanceCounter();
+    // the calling thread is worker 0, a worker that fails to start is covered by stealing
+    for(uint32_t w = 1; w < workers; w++){
+        threads[w] = SDL_CreateThread(batch_worker, "chip8 batch", &args[w]);
+        if(!threads[w]) SDL_Log("Could not start batch worker %u %s\n", w, SDL_GetError());
+    }
+    batch_worker(&args[0]);
+    for(uint32_t w = 1; w < workers; w++)
+        if(threads[w]) SDL_WaitThread(threads[w], NULL);
+    const uint64_t after = SDL_GetPerformanceCounter();
+
+    uint64_t instructions = 0;
+    if(!library) printf("instance,seed,instructions,frames,display_hash,PC,I,V\n");
+    for(uint32_t i = 0; i < count; i++){
+        const batch_result_t *result = &batch.results[i];
+        if(library) printf("%s,", rom->rom_name);
+        printf("%u,%u,%llu,%llu,%016llx,%03X,%03X,", i, config.seed + i,
+               (unsigned long long)result->instructions, (unsigned long long)result->frames,
+               (unsigned long long)result->hash, result->PC, result->I);
+        for(uint32_t r = 0; r < 16; r++) printf("%02X", result->V[r]);
+        printf("\n");
+        instructions += result->instructions;
+    }
+
+    const double seconds = (double)(after - before) / SDL_GetPerformanceFrequency();
+    if(!library){
+        fprintf(stderr, "ROM:             %s\n", rom->rom_name);
+        fprintf(stderr, "Seed:            %u\n", config.seed);
+        fprintf(stderr, "Instances:       %u\n", count);
+        fprintf(stderr, "Threads:         %u\n", workers);
+        fprintf(stderr, "Instructions:    %llu\n", (unsigned long long)instructions);
+        fprintf(stderr, "Wall time:       %.6f s\n", seconds);
+        fprintf(stderr, "MIPS:            %.3f\n", instructions / seconds / 1e6);
+        fprintf(stderr, "Instances/sec:   %.1f\n", count / seconds);
+    }
+
+    free(args);
+    free(threads);
+    free(batch.ranges);
+    free(batch.results);
+    return true;
+}
+
+// Differential fuzzing (--fuzz N): every case is a program, a quirk profile and a keypad
+// log derived from its seed, run on LOCKSTEP_LANES machines (CXNN seeds seed + lane) by each
+// core. After every frame each core's machines are compared with the interpreter's, a case
+// whose cores disagree is shrunk to the fewest instructions that still show it
+typedef enum{
+    FUZZ_INTERPRETER,   // the reference the others are compared with
+    FUZZ_PREDECODED,
+    FUZZ_JIT,
+    FUZZ_LOCKSTEP,
+    FUZZ_CORES,
+} fuzz_core_t;
+
+static const char *const fuzz_core_names[FUZZ_CORES] = {"interpreter", "predecoded", "jit", "lockstep"};
+
+#define FUZZ_PROGRAM (4096 - 0x200)     // program bytes from the entry point
+
+// One generated test case
+typedef struct{
+    uint32_t seed;              // what the case was generated from, lane l seeds CXNN with seed + l
+    uint8_t quirks;             // quirks_t profile
+    uint16_t size;              // program bytes in use
+    uint8_t program[FUZZ_PROGRAM];
+    uint16_t *keys;             // keypad during each frame
+} fuzz_case_t;
+
+// Where a case first diverged
+typedef struct{
+    int core;                   // fuzz_core_t that disagreed with the interpreter, -1 = none
+    uint32_t lane;
+    uint32_t frame;             // frame after which the difference showed
+    const char *what;           // state that differed
+} fuzz_result_t;
+
+// Shared by the fuzz workers
+typedef struct{
+    config_t config;
+    const uint8_t *rom;         // ROM the cases mutate, NULL = random programs
+    uint16_t rom_size;
+    SDL_atomic_t next;          // next case to claim
+    SDL_atomic_t failed;        // cases that diverged
+} fuzz_t;
+
+// A worker's machines, LOCKSTEP_LANES per core
+typedef struct{
+    fuzz_t *fuzz;
+    uint32_t id;
+    uint64_t instructions;      // instructions run by all cores together
+    config_t configs[FUZZ_CORES];
+    chip8_t *machines[FUZZ_CORES];
+    lockstep_t *group;          // over machines[FUZZ_LOCKSTEP]
+    chip8_t rom;                // the case's program freshly loaded
+    fuzz_case_t test;
+    fuzz_case_t shrunk;
+} fuzz_worker_t;
+
+uint32_t fuzz_random(uint32_t *rng){
+    uint32_t x = *rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *rng = x;
+}
+
+// A random instruction, weighted towards the opcodes the cores implement differently
+// Jumps and calls land on even addresses inside the program, I anywhere in the 64 KB
+// it can reach so memory accesses wrap too
+uint16_t fuzz_opcode(uint32_t *rng, uint16_t size){
+    static const uint8_t alu[] = {0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE};
+    static const uint8_t misc[] = {0x01, 0x07, 0x0A, 0x15, 0x18, 0x1E, 0x29, 0x33, 0x55, 0x65};
+    static const uint16_t extended[] = {0x00C0, 0x00D0, 0x00FB, 0x00FC, 0x00FE, 0x00FF};
+    const uint32_t r = fuzz_random(rng);
+    const uint16_t XY = (r >> 8) & 0x0FF0, NN = r >> 24;
+    const uint16_t target = 0x200 + 2 * ((r >> 8) % (size / 2));
+    switch(r % 32){
+        case 0: return 0x00E0;
+        case 1: case 2: return 0x00EE;
+        case 3: return extended[(r >> 8) % sizeof extended / sizeof *extended] | (NN & 0x0F);
+        case 4: case 5: return 0x1000 | target;
+        case 6: case 7: return 0x2000 | target;
+        case 8: return 0x3000 | (XY & 0x0F00) | NN;
+        case 9: return 0x4000 | (XY & 0x0F00) | NN;
+        case 10: return 0x5000 | XY;
+        case 11: case 12: return 0x6000 | (XY & 0x0F00) | NN;
+        case 13: case 14: return 0x7000 | (XY & 0x0F00) | NN;
+        case 15: case 16: case 17: case 18: return 0x8000 | XY | alu[NN % sizeof alu];
+        case 19: return 0x9000 | XY;
+        case 20: return 0xA000 | (NN & 1 ? target : r >> 20);
+        case 21: return 0xB000 | ((target - (NN & 0x3F)) & 0x0FFF);
+        case 22: return 0xC000 | (XY & 0x0F00) | NN;
+        case 23: case 24: return 0xD000 | XY | (NN & 0x0F);
+        case 25: return 0xE000 | (XY & 0x0F00) | (NN & 1 ? 0x9E : 0xA1);
+        case 26: case 27: case 28: return 0xF000 | (XY & 0x0F00) | misc[NN % sizeof misc];
+        default: return r >> 16;    // anything at all
+    }
+}
+
+// Derive a case from its seed: a ROM with a few instructions replaced, or a random program
+void fuzz_generate(const fuzz_t *fuzz, uint32_t seed, fuzz_case_t *test){
+    static const uint8_t profiles[] = {QUIRKS_CHIP8, QUIRKS_VIP, QUIRKS_SCHIP, QUIRKS_XOCHIP};
+    uint32_t rng = seed * 2654435761u ^ 0x5EED5EED;
+    if(!rng) rng = 1;   // xorshift never leaves 0
+    test->seed = seed;
+    test->quirks = profiles[fuzz_random(&rng) % sizeof profiles];
+    memset(test->program, 0, sizeof test->program);
+    if(fuzz->rom){
+        test->size = fuzz->rom_size;
+        memcpy(test->program, fuzz->rom, fuzz->rom_size);
+        for(uint32_t n = 1 + fuzz_random(&rng) % 8; n; n--){
+            const uint16_t at = 2 * (fuzz_random(&rng) % (test->size / 2)), op = fuzz_opcode(&rng, test->size);
+            test->program[at] = op >> 8;
+            test->program[at + 1] = op;
+        }
+    }
+    else{
+        test->size = 2 * (32 + fuzz_random(&rng) % 224);
+        for(uint16_t at = 0; at < test->size; at += 2){
+            const uint16_t op = fuzz_opcode(&rng, test->size);
+            test->program[at] = op >> 8;
+            test->program[at + 1] = op;
+        }
+    }
+    // mostly nothing held, now and then one key, rarely two
+    uint16_t keys = 0;
+    for(uint64_t f = 0; f < fuzz->config.max_frames; f++){
+        const uint32_t r = fuzz_random(&rng);
+        if(r % 8 == 0) keys = (r >> 8) % 3 == 0 ? 0 : 1 << ((r >> 12) & 0xF) | ((r >> 16) % 4 == 0) << ((r >> 20) & 0xF);
+        test->keys[f] = keys;
+    }
+}
+
+// First state two machines disagree on, NULL if they match
+const char *fuzz_compare(const chip8_t *a, const chip8_t *b){
+    const uint8_t sp = a->sp;
+    if(a->PC != b->PC) return "PC";
+    if(a->I != b->I) return "I";
+    if(memcmp(a->V, b->V, sizeof a->V)) return "V";
+    if(sp != b->sp || memcmp(a->stack, b->stack, sp * sizeof *a->stack)) return "stack";
+    if(a->delay_timer != b->delay_timer || a->sound_timer != b->sound_timer) return "timers";
+    if(a->rng != b->rng) return "random generator";
+    if(a->hires != b->hires || a->planes != b->planes) return "display mode";
+    if(memcmp(a->ram, b->ram, sizeof a->ram)) return "RAM";
+    if(memcmp(a->display, b->display, sizeof a->display)) return "display";
+    return NULL;
+}
+
+// Run one frame of count instructions on a core's machines with the keypad held
+void fuzz_frame(fuzz_worker_t *worker, int core, uint16_t keys, uint64_t count){
+    chip8_t *machines = worker->machines[core];
+    for(uint32_t l = 0; l < LOCKSTEP_LANES; l++) machines[l].keypad = keys;
+    if(core == FUZZ_LOCKSTEP){
+        // as run_lockstep_frames, scattered at the end of every frame to compare the lanes
+        lockstep_t *group = worker->group;
+        lockstep_gather(group);
+        const uint64_t left = group->locked ? run_lockstep(group, worker->configs[core], count) : count;
+        if(group->locked){
+            group->delay_timer -= (lane8_t)(group->delay_timer != 0) & 1;
+            group->sound_timer -= (lane8_t)(group->sound_timer != 0) & 1;
+            lockstep_scatter(group);
+        }
+        else{
+            for(uint32_t l = 0; l < LOCKSTEP_LANES; l++){
+                run_chip8(&machines[l], worker->configs[core], left);
+                update_timers(&machines[l]);
+            }
+        }
+    }
+    else{
+        for(uint32_t l = 0; l < LOCKSTEP_LANES; l++){
+            run_chip8(&machines[l], worker->configs[core], count);
+            update_timers(&machines[l]);
+        }
+    }
+    for(uint32_t l = 0; l < LOCKSTEP_LANES; l++) machines[l].draw = false;
+}
+
+// Run a case for up to frames frames on the interpreter and the cores in the cores mask
+fuzz_result_t fuzz_run(fuzz_worker_t *worker, const fuzz_case_t *test, uint32_t cores, uint64_t frames){
+    memset(&worker->rom, 0, sizeof worker->rom);
+    load_chip8(&worker->rom, "fuzz", test->program, test->size);
+    worker->rom.quirks = test->quirks;
+    cores |= 1 << FUZZ_INTERPRETER;
+    for(int c = 0; c < FUZZ_CORES; c++){
+        if(!(cores & 1 << c)) continue;
+        for(uint32_t l = 0; l < LOCKSTEP_LANES; l++){
+            reset_instance(&worker->machines[c][l], &worker->rom);
+            seed_random(&worker->machines[c][l], test->seed + l);
+        }
+    }
+    memset(worker->group->written, 0, sizeof worker->group->written);
+
+    uint64_t carry = 0;
+    for(uint64_t f = 0; f < frames; f++){
+        const uint64_t count = frame_cycles(&carry, worker->fuzz->config.clock_speed, 60);
+        for(int c = 0; c < FUZZ_CORES; c++){
+            if(!(cores & 1 << c)) continue;
+            fuzz_frame(worker, c, test->keys[f], count);
+            worker->instructions += count * LOCKSTEP_LANES;
+        }
+        for(int c = 1; c < FUZZ_CORES; c++){
+            if(!(cores & 1 << c)) continue;
+            for(uint32_t l = 0; l < LOCKSTEP_LANES; l++){
+                const char *what = fuzz_compare(&worker->machines[FUZZ_INTERPRETER][l], &worker->machines[c][l]);
+                if(what) return (fuzz_result_t){.core = c, .lane = l, .frame = f, .what = what};
+            }
+        }
+    }
+    return (fuzz_result_t){.core = -1};
+}
+
+// Shrink a diverging case: clear instructions and key presses one at a time, keeping every
+// change after which the same core still diverges, until a whole pass changes nothing
+fuzz_result_t fuzz_shrink(fuzz_worker_t *worker, fuzz_result_t result){
+    fuzz_case_t *test = &worker->shrunk;
+    uint16_t *keys = test->keys;
+    *test = worker->test;
+    test->keys = keys;
+    memcpy(keys, worker->test.keys, worker->fuzz->config.max_frames * sizeof *keys);
+    const uint32_t core = 1 << result.core;
+    for(bool changed = true; changed;){
+        changed = false;
+        for(uint16_t at = 0; at < test->size; at += 2){
+            const uint8_t hi = test->program[at], lo = test->program[at + 1];
+            if(!hi && !lo) continue;
+            test->program[at] = test->program[at + 1] = 0;     // 0000 does nothing
+            const fuzz_result_t again = fuzz_run(worker, test, core, result.frame + 1);
+            if(again.core >= 0){
+                result = again;
+                changed = true;
+            }
+            else{
+                test->program[at] = hi;
+                test->program[at + 1] = lo;
+            }
+        }
+        for(uint32_t f = 0; f <= result.frame; f++){
+            if(!keys[f]) continue;
+            const uint16_t held = keys[f];
+            keys[f] = 0;
+            const fuzz_result_t again = fuzz_run(worker, test, core, result.frame + 1);
+            if(again.core >= 0){
+                result = again;
+                changed = true;
+            }
+            else keys[f] = held;
+        }
+    }
+    while(test->size && !test->program[test->size - 2] && !test->program[test->size - 1]) test->size -= 2;
+    return result;
+}
+
+// Report a divergence: what differed, the shrunk program as fuzz-SEED.ch8 and its key presses
+void fuzz_report(fuzz_worker_t *worker, const fuzz_result_t found, const fuzz_result_t shrunk){
+    static const char *const profiles[] = {[QUIRKS_CHIP8] = "chip8", [QUIRKS_VIP] = "vip",
+                                           [QUIRKS_SCHIP] = "schip", [QUIRKS_XOCHIP] = "xochip"};
+    const fuzz_case_t *test = &worker->shrunk;
+    char name[32], line[160], report[4096];
+    snprintf(name, sizeof name, "fuzz-%u.ch8", test->seed);
+    FILE *file = fopen(name, "wb");
+    const bool written = file && fwrite(test->program, 1, test->size, file) == test->size;
+    if(file) fclose(file);
+
+    uint32_t instructions = 0;
+    for(uint16_t at = 0; at < test->size; at += 2) instructions += test->program[at] || test->program[at + 1];
+    int length = snprintf(report, sizeof report,
+        "Case %u (--quirks %s): %s lane %u differs from the interpreter in %s after frame %u\n"
+        "  shrunk to %u instructions in %u bytes, %s lane %u %s after frame %u, %s %s\n  keys:",
+        test->seed, profiles[test->quirks], fuzz_core_names[found.core], found.lane, found.what, found.frame,
+        instructions, test->size, fuzz_core_names[shrunk.core], shrunk.lane, shrunk.what, shrunk.frame,
+        written ? "written to" : "could not write", name);
+    // frame:mask whenever the keypad changed
+    uint16_t held = 0;
+    bool pressed = false;
+    for(uint32_t f = 0; f <= shrunk.frame; f++){
+        if(test->keys[f] == held) continue;
+        held = test->keys[f];
+        pressed = true;
+        snprintf(line, sizeof line, " %u:%04X", f, held);
+        if(length + strlen(line) + 8 < sizeof report) length += sprintf(report + length, "%s", line);
+    }
+    if(!pressed) sprintf(report + length, " none");
+    fprintf(stderr, "%s\n", report);   // one write, reports from workers do not interleave
+}
+
+// Fuzz worker, claims cases until they run out
+int fuzz_worker(void *data){
+    fuzz_worker_t *worker = data;
+    fuzz_t *fuzz = worker->fuzz;
+    const uint64_t frames = fuzz->config.max_frames;
+    int c;
+    for(c = 0; c < FUZZ_CORES; c++){
+        worker->configs[c] = fuzz->config;
+        worker->machines[c] = alloc_machines(LOCKSTEP_LANES);
+        if(!worker->machines[c]) break;
+    }
+    worker->configs[FUZZ_INTERPRETER].cpu_mode = CPU_INTERPRETER;
+    worker->configs[FUZZ_PREDECODED].cpu_mode = CPU_PREDECODED;
+    worker->configs[FUZZ_JIT].cpu_mode = CPU_JIT;
+    worker->configs[FUZZ_LOCKSTEP].cpu_mode = CPU_INTERPRETER;     // for lanes that split up
+    worker->group = aligned_alloc(_Alignof(lockstep_t), sizeof *worker->group);
+    worker->test.keys = calloc(frames, sizeof *worker->test.keys);
+    worker->shrunk.keys = calloc(frames, sizeof *worker->shrunk.keys);
+    if(c < FUZZ_CORES || !worker->group || !worker->test.keys || !worker->shrunk.keys){
+        SDL_Log("Could not allocate fuzz worker %u\n", worker->id);
+    }
+    else{
+        memset(worker->group, 0, sizeof *worker->group);
+        for(uint32_t l = 0; l < LOCKSTEP_LANES; l++) worker->group->lanes[l] = &worker->machines[FUZZ_LOCKSTEP][l];
+        uint32_t cores = 1 << FUZZ_PREDECODED | 1 << FUZZ_LOCKSTEP;
+#ifdef HAVE_JIT
+        cores |= 1 << FUZZ_JIT;
+#endif
+        int i;
+        while((i = SDL_AtomicAdd(&fuzz->next, 1)) < (int)fuzz->config.fuzz){
+            fuzz_generate(fuzz, fuzz->config.seed + i, &worker->test);
+            const fuzz_result_t found = fuzz_run(worker, &worker->test, cores, frames);
+            if(found.core < 0) continue;
+            SDL_AtomicAdd(&fuzz->failed, 1);
+            fuzz_report(worker, found, fuzz_shrink(worker, found));
+        }
+    }
+    for(c = 0; c < FUZZ_CORES; c++){
+        for(uint32_t l = 0; worker->machines[c] && l < LOCKSTEP_LANES; l++) free_caches(&worker->machines[c][l]);
+        free(worker->machines[c]);
+    }
+    free(worker->group);
+    free(worker->test.keys);
+    free(worker->shrunk.keys);
+    return 0;
+}
+
+// Run config.fuzz cases across a thread pool, mutating the ROM at rom_name or, for -,
+// generating random programs. False if any case diverged
+bool run_fuzz(const char *rom_name, const config_t config){
+    static chip8_t loaded;
+    fuzz_t fuzz = {.config = config};
+    if(strcmp(rom_name, "-") != 0){
+        if(!init_chip8(&loaded, rom_name)) return false;
+        // the image up to its last nonzero byte, rounded up to whole instructions
+        uint16_t size = FUZZ_PROGRAM;
+        while(size && !loaded.ram[0x200 + size - 1]) size--;
+        fuzz.rom_size = (size + 1) & ~1;
+        fuzz.rom = &loaded.ram[0x200];
+        if(fuzz.rom_size < 2){
+            SDL_Log("ROM file %s is empty\n", rom_name);
+            return false;
+        }
+    }
+    uint32_t workers = config.threads ? config.threads : (uint32_t)SDL_GetCPUCount();
+    if(workers > config.fuzz) workers = config.fuzz;
+    if(workers < 1) workers = 1;
+    // each worker holds a machine, so it is cache line aligned too
+    fuzz_worker_t *args = aligned_alloc(_Alignof(fuzz_worker_t), workers * sizeof *args);
+    SDL_Thread **threads = calloc(workers, sizeof *threads);
+    if(!args || !threads){
+        SDL_Log("Could not allocate %u fuzz workers\n", workers);
+        free(args);
+        free(threads);
+        return false;
+    }
+
+    const uint64_t before = SDL_GetPerformanceCounter();
+    for(uint32_t w = 0; w < workers; w++) args[w] = (fuzz_worker_t){.fuzz = &fuzz, .id = w};
+    for(uint32_t w = 1; w < workers; w++){
+        threads[w] = SDL_CreateThread(fuzz_worker, "chip8 fuzz", &args[w]);
+        if(!threads[w]) SDL_Log("Could not start fuzz worker %u %s\n", w, SDL_GetError());
+    }
+    fuzz_worker(&args[0]);
+    uint64_t instructions = args[0].instructions;
+    for(uint32_t w = 1; w < workers; w++){
+        if(threads[w]) SDL_WaitThread(threads[w], NULL);
+        instructions += args[w].instructions;
+    }
+    const uint64_t after = SDL_GetPerformanceCounter();
+
+    const double seconds = (double)(after - before) / SDL_GetPerformanceFrequency();
+    const int failed = SDL_AtomicGet(&fuzz.failed);
+    const int run = SDL_AtomicGet(&fuzz.next) < (int)config.fuzz ? SDL_AtomicGet(&fuzz.next) : (int)config.fuzz;
+    fprintf(stderr, "Cases:           %d (seeds %u to %u)\n", run, config.seed, config.seed + config.fuzz - 1);
+    fprintf(stderr, "Diverged:        %d\n", failed);
+    fprintf(stderr, "Instructions:    %llu\n", (unsigned long long)instructions);
+    fprintf(stderr, "Wall time:       %.3f s\n", seconds);
+    fprintf(stderr, "MIPS:            %.3f (%.3f per worker)\n", instructions / seconds / 1e6,
+            instructions / seconds / 1e6 / workers);
+    free(args);
+    free(threads);
+    return failed == 0 && run == (int)config.fuzz;
+}
+
+#ifdef HAVE_LIBRARY
+// What a sweep over a ROM's opcodes found, kept in the library index
+typedef enum{
+    ROM_RANDOM = 1 << 0,    // CXNN, batch instances differ by seed
+    ROM_KEYS = 1 << 1,      // EX9E, EXA1 or FX0A, needs input to get anywhere
+    ROM_SOUND = 1 << 2,     // FX18
+    ROM_SCHIP = 1 << 3,     // SUPER-CHIP opcodes: 00CN, 00FB-00FF, FX30, FX75, FX85
+    ROM_XO = 1 << 4,        // XO-CHIP opcodes: 5XY2, 5XY3, F000, FN01, F002, FX3A
+    ROM_COMPUTED = 1 << 5,  // static analysis reached BNNN, see analyze_code
+    ROM_SELF_MODIFYING = 1 << 6,    // static analysis found writes that can land on code
+} rom_flag_t;
+
+// One ROM of a library directory
+typedef struct{
+    char *name;             // file name inside the directory
+    uint64_t hash;          // FNV-1a of the contents
+    uint32_t size;
+    int64_t mtime;          // modification time in ns when hashed, any of these changing means rehash
+    int64_t ctime;          // status change time in ns, catches rewrites that kept the mtime
+    uint64_t inode;         // catches a file renamed over this one
+    uint32_t flags;         // rom_flag_t bits
+    uint64_t code_pages;    // static analysis under the guessed profile: pages holding code
+    uint64_t written_pages; // and pages FX33/FX55 can write
+    char profile[16];       // quirk profile to run it with, guessed from flags, editable in the index
+    bool seen;              // found by this scan
+} library_entry_t;
+
+typedef struct{
+    library_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} library_t;
+
+#define LIBRARY_INDEX ".chip8-index"
+#define LIBRARY_VERSION 3
+
+// Linear sweep over the even addresses, data that happens to look like an opcode counts too
+uint32_t analyze_rom(const uint8_t *rom, size_t size){
+    uint32_t flags = 0;
+    for(size_t i = 0; i + 1 < size; i += 2){
+        const uint16_t opcode = rom[i] << 8 | rom[i + 1];
+        const uint8_t NN = opcode & 0xFF;
+        switch(opcode >> 12){
+            case 0x0:
+                if((opcode & 0xFFF0) == 0x00C0 || (opcode >= 0x00FB && opcode <= 0x00FF)) flags |= ROM_SCHIP;
+                break;
+            case 0x5:
+                if((opcode & 0xF) == 0x2 || (opcode & 0xF) == 0x3) flags |= ROM_XO;
+                break;
+            case 0xC:
+                flags |= ROM_RANDOM;
+                break;
+            case 0xE:
+                if(NN == 0x9E || NN == 0xA1) flags |= ROM_KEYS;
+                break;
+            case 0xF:
+                if(NN == 0x0A) flags |= ROM_KEYS;
+                else if(NN == 0x18) flags |= ROM_SOUND;
+                else if(NN == 0x30 || NN == 0x75 || NN == 0x85) flags |= ROM_SCHIP;
+                else if(opcode == 0xF000 || NN == 0x01 || opcode == 0xF002 || NN == 0x3A) flags |= ROM_XO;
+                break;
+        }
+    }
+    return flags;
+}
+
+// Quirk profile a ROM most likely wants, going by its flags
+const char *guess_profile(uint32_t flags){
+    return flags & ROM_XO ? "xochip" : flags & ROM_SCHIP ? "schip" : "chip8";
+}
+
+// Statically analyze a ROM under its guessed profile and keep the pages in its entry
+void analyze_entry(library_entry_t *entry, const uint8_t *rom, size_t size){
+    static chip8_t chip8;
+    static analysis_t analysis;
+    memset(&chip8, 0, sizeof chip8);
+    quirks_t quirks = QUIRKS_CHIP8;
+    find_quirks(entry->profile, &quirks);
+    if(!load_chip8(&chip8, entry->name, rom, size)) return;
+    chip8.quirks = quirks;
+    analyze_code(&chip8, &analysis);
+    entry->code_pages = analysis.code_pages;
+    entry->written_pages = analysis.written_pages;
+    if(analysis.computed_jump) entry->flags |= ROM_COMPUTED;
+    if(analysis.self_modifying) entry->flags |= ROM_SELF_MODIFYING;
+}
+
+int compare_library_entries(const void *a, const void *b){
+    return strcmp(((const library_entry_t *)a)->name, ((const library_entry_t *)b)->name);
+}
+
+library_entry_t *add_library_entry(library_t *library, const char *name){
+    if(library->count == library->capacity){
+        const size_t capacity = library->capacity ? library->capacity * 2 : 256;
+        library_entry_t *entries = realloc(library->entries, capacity * sizeof *entries);
+        if(!entries) return NULL;
+        library->entries = entries;
+        library->capacity = capacity;
+    }
+    library_entry_t *entry = &library->entries[library->count];
+    *entry = (library_entry_t){.name = strdup(name)};
+    if(!entry->name) return NULL;
+    library->count++;
+    return entry;
+}
+
+void free_library(library_t *library){
+    for(size_t i = 0; i < library->count; i++) free(library->entries[i].name);
+    free(library->entries);
+}
+
+// Read DIR/.chip8-index into library, sorted by name. A missing or outdated index is empty
+bool load_library_index(library_t *library, const char *dir){
+    char path[4096], line[4096 + 64];
+    snprintf(path, sizeof path, "%s/%s", dir, LIBRARY_INDEX);
+    FILE *file = fopen(path, "r");
+    if(!file) return true;
+    unsigned version = 0;
+    if(!fgets(line, sizeof line, file) || sscanf(line, "# chip8 library index %u", &version) != 1 ||
+       version != LIBRARY_VERSION){
+        fclose(file);
+        return true;
+    }
+    while(fgets(line, sizeof line, file)){
+        if(line[0] == '#') continue;
+        unsigned long long hash, code_pages, written_pages;
+        unsigned size, flags;
+        long long mtime, ctime;
+        unsigned long long inode;
+        char profile[16];
+        int name_at = 0;
+        if(sscanf(line, "%16llx %u %lld %lld %llu %x %16llx %16llx %15s %n", &hash, &size, &mtime, &ctime,
+                  &inode, &flags, &code_pages, &written_pages, profile, &name_at) != 9 || !name_at) continue;
+        line[strcspn(line, "\n")] = '\0';
+        library_entry_t *entry = add_library_entry(library, line + name_at);
+        if(!entry){
+            fclose(file);
+            return false;
+        }
+        entry->hash = hash;
+        entry->size = size;
+        entry->mtime = mtime;
+        entry->ctime = ctime;
+        entry->inode = inode;
+        entry->flags = flags;
+        entry->code_pages = code_pages;
+        entry->written_pages = written_pages;
+        memcpy(entry->profile, profile, sizeof profile);
+    }
+    fclose(file);
+    qsort(library->entries, library->count, sizeof *library->entries, compare_library_entries);
+    return true;
+}
+
+// Written to a temporary file and renamed over the index, a killed scan leaves the old one
+bool save_library_index(const library_t *library, const char *dir){
+    char path[4096], temp[4096 + 8];
+    snprintf(path, sizeof path, "%s/%s", dir, LIBRARY_INDEX);
+    snprintf(temp, sizeof temp, "%s.tmp", path);
+    FILE *file = fopen(temp, "w");
+    if(!file){
+        SDL_Log("Could not write the library index %s\n", temp);
+        return false;
+    }
+    fprintf(file, "# chip8 library index %u\n# hash size mtime ctime inode flags code written profile name\n", LIBRARY_VERSION);
+    for(size_t i = 0; i < library->count; i++){
+        const library_entry_t *entry = &library->entries[i];
+        fprintf(file, "%016llx %u %lld %lld %llu %02x %016llx %016llx %s %s\n", (unsigned long long)entry->hash,
+                entry->size, (long long)entry->mtime, (long long)entry->ctime, (unsigned long long)entry->inode,
+                entry->flags, (unsigned long long)entry->code_pages,
+                (unsigned long long)entry->written_pages, entry->profile, entry->name);
+    }
+    const bool ok = !ferror(file);
+    if(fclose(file) != 0 || !ok || rename(temp, path) != 0){
+        SDL_Log("Could not write the library index %s\n", path);
+        remove(temp);
+        return false;
+    }
+    return true;
+}
+
+// Map a library ROM read-only, NULL if it cannot be read
+const uint8_t *map_rom(const char *path, size_t size){
+    const int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+// Bring the index up to date with the directory. Only new files and files whose size,
+// mtime, ctime or inode changed are mapped, hashed and analyzed. Returns false on allocation failure
+bool scan_library(library_t *library, const char *dir, uint32_t *hashed, bool *changed){
+    DIR *handle = opendir(dir);
+    if(!handle){
+        SDL_Log("Could not open the ROM library %s\n", dir);
+        return false;
+    }
+    const size_t indexed = library->count;  // the sorted part bsearch can look in
+    char path[4096];
+    for(struct dirent *ent; (ent = readdir(handle));){
+        if(ent->d_name[0] == '.') continue;
+        if(strpbrk(ent->d_name, ",\n")){
+            SDL_Log("Skipping %s, commas and newlines do not fit the index\n", ent->d_name);
+            continue;
+        }
+        if(snprintf(path, sizeof path, "%s/%s", dir, ent->d_name) >= (int)sizeof path) continue;
+        struct stat st;
+        if(stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if(st.st_size < 1 || st.st_size > 4096 - 0x200) continue; // not a CHIP8 program
+
+        const library_entry_t key = {.name = ent->d_name};
+        library_entry_t *entry = indexed ? bsearch(&key, library->entries, indexed, sizeof key, compare_library_entries) : NULL;
+        // whole seconds miss a same-size rewrite within the second, so compare in ns
+        const int64_t mtime = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+        const int64_t ctime = st.st_ctim.tv_sec * 1000000000ll + st.st_ctim.tv_nsec;
+        if(entry && entry->size == st.st_size && entry->mtime == mtime && entry->ctime == ctime &&
+           entry->inode == st.st_ino){
+            entry->seen = true;
+            continue;
+        }
+        const uint8_t *rom = map_rom(path, st.st_size);
+        if(!rom) continue;
+        if(!entry && !(entry = add_library_entry(library, ent->d_name))){
+            munmap((void *)rom, st.st_size);
+            closedir(handle);
+            return false;
+        }
+        entry->hash = hash_bytes(rom, st.st_size);
+        entry->flags = analyze_rom(rom, st.st_size);
+        snprintf(entry->profile, sizeof entry->profile, "%s", guess_profile(entry->flags));
+        analyze_entry(entry, rom, st.st_size);
+        munmap((void *)rom, st.st_size);
+        entry->size = st.st_size;
+        entry->mtime = mtime;
+        entry->ctime = ctime;
+        entry->inode = st.st_ino;
+        entry->seen = true;
+        (*hashed)++;
+        *changed = true;
+    }
+    closedir(handle);
+
+    // drop files that are gone
+    size_t kept = 0;
+    for(size_t i = 0; i < library->count; i++){
+        if(library->entries[i].seen) library->entries[kept++] = library->entries[i];
+        else{
+            free(library->entries[i].name);
+            *changed = true;
+        }
+    }
+    library->count = kept;
+    qsort(library->entries, library->count, sizeof *library->entries, compare_library_entries);
+    return true;
+}
+
+// --library: index a ROM directory, then list it or run a batch of every ROM in it
+bool run_library(const char *dir, const config_t config){
+    const uint64_t before = SDL_GetPerformanceCounter();
+    library_t library = {0};
+    uint32_t hashed = 0;
+    bool changed = false;
+    if(!load_library_index(&library, dir) || !scan_library(&library, dir, &hashed, &changed)){
+        free_library(&library);
+        return false;
+    }
+    if(changed) save_library_index(&library, dir);
+    const uint64_t indexed = SDL_GetPerformanceCounter();
+
+    bool ok = true;
+    char path[4096];
+    if(!config.batch_size){
+        printf("name,hash,size,flags,code_pages,written_pages,profile\n");
+        for(size_t i = 0; i < library.count; i++){
+            const library_entry_t *entry = &library.entries[i];
+            printf("%s,%016llx,%u,%02x,%016llx,%016llx,%s\n", entry->name, (unsigned long long)entry->hash,
+                   entry->size, entry->flags, (unsigned long long)entry->code_pages,
+                   (unsigned long long)entry->written_pages, entry->profile);
+        }
+    }
+    else{
+        printf("rom,instance,seed,instructions,frames,display_hash,PC,I,V\n");
+        for(size_t i = 0; i < library.count && ok; i++){
+            const library_entry_t *entry = &library.entries[i];
+            snprintf(path, sizeof path, "%s/%s", dir, entry->name);
+            const uint8_t *rom = map_rom(path, entry->size);
+            if(!rom){
+                SDL_Log("Could not map %s\n", path);
+                continue;
+            }
+            chip8_t chip8 = {0};
+            const bool loaded = load_chip8(&chip8, entry->name, rom, entry->size);
+            munmap((void *)rom, entry->size);
+            if(!loaded) continue;
+            seed_random(&chip8, config.seed);
+            // the index says which profile the ROM runs with, edited entries included
+            quirks_t quirks = config.quirks;
+            if(!find_quirks(entry->profile, &quirks))
+                SDL_Log("%s: unknown quirk profile %s, using --quirks\n", entry->name, entry->profile);
+            chip8.quirks = quirks;
+            // the analysis in the index only holds for the profile it was made under
+            if(config.analyze && !(entry->flags & (ROM_COMPUTED | ROM_SELF_MODIFYING)) &&
+               strcmp(entry->profile, guess_profile(entry->flags)) == 0)
+                chip8.data_pages = ~entry->code_pages;
+            ok = run_batch(&chip8, config, true);
+        }
+    }
+    const uint64_t after = SDL_GetPerformanceCounter();
+
+    const double freq = SDL_GetPerformanceFrequency();
+    fprintf(stderr, "Library:         %s\n", dir);
+    fprintf(stderr, "ROMs:            %zu\n", library.count);
+    fprintf(stderr, "Hashed:          %u\n", hashed);
+    fprintf(stderr, "Index time:      %.6f s\n", (indexed - before) / freq);
+    if(config.batch_size){
+        fprintf(stderr, "Instances:       %llu\n", (unsigned long long)library.count * config.batch_size);
+        fprintf(stderr, "Batch time:      %.6f s\n", (after - indexed) / freq);
+    }
+    free_library(&library);
+    return ok;
+}
+#endif
+
+#ifdef HAVE_SERVER
+// Session server (--serve): every TCP connection gets a machine of its own running the ROM.
+// Clients send keypad masks as u16 little endian and receive a frame stream (see stream_frame).
+// One epoll loop owns every socket and a timerfd that turns a wheel of SERVER_SLOTS slots, each
+// slot ticks its sessions once a frame, so the work is spread over the frame instead of
+// landing all at once. A session blocked on FX0A or 00FD is taken off the wheel until input
+// arrives, its timers catch up when it runs again, so a session waiting for a key costs nothing
+#define SERVER_SLOTS FRAME_SLICES
+#define SESSION_OUT 16384   // queued frame stream bytes per session
+#define SERVER_EVENTS 256   // epoll events taken per wait
+
+typedef struct session session_t;
+struct session{
+    chip8_t *chip8;         // from the server's machine pool
+    frame_stream_t stream;  // what the client has been sent
+    int fd;
+    uint8_t slot;           // wheel slot the session ticks in
+    bool parked;            // off the wheel until input arrives
+    bool writing;           // epoll waits for the socket to take more of out
+    session_t *prev, *next; // slot list
+    uint64_t turn;          // wheel turn the session last ran a frame in
+    uint64_t cycle_carry;   // see frame_cycles
+    uint16_t keys;          // latest keypad mask from the client
+    uint8_t in[2];          // partial keypad message
+    uint8_t in_len;
+    size_t out_len;         // bytes queued in out
+    uint8_t out[SESSION_OUT];
+};
+
+typedef struct{
+    int epoll;
+    int listener;
+    int timer;
+    session_t *slots[SERVER_SLOTS]; // sessions ticking in each slot
+    uint32_t slot;          // next slot to tick
+    uint64_t turn;          // completed turns of the wheel, one per frame
+    uint32_t sessions;      // open sessions
+    uint32_t max_sessions;
+    uint64_t served;        // sessions accepted so far, also the next CXNN seed offset
+    session_t *closed;      // closed sessions, freed once the events in hand are handled
+    machine_pool_t pool;    // machines of open sessions and ones to reuse
+} server_t;
+
+void wheel_insert(server_t *server, session_t *session){
+    session_t **head = &server->slots[session->slot];
+    session->prev = NULL;
+    session->next = *head;
+    if(*head) (*head)->prev = session;
+    *head = session;
+    session->parked = false;
+}
+
+void wheel_remove(server_t *server, session_t *session){
+    if(session->prev) session->prev->next = session->next;
+    else server->slots[session->slot] = session->next;
+    if(session->next) session->next->prev = session->prev;
+    session->prev = session->next = NULL;
+    session->parked = true;
+}
+
+// Machine is stopped until a key goes down: FX0A with no key held, or 00FD
+bool session_blocked(const chip8_t *chip8){
+    const uint16_t PC = chip8->PC & 0xFFF;
+    const uint16_t opcode = chip8->ram[PC] << 8 | chip8->ram[(PC + 1) & 0xFFF];
+    return opcode == 0x00FD || ((opcode & 0xF0FF) == 0xF00A && !chip8->keypad);
+}
+
+// Send as much of the queued stream as the socket takes, false if the client is gone
+bool flush_session(server_t *server, session_t *session){
+    size_t sent = 0;
+    while(sent < session->out_len){
+        const ssize_t n = send(session->fd, session->out + sent, session->out_len - sent, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if(n <= 0) return false;
+        sent += n;
+    }
+    memmove(session->out, session->out + sent, session->out_len - sent);
+    session->out_len -= sent;
+    // only wait for the socket to drain while something is queued
+    if(session->writing != (session->out_len > 0)){
+        session->writing = session->out_len > 0;
+        struct epoll_event event = {.events = EPOLLIN | (session->writing ? EPOLLOUT : 0), .data.ptr = session};
+        epoll_ctl(server->epoll, EPOLL_CTL_MOD, session->fd, &event);
+    }
+    return true;
+}
+
+// Drop a session, it is freed by free_closed_sessions as events for it may still be in hand
+void close_session(server_t *server, session_t *session){
+    if(!session->parked) wheel_remove(server, session);
+    close(session->fd);
+    session->fd = -1;
+    session->next = server->closed;
+    server->closed = session;
+    server->sessions--;
+}
+
+void free_closed_sessions(server_t *server){
+    while(server->closed){
+        session_t *session = server->closed;
+        server->closed = session->next;
+        release_machine(&server->pool, session->chip8);
+        free(session);
+    }
+}
+
+// Run one frame of a session and queue its frame record
+// Records without changes are not sent, the frame numbers of the next one says how much time
+// passed. A client that does not keep up skips records, the next one it gets carries every change
+bool tick_session(server_t *server, session_t *session, const config_t config){
+    chip8_t *chip8 = session->chip8;
+    // frames spent parked only ran the timers down, the machine itself was stopped
+    if(server->turn > session->turn + 1){
+        const uint64_t missed = server->turn - session->turn - 1;
+        chip8->delay_timer = missed < chip8->delay_timer ? chip8->delay_timer - missed : 0;
+        chip8->sound_timer = missed < chip8->sound_timer ? chip8->sound_timer - missed : 0;
+        session->stream.frame += missed;
+    }
+    session->turn = server->turn;
+    chip8->keypad = session->keys;
+    run_chip8(chip8, config, frame_cycles(&session->cycle_carry, config.clock_speed, 60));
+    update_timers(chip8);
+    chip8->draw = false;
+    if(session_blocked(chip8)) wheel_remove(server, session);
+    if(session->out_len + STREAM_RECORD_MAX > sizeof session->out){
+        session->stream.frame++;
+        return true;
+    }
+    const uint32_t length = encode_frame(&session->stream, chip8);
+    const uint8_t *record = session->stream.record;
+    if(!record[7] && !(record[6] & STREAM_CLEAR)) return true;
+    memcpy(session->out + session->out_len, record, length);
+    const bool was_empty = !session->out_len;
+    session->out_len += length;
+    return !was_empty || flush_session(server, session);
+}
+
+// Take every pending connection, each starts the ROM from the beginning
+void accept_sessions(server_t *server, const config_t config){
+    for(;;){
+        const int fd = accept(server->listener, NULL, NULL);
+        if(fd < 0){
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                SDL_Log("Could not accept a session: %s\n", strerror(errno));
+            return;
+        }
+        session_t *session = server->sessions < server->max_sessions ? calloc(1, sizeof *session) : NULL;
+        if(session && !(session->chip8 = acquire_machine(&server->pool))){
+            free(session);
+            session = NULL;
+        }
+        if(!session){
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+        seed_random(session->chip8, config.seed + server->served);
+        session->fd = fd;
+        session->slot = server->served++ % SERVER_SLOTS;
+        session->turn = server->turn;
+        const uint8_t header[8] = {STREAM_MAGIC[0], STREAM_MAGIC[1], STREAM_MAGIC[2], STREAM_MAGIC[3], STREAM_VERSION};
+        memcpy(session->out, header, sizeof header);
+        session->out_len = sizeof header;
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = session};
+        epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &event);
+        wheel_insert(server, session);
+        server->sessions++;
+        if(!flush_session(server, session)) close_session(server, session);
+    }
+}
+
+// Read keypad masks, only the latest one counts. A key going down wakes a parked session
+bool read_session(server_t *server, session_t *session){
+    uint8_t data[256];
+    for(;;){
+        const ssize_t n = recv(session->fd, data, sizeof data, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if(n <= 0) return false;
+        for(ssize_t i = 0; i < n; i++){
+            session->in[session->in_len++] = data[i];
+            if(session->in_len < 2) continue;
+            session->keys = session->in[0] | session->in[1] << 8;
+            session->in_len = 0;
+        }
+    }
+    if(session->parked && session->keys) wheel_insert(server, session);
+    return true;
+}
+
+// Tick the sessions in the next slot of the wheel
+void turn_wheel(server_t *server, const config_t config){
+    for(session_t *session = server->slots[server->slot], *next; session; session = next){
+        next = session->next;
+        if(!tick_session(server, session, config)) close_session(server, session);
+    }
+    server->slot = (server->slot + 1) % SERVER_SLOTS;
+    if(!server->slot) server->turn++;
+}
+
+// Serve the ROM to every client that connects on port, until the process is stopped
+bool run_server(chip8_t *rom, const config_t config){
+    server_t server = {.max_sessions = config.max_sessions, .turn = 1};
+    if(!init_pool(&server.pool, rom, config.max_sessions)) return false;
+    // thousands of sessions are thousands of sockets
+    struct rlimit files;
+    if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max){
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(config.serve_port), .sin_addr.s_addr = htonl(INADDR_ANY)};
+    server.listener = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(server.listener, F_SETFL, O_NONBLOCK);
+    server.epoll = epoll_create1(EPOLL_CLOEXEC);
+    server.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    const long slice = 1000000000L / (60 * SERVER_SLOTS);
+    const struct itimerspec period = {.it_interval = {0, slice}, .it_value = {0, slice}};
+    setsockopt(server.listener, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if(server.listener < 0 || server.epoll < 0 || server.timer < 0 ||
+       bind(server.listener, (struct sockaddr *)&address, sizeof address) != 0 ||
+       listen(server.listener, SOMAXCONN) != 0 || timerfd_settime(server.timer, 0, &period, NULL) != 0){
+        SDL_Log("Could not listen on port %u: %s\n", config.serve_port, strerror(errno));
+        return false;
+    }
+    // the listener and timer are told apart from sessions by their data pointers
+    epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.listener, &(struct epoll_event){.events = EPOLLIN, .data.ptr = &server.listener});
+    epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.timer, &(struct epoll_event){.events = EPOLLIN, .data.ptr = &server.timer});
+    fprintf(stderr, "Serving %s on port %u\n", rom->rom_name, config.serve_port);
+
+    struct epoll_event events[SERVER_EVENTS];
+    for(;;){
+        const int count = epoll_wait(server.epoll, events, SERVER_EVENTS, -1);
+        if(count < 0 && errno != EINTR){
+            SDL_Log("epoll_wait failed: %s\n", strerror(errno));
+            return false;
+        }
+        for(int e = 0; e < count; e++){
+            void *ptr = events[e].data.ptr;
+            if(ptr == &server.listener){
+                accept_sessions(&server, config);
+            }
+            else if(ptr == &server.timer){
+                // a stalled loop catches up a few frames at most, like the windowed scheduler
+                uint64_t expired = 0;
+                if(read(server.timer, &expired, sizeof expired) != sizeof expired) continue;
+                if(expired > MAX_CATCHUP_FRAMES * SERVER_SLOTS) expired = MAX_CATCHUP_FRAMES * SERVER_SLOTS;
+                while(expired--) turn_wheel(&server, config);
+            }
+            else{
+                session_t *session = ptr;
+                if(session->fd < 0) continue;   // closed while handling an earlier event
+                bool ok = !(events[e].events & (EPOLLERR | EPOLLHUP));
+                if(ok && events[e].events & EPOLLIN) ok = read_session(&server, session);
+                if(ok && events[e].events & EPOLLOUT) ok = flush_session(&server, session);
+                if(!ok) close_session(&server, session);
+            }
+        }
+        free_closed_sessions(&server);
+    }
+}
+#endif
+
+// Finished display handed from the emulation thread to the UI thread
+typedef struct{
+    uint64_t display[DISPLAY_PLANES][DISPLAY_ROWS][DISPLAY_WORDS];  // copy of chip8_t.display
+    bool hires;             // copy of chip8_t.hires
+} frame_t;
+
+#define FRAME_INDEX 0x3     // ready slot index bits
+#define FRAME_FRESH 0x4     // ready slot holds a frame the UI has not taken yet
+
+// State shared by the emulation and UI threads, only touched through the atomics
+// Triple buffer: the emulation thread owns one frame, the UI another, the third is ready
+// and ownership moves by atomically exchanging slot indexes
+typedef struct{
+    chip8_t *chip8;         // owned by the emulation thread while it runs
+    config_t config;
+    frame_t frames[3];
+    SDL_atomic_t ready;     // index of the ready frame | FRAME_FRESH
+    SDL_atomic_t keys;      // keypad bitmask from the UI, bit n = key n held
+    SDL_atomic_t state;     // emulator_state_t from the UI
+    SDL_atomic_t hotkeys;   // hotkey_t bits from the UI, cleared as the emulation thread takes them
+    SDL_atomic_t rewind_held; // rewind key state from the UI
+    SDL_atomic_t background;  // the UI's window is out of sight, see set_background
+    SDL_sem *resume;        // posted by the UI when state leaves PAUSED
+    rewind_t *rewind;       // NULL without --rewind
+    input_log_t *record;    // NULL without --record
+} emu_link_t;
+
+// Emulation thread: paced by its own 60hz schedule, never waits on the renderer
+int emulation_thread(void *data){
+    emu_link_t *link = data;
+    chip8_t *chip8 = link->chip8;
+    const sdl_t no_vsync = {.refresh_rate = 60};
+    scheduler_t sched;
+    init_scheduler(&sched, link->config, no_vsync, link->rewind, link->record);
+    int back = 0;
+    for(emulator_state_t state; (state = SDL_AtomicGet(&link->state)) != QUIT;){
+        if(state == PAUSED){
+            if(chip8->beeper_gate) SDL_AtomicSet(chip8->beeper_gate, 0);
+            SDL_SemWait(link->resume);
+            reset_scheduler(&sched);
+            continue;
+        }
+        set_background(&sched, SDL_AtomicGet(&link->background));
+        // keys arrive through the mask, so they land on the slice after the UI saw them
+        set_keys(chip8, &sched, SDL_AtomicGet(&link->keys));
+        chip8->rewind_held = SDL_AtomicGet(&link->rewind_held);
+        const uint8_t hotkeys = SDL_AtomicSet(&link->hotkeys, 0);
+        if(hotkeys & HOTKEY_TURBO) set_turbo(&sched, !sched.turbo);
+        handle_hotkeys(chip8, hotkeys, link->record);
+
+        const bool ended = run_scheduled_frames(chip8, link->config, &sched);
+        // running ahead, every frame publishes its future as that may change on its own
+        const bool ahead = link->config.run_ahead && !sched.turbo && !sched.rewinding;
+        if(ended && (chip8->draw || ahead)){
+            static run_ahead_t saved;
+            if(ahead) begin_run_ahead(chip8, link->config, &sched, &saved);
+            // publish the frame and take back whichever slot was ready
+            memcpy(link->frames[back].display, chip8->display, sizeof chip8->display);
+            link->frames[back].hires = chip8->hires;
+            back = SDL_AtomicSet(&link->ready, back | FRAME_FRESH) & FRAME_INDEX;
+            chip8->draw = false;
+            if(ahead) end_run_ahead(chip8, &saved);
+        }
+        wait_next_frame(&sched, no_vsync);
+    }
+    if(link->record) close_recording(link->record, chip8, sched.cycles);
+    return 0;
+}
+
+// Main loop with emulation on its own thread, here only events and presents
+// Returns false if the thread could not be started
+bool run_threaded(chip8_t *chip8, const config_t config, const sdl_t sdl, rewind_t *rewind, input_log_t *record){
+    emu_link_t *link = calloc(1, sizeof *link);
+    if(!link || !(link->resume = SDL_CreateSemaphore(0))){
+        SDL_Log("Could not allocate the emulation thread state\n");
+        free(link);
+        return false;
+    }
+    link->chip8 = chip8;
+    link->config = config;
+    link->rewind = rewind;
+    link->record = record;
+    SDL_AtomicSet(&link->ready, 2);
+    SDL_AtomicSet(&link->state, RUNNING);
+    int front = 1;
+    SDL_Thread *thread = SDL_CreateThread(emulation_thread, "chip8 emulation", link);
+    if(!thread){
+        SDL_Log("Could not start the emulation thread %s\n", SDL_GetError());
+        SDL_DestroySemaphore(link->resume);
+        free(link);
+        return false;
+    }
+
+    // what the UI shows and the input it has collected, the renderer reads it like a machine
+    chip8_t view = {.state = RUNNING, .draw = true, .damage = {0, 0, 0xFF, 0xFF}};
+#ifdef PROFILE
+    view.profile = chip8->profile;      // presents count as redraw time of the real machine
+#endif
+    const uint64_t freq = SDL_GetPerformanceFrequency();
+    uint64_t next = SDL_GetPerformanceCounter();
+    while(view.state != QUIT){
+        handle_input(&view);
+        if(view.key_count){
+            view.keypad = view.key_queue[(view.key_head + view.key_count - 1) % KEY_QUEUE].keys;
+            view.key_count = 0;
+        }
+        SDL_AtomicSet(&link->keys, view.keypad);
+        // a window out of sight pauses the emulation thread with --background pause
+        const bool away = in_background(&view, config);
+        const emulator_state_t state = away && config.background == BACKGROUND_PAUSE && view.state == RUNNING
+                                     ? PAUSED : view.state;
+        if(SDL_AtomicSet(&link->state, state) == PAUSED && state != PAUSED) SDL_SemPost(link->resume);
+        SDL_AtomicSet(&link->background, away);
+        SDL_AtomicSet(&link->rewind_held, view.rewind_held);
+        // merge new hotkeys with any the emulation thread has not taken yet
+        while(view.hotkeys){
+            const int pending = SDL_AtomicGet(&link->hotkeys);
+            if(SDL_AtomicCAS(&link->hotkeys, pending, pending | view.hotkeys)) view.hotkeys = 0;
+        }
+
+        if(SDL_AtomicGet(&link->ready) & FRAME_FRESH){
+            front = SDL_AtomicSet(&link->ready, front) & FRAME_INDEX;
+            // damage the columns and rows that changed since the last shown frame,
+            // everything when the resolution changed
+            const frame_t *frame = &link->frames[front];
+            if(frame->hires != view.hires){
+                view.hires = frame->hires;
+                add_damage(&view, 0, 0, 0xFF, 0xFF);
+            }
+            for(uint8_t p = 0; p < DISPLAY_PLANES; p++)
+                for(uint8_t y = 0; y < DISPLAY_ROWS; y++)
+                    for(uint8_t w = 0; w < DISPLAY_WORDS; w++){
+                        const uint64_t changed = frame->display[p][y][w] ^ view.display[p][y][w];
+                        if(changed) add_damage(&view, w * 64 + __builtin_clzll(changed), y,
+                                               w * 64 + 63 - __builtin_ctzll(changed), y);
+                    }
+            memcpy(view.display, frame->display, sizeof view.display);
+        }
+        // out of sight presents stop pacing the UI, only frames that changed are presented
+        sdl_t shown = sdl;
+        shown.vsync = sdl.vsync && !away;
+        if(!(view.window & WINDOW_HIDDEN)){
+            redraw_screen(shown, config, &view);
+            measure_latency(&view);
+        }
+
+        // vsync presents pace the UI, otherwise poll at the display refresh rate
+        // Paused or hidden there is nothing to show until an event changes that
+        if(state == PAUSED || view.window & WINDOW_HIDDEN){
+            wait_for_event();
+            next = SDL_GetPerformanceCounter();
+        }
+        else if(!shown.vsync){
+            next += freq / sdl.refresh_rate;
+            const uint64_t now = SDL_GetPerformanceCounter();
+            if(next < now) next = now;
+            // out of focus a frame may be late by a millisecond, spinning for it is not worth it
+            if(away) SDL_WaitEventTimeout(NULL, (next - now) * 1000 / freq + 1);
+            else sleep_until(next);
+        }
+    }
+    SDL_WaitThread(thread, NULL);
+    chip8->latency = view.latency;
+    SDL_DestroySemaphore(link->resume);
+    free(link);
+    return true;
+}
+
+#ifdef BENCH
+// Microbenchmarks of a benchmark build (make bench), see run_bench
+#define BENCH_WARMUP 10         // samples run and thrown away first
+#define BENCH_SAMPLES 101       // samples kept, odd so the median is one of them
+#define BENCH_MAX 128           // benchmarks in one run
+
+// Statistics of one benchmark, times are per operation
+typedef struct{
+    char name[64];
+    const char *unit;           // what one operation is
+    uint64_t ops;               // operations per sample
+    uint64_t instructions;      // CHIP8 instructions per operation, 0 = not an emulation benchmark
+    double median_ns, p99_ns, min_ns;
+} bench_result_t;
+
+typedef struct{
+    bench_result_t results[BENCH_MAX];
+    uint32_t count;
+} bench_t;
+
+// What a benchmark runs, one sample at a time
+typedef struct{
+    chip8_t *chip8;
+    config_t config;
+    sdl_t sdl;
+    uint64_t count;             // instructions, sprites, redraws, frames or timer ticks per sample
+    uint8_t N;                  // sprite height, 0 = 16x16
+    bool wrap;                  // draw sprites with QUIRK_WRAP
+    bool lit;                   // draw sprites onto a fully lit display, so every one collides
+} bench_work_t;
+
+// Programs the benchmarks run, endless loops starting at 0x200
+typedef struct{
+    const char *name;
+    const uint16_t *code;
+    size_t length;              // instructions
+} bench_program_t;
+
+// Opcode mixes for the dispatch benchmarks, they change registers every pass so never idle
+static const uint16_t bench_alu[] = {
+    0x6005, 0x6103, 0x8014, 0x8125, 0x8236, 0x7201, 0x8306, 0x830E,
+    0x8417, 0x8041, 0x8142, 0x8243, 0x8350, 0x7307, 0x1200,
+};
+static const uint16_t bench_branch[] = {
+    0x7001, 0x3010, 0x120A, 0x6000, 0x7101, 0x4100, 0x7201, 0x5120,
+    0x9010, 0x1200, 0x2218, 0x1200, 0x00EE,
+};
+static const uint16_t bench_memory[] = {
+    0xA300, 0x7001, 0xF01E, 0xF033, 0xF255, 0xF265, 0xF029, 0x1200,
+};
+static const uint16_t bench_mixed[] = {
+    0x6A00, 0x7A01, 0x8AB4, 0xCB0F, 0x3B00, 0x7C01, 0xA210, 0xDAB3,
+    0xFE07, 0xEEA1, 0x6D01, 0x1202,
+};
+// Full frame programs: rows of font digits cleared and redrawn, and a loop that does a
+// little work then waits for the delay timer like most games do
+static const uint16_t bench_sprites[] = {
+    0x00E0, 0x6000, 0x6100, 0x6300, 0xF329, 0xD015, 0x7008, 0x7301,
+    0x3040, 0x1208, 0x6000, 0x7106, 0x311E, 0x1208, 0x1200,
+};
+static const uint16_t bench_idle[] = {
+    0x6F01, 0xFF15, 0x7001, 0x8014, 0x8104, 0xA300, 0xF133, 0x8216,
+    0xFE07, 0x3E00, 0x1210, 0x1200,
+};
+
+#define BENCH_PROGRAM(name) {#name, bench_##name, sizeof bench_##name / sizeof *bench_##name}
+
+// Start the machine over on a program, freeing the code caches of the last one
+void bench_load(bench_work_t *work, const uint16_t *code, size_t length, uint8_t quirks){
+    chip8_t *chip8 = work->chip8;
+    free(chip8->decoded);
+#ifdef HAVE_JIT
+    if(chip8->jit) jit_free(chip8->jit);
+#endif
+    uint8_t image[FUZZ_PROGRAM];
+    for(size_t i = 0; i < length; i++){
+        image[2 * i] = code[i] >> 8;
+        image[2 * i + 1] = code[i];
+    }
+    memset(chip8, 0, sizeof *chip8);
+    load_chip8(chip8, "bench", image, 2 * length);
+    chip8->quirks = quirks;
+    seed_random(chip8, 1);
+}
+
+void bench_instructions(bench_work_t *work){
+    run_chip8(work->chip8, work->config, work->count);
+}
+
+void bench_draw(bench_work_t *work){
+    chip8_t *chip8 = work->chip8;
+    memset(chip8->display, work->lit ? 0xFF : 0, sizeof chip8->display);
+    for(uint64_t i = 0; i < work->count; i++){
+        chip8->V[0] += 7;
+        chip8->V[1] += 3;
+        if(work->wrap) draw_sprite_wrapped(chip8, work->config, 0, 1, work->N);
+        else draw_sprite(chip8, work->config, 0, 1, work->N);
+    }
+}
+
+void bench_redraw(bench_work_t *work){
+    for(uint64_t i = 0; i < work->count; i++){
+        work->chip8->draw = true;
+        work->chip8->damage = (damage_t){0, 0, 0xFF, 0xFF};
+        redraw_screen(work->sdl, work->config, work->chip8);
+    }
+}
+
+void bench_frames(bench_work_t *work){
+    uint64_t carry = 0;
+    for(uint64_t f = 0; f < work->count; f++){
+        run_chip8(work->chip8, work->config, frame_cycles(&carry, work->config.clock_speed, 60));
+        update_timers(work->chip8);
+        work->chip8->draw = false;
+    }
+}
+
+void bench_timers(bench_work_t *work){
+    chip8_t *chip8 = work->chip8;
+    for(uint64_t i = 0; i < work->count; i++){
+        if(!chip8->sound_timer) chip8->delay_timer = chip8->sound_timer = 0xFF;
+        update_timers(chip8);
+    }
+}
+
+int compare_doubles(const void *a, const void *b){
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Time BENCH_SAMPLES runs of work after BENCH_WARMUP unrecorded ones and print the result
+void bench_measure(bench_t *bench, const char *name, const char *unit, uint64_t instructions,
+                   void (*run)(bench_work_t *), bench_work_t *work){
+    if(bench->count == BENCH_MAX) return;
+    double samples[BENCH_SAMPLES];
+    const double freq = SDL_GetPerformanceFrequency();
+    for(int s = -BENCH_WARMUP; s < BENCH_SAMPLES; s++){
+        const uint64_t start = SDL_GetPerformanceCounter();
+        run(work);
+        const uint64_t end = SDL_GetPerformanceCounter();
+        if(s >= 0) samples[s] = (end - start) * 1e9 / freq / work->count;
+    }
+    qsort(samples, BENCH_SAMPLES, sizeof *samples, compare_doubles);
+    bench_result_t *result = &bench->results[bench->count++];
+    snprintf(result->name, sizeof result->name, "%s", name);
+    result->unit = unit;
+    result->ops = work->count;
+    result->instructions = instructions;
+    result->median_ns = samples[BENCH_SAMPLES / 2];
+    result->p99_ns = samples[(BENCH_SAMPLES * 99 + 99) / 100 - 1];
+    result->min_ns = samples[0];
+    printf("%-36s %-12s %12.2f %12.2f %12.2f %14.0f", result->name, unit, result->median_ns,
+           result->p99_ns, result->min_ns, 1e9 / result->median_ns);
+    if(instructions) printf(" %10.2f", instructions * 1e3 / result->median_ns);
+    printf("\n");
+    fflush(stdout);
+}
+
+// Write the results as CSV, or JSON if the file name ends in .json
+bool write_bench(const bench_t *bench, const char *file_name){
+    FILE *out = fopen(file_name, "w");
+    if(!out){
+        SDL_Log("Could not write benchmark results %s\n", file_name);
+        return false;
+    }
+    const size_t name_len = strlen(file_name);
+    const bool json = name_len >= 5 && strcmp(file_name + name_len - 5, ".json") == 0;
+    if(json) fprintf(out, "{\n  \"samples\": %d,\n  \"benchmarks\": [", BENCH_SAMPLES);
+    else fprintf(out, "benchmark,unit,ops_per_sample,median_ns,p99_ns,min_ns,ops_per_sec,mips\n");
+    for(uint32_t i = 0; i < bench->count; i++){
+        const bench_result_t *r = &bench->results[i];
+        const double mips = r->instructions * 1e3 / r->median_ns;
+        if(json)
+            fprintf(out, "%s\n    {\"benchmark\": \"%s\", \"unit\": \"%s\", \"ops_per_sample\": %llu, "
+                    "\"median_ns\": %.3f, \"p99_ns\": %.3f, \"min_ns\": %.3f, \"ops_per_sec\": %.1f, \"mips\": %.3f}",
+                    i ? "," : "", r->name, r->unit, (unsigned long long)r->ops, r->median_ns, r->p99_ns,
+                    r->min_ns, 1e9 / r->median_ns, mips);
+        else
+            fprintf(out, "%s,%s,%llu,%.3f,%.3f,%.3f,%.1f,%.3f\n", r->name, r->unit, (unsigned long long)r->ops,
+                    r->median_ns, r->p99_ns, r->min_ns, 1e9 / r->median_ns, mips);
+    }
+    if(json) fprintf(out, "\n  ]\n}\n");
+    const bool ok = !ferror(out);
+    if(fclose(out) != 0 || !ok){
+        SDL_Log("Could not write benchmark results %s\n", file_name);
+        return false;
+    }
+    return true;
+}
+
+// Run every benchmark, print a table and write the results to config.bench
+// rom_name is a ROM to add to the full frame benchmarks, - for only the built-in programs
+bool run_bench(const char *rom_name, config_t config){
+    static const bench_program_t mixes[] = {
+        BENCH_PROGRAM(alu), BENCH_PROGRAM(branch), BENCH_PROGRAM(memory), BENCH_PROGRAM(mixed),
+    };
+    static const bench_program_t programs[] = {BENCH_PROGRAM(sprites), BENCH_PROGRAM(idle)};
+    static const struct{ const char *name; cpu_mode_t mode; } cores[] = {
+        {"interpreter", CPU_INTERPRETER}, {"predecoded", CPU_PREDECODED},
+#ifdef HAVE_JIT
+        {"jit", CPU_JIT},
+#endif
+    };
+    static const uint8_t heights[] = {1, 5, 8, 15, 0};
+    static const struct{ const char *name; render_mode_t mode; } renderers[] = {
+        {"texture", RENDER_TEXTURE}, {"rects", RENDER_RECTS}, {"gl", RENDER_GL},
+    };
+    static bench_t bench;
+    static chip8_t machine, rom;
+    bench_work_t work = {.chip8 = &machine, .config = config};
+    char name[64];
+    config.pacing = PACING_TIMER;   // presents must not wait for vsync
+    config.volume = 0;
+
+    if(strcmp(rom_name, "-") != 0 && !init_chip8(&rom, rom_name)) return false;
+    printf("%-36s %-12s %12s %12s %12s %14s %10s\n", "benchmark", "unit", "median ns", "p99 ns", "min ns",
+           "ops/sec", "MIPS");
+
+    // dispatch: every core on each opcode mix, idle skipping off so every instruction runs
+    work.config.idle_skip = false;
+    work.count = 100000;
+    for(size_t c = 0; c < sizeof cores / sizeof *cores; c++){
+        work.config.cpu_mode = cores[c].mode;
+        for(size_t m = 0; m < sizeof mixes / sizeof *mixes; m++){
+            bench_load(&work, mixes[m].code, mixes[m].length, QUIRKS_CHIP8);
+            snprintf(name, sizeof name, "dispatch/%s/%s", mixes[m].name, cores[c].name);
+            bench_measure(&bench, name, "instruction", 1, bench_instructions, &work);
+        }
+    }
+
+    // DXYN: each height clipped and wrapped, on an empty display with empty sprites (no
+    // collisions) and on a lit one with font sprites (every draw collides). 16x16 is hi-res
+    work.config = config;
+    work.count = 1000;
+    for(size_t h = 0; h < sizeof heights; h++){
+        for(int wrap = 0; wrap < 2; wrap++){
+            for(int lit = 0; lit < 2; lit++){
+                bench_load(&work, bench_alu, 1, heights[h] ? QUIRKS_CHIP8 : QUIRKS_SCHIP);
+                machine.hires = !heights[h];
+                machine.I = lit ? 0 : 0x300;
+                work.N = heights[h];
+                work.wrap = wrap;
+                work.lit = lit;
+                char height[8] = "16x16";
+                if(heights[h]) snprintf(height, sizeof height, "%u", heights[h]);
+                snprintf(name, sizeof name, "dxyn/%s/%s/%s", height, wrap ? "wrap" : "clip", lit ? "collide" : "empty");
+                bench_measure(&bench, name, "sprite", 0, bench_draw, &work);
+            }
+        }
+    }
+
+    // redraw: every backend with half the pixels lit, lo-res and hi-res
+    work.count = 10;
+    for(size_t r = 0; r < sizeof renderers / sizeof *renderers; r++){
+        work.config = config;
+        work.config.render_mode = renderers[r].mode;
+        work.sdl = (sdl_t){0};
+        if(!init_sdl(&work.sdl, work.config)){
+            SDL_Log("Could not open a window, skipping the %s redraw benchmarks\n", renderers[r].name);
+            continue;
+        }
+        if(renderers[r].mode == RENDER_GL && !work.sdl.gl){
+            SDL_Log("No OpenGL 3.3, skipping the gl redraw benchmarks\n");
+            final_cleanup(work.sdl);
+            continue;
+        }
+        for(int hires = 0; hires < 2; hires++){
+            bench_load(&work, bench_alu, 1, QUIRKS_CHIP8);
+            machine.hires = hires;
+            for(uint32_t y = 0; y < DISPLAY_ROWS; y++)
+                for(uint32_t w = 0; w < DISPLAY_WORDS; w++)
+                    machine.display[0][y][w] = y & 1 ? 0xAAAAAAAAAAAAAAAAull : 0x5555555555555555ull;
+            snprintf(name, sizeof name, "redraw/%s/%s", renderers[r].name, hires ? "hires" : "lores");
+            bench_measure(&bench, name, "redraw", 0, bench_redraw, &work);
+        }
+        final_cleanup(work.sdl);
+    }
+
+    // full frames: every core on the built-in programs and the ROM, idle skipping as configured
+    work.config = config;
+    work.count = 60;
+    const uint64_t per_frame = config.clock_speed / 60;
+    for(size_t c = 0; c < sizeof cores / sizeof *cores; c++){
+        work.config.cpu_mode = cores[c].mode;
+        for(size_t p = 0; p < sizeof programs / sizeof *programs; p++){
+            bench_load(&work, programs[p].code, programs[p].length, config.quirks);
+            snprintf(name, sizeof name, "frame/%s/%s", programs[p].name, cores[c].name);
+            bench_measure(&bench, name, "frame", per_frame, bench_frames, &work);
+        }
+        if(rom.rom_name){
+            bench_load(&work, NULL, 0, config.quirks);
+            memcpy(machine.ram, rom.ram, sizeof machine.ram);
+            const char *base = strrchr(rom_name, '/');
+            snprintf(name, sizeof name, "frame/%s/%s", base ? base + 1 : rom_name, cores[c].name);
+            bench_measure(&bench, name, "frame", per_frame, bench_frames, &work);
+        }
+    }
+
+    // timers: the 60 Hz tick, beeper gate included
+    SDL_atomic_t gate;
+    bench_load(&work, bench_alu, 1, QUIRKS_CHIP8);
+    machine.beeper_gate = &gate;
+    work.count = 100000;
+    bench_measure(&bench, "timers/update", "tick", 0, bench_timers, &work);
+
+    bench_load(&work, bench_alu, 1, QUIRKS_CHIP8);     // frees the last code caches
+    return write_bench(&bench, config.bench);
+}
+#endif
+
+//main sequence
+int main(int argc, char **argv){
+    //Default usage message for args
+    if(argc < 2){
+        fprintf(stderr, "Usage: %s <rom_name> [options]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    //initialize configuration
+    config_t config = {0};
+    if(!set_config(&config, argc, argv)) exit(EXIT_FAILURE);
+
+    //Initialize CHIP8 machine
+    chip8_t chip8 = {0};
+    const char *rom_name = argv[1];
+#ifdef TRACE
+    if(config.decode_trace) exit(decode_trace(rom_name) ? EXIT_SUCCESS : EXIT_FAILURE);
+#endif
+#ifdef HAVE_LIBRARY
+    if(config.library) exit(run_library(rom_name, config) ? EXIT_SUCCESS : EXIT_FAILURE);
+#endif
+#ifdef HAVE_STREAM
+    if(config.play_stream) exit(play_stream(rom_name, config) ? EXIT_SUCCESS : EXIT_FAILURE);
+#endif
+    //Fuzzing loads its own machines, one per lane and CPU core
+    if(config.fuzz) exit(run_fuzz(rom_name, config) ? EXIT_SUCCESS : EXIT_FAILURE);
+#ifdef BENCH
+    //Benchmark builds only run the benchmarks, on machines of their own
+    exit(run_bench(rom_name, config) ? EXIT_SUCCESS : EXIT_FAILURE);
+#endif
+    if(!init_chip8(&chip8, rom_name)) exit(EXIT_FAILURE);
+
+    seed_random(&chip8, config.seed);
+    chip8.quirks = config.quirks;
+
+    //Static analysis, under the quirk profile the ROM runs with
+    if(config.analyze || config.print_cfg){
+        static analysis_t analysis;
+        analyze_code(&chip8, &analysis);
+        if(config.print_cfg){
+            print_cfg(&chip8, &analysis);
+            exit(EXIT_SUCCESS);
+        }
+        print_analysis(&analysis);
+        chip8.data_pages = data_pages(&analysis);
+        // batch instances and sessions start from empty code caches of their own
+        if(!config.batch_size && !config.serve_port) precompile_code(&chip8, config, &analysis);
+    }
+
+#ifdef PROFILE
+    //Profile single machine runs, batch instances are left alone
+    static profile_t profile;
+    if(!config.batch_size) chip8.profile = &profile;
+#endif
+#ifdef TRACE
+    //Trace single machine runs, batch instances are left alone
+    static trace_t trace;
+    if(!config.batch_size && !start_trace(&chip8, &trace)) exit(EXIT_FAILURE);
+#endif
+
+#ifdef HAVE_SERVER
+    //Servers load the ROM once and copy it into every session
+    if(config.serve_port) exit(run_server(&chip8, config) ? EXIT_SUCCESS : EXIT_FAILURE);
+#endif
+
+    //Batch runs load the ROM once and copy it into every instance
+    if(config.batch_size){
+        exit(run_batch(&chip8, config, false) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    //Replays run headless and report whether they reproduced the recording
+    if(config.replay){
+        const bool matched = run_replay(&chip8, config);
+#ifdef PROFILE
+        write_profile(&chip8, config);
+#endif
+        exit(matched ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+#ifdef HAVE_STREAM
+    //Frame stream, every finished frame is written to it
+    if(config.stream && !(chip8.stream = open_stream(config.stream))) exit(EXIT_FAILURE);
+#endif
+
+    //Headless runs never touch SDL video
+    if(config.headless){
+        run_headless(&chip8, config);
+#ifdef HAVE_STREAM
+        if(chip8.stream) close_stream(chip8.stream);
+#endif
+#ifdef PROFILE
+        if(!write_profile(&chip8, config)) exit(EXIT_FAILURE);
+#endif
+        exit(EXIT_SUCCESS);
+    }
+
+    //Initialize SDL
+    sdl_t sdl = {0};
+    if(!init_sdl(&sdl, config)) exit(EXIT_FAILURE);
+
+    //Initial screen clear to background color
+    clear_screen(config, sdl);
+
+    //Let the timers drive the beeper
+    if(sdl.beeper) chip8.beeper_gate = &sdl.beeper->gate;
+
+    //Rewind history, about half a megabyte
+    rewind_t *rewind = NULL;
+    if(config.rewind && !(rewind = calloc(1, sizeof *rewind)))
+        SDL_Log("Could not allocate the rewind history, running without it\n");
+
+    //Keypad log for --replay
+    input_log_t log, *record = NULL;
+    if(config.record){
+        if(!open_recording(&log, config.record, config)) exit(EXIT_FAILURE);
+        record = &log;
+    }
+
+    //Emulate on a separate thread if asked to, the loop below is the fallback
+    if(config.emu_thread && run_threaded(&chip8, config, sdl, rewind, record)){
+        if(config.input_latency) print_latency(&chip8.latency);
+#ifdef PROFILE
+        write_profile(&chip8, config);
+#endif
+#ifdef HAVE_STREAM
+        if(chip8.stream) close_stream(chip8.stream);
+#endif
+        free(rewind);
+        final_cleanup(sdl);
+        exit(EXIT_SUCCESS);
+    }
+
+    //Main emulator loop
+    scheduler_t sched;
+    init_scheduler(&sched, config, sdl, rewind, record);
+    while (chip8.state != QUIT){
+        //Handle user input
+        handle_input(&chip8);
+        if(chip8.hotkeys & HOTKEY_TURBO) set_turbo(&sched, !sched.turbo);
+        handle_hotkeys(&chip8, chip8.hotkeys, record);
+        chip8.hotkeys = 0;
+        const bool away = in_background(&chip8, config);
+        if(chip8.state == PAUSED || (away && config.background == BACKGROUND_PAUSE)){
+            if(chip8.beeper_gate) SDL_AtomicSet(chip8.beeper_gate, 0);
+            //show what an expose lost, then sleep until the next event
+            if(chip8.draw && !(chip8.window & WINDOW_HIDDEN)) redraw_screen(sdl, config, &chip8);
+            wait_for_event();
+            reset_scheduler(&sched);
+            continue;
+        }
+        //out of sight presents stop pacing the loop, only frames that changed are presented
+        set_background(&sched, away);
+        sdl_t shown = sdl;
+        shown.vsync = sdl.vsync && !away;
+        //Emulate up to now, and present once a frame (and its timer ticks) is complete
+        if((run_scheduled_frames(&chip8, config, &sched) || shown.vsync) && !(chip8.window & WINDOW_HIDDEN)){
+            //run ahead to present the frames the keys held now lead to, not fast-forwarding or rewinding
+            static run_ahead_t saved;
+            const bool ahead = config.run_ahead && !sched.turbo && !sched.rewinding;
+            if(ahead) begin_run_ahead(&chip8, config, &sched, &saved);
+            //update window if anything was drawn since the last frame
+            redraw_screen(shown , config , &chip8);
+            measure_latency(&chip8);
+            if(ahead) end_run_ahead(&chip8, &saved);
+        }
+
+        //sleep until the next frame is due
+        wait_next_frame(&sched, shown);
+    }
+
+    //Final cleanup
+    if(record) close_recording(record, &chip8, sched.cycles);
+    if(config.input_latency) print_latency(&chip8.latency);
+#ifdef PROFILE
+    write_profile(&chip8, config);
+#endif
+#ifdef HAVE_STREAM
+    if(chip8.stream) close_stream(chip8.stream);
+#endif
+    free(rewind);
     final_cleanup(sdl);
     exit(EXIT_SUCCESS);
     return 0;